@@ -1,3 +1,8 @@
+#include <algorithm>
+#include <iterator>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
 #include "block.h"
 using namespace cow_block;
 
@@ -98,35 +103,362 @@ std::string cow_block::bin2hex(const std::vector < char > & vec)
     return result;
 }
 
-block_manager::block_manager(std::string data_dir, const uint64_t blk_sz)
-    : data_dir(std::move(data_dir)), block_size(blk_sz)
+[[nodiscard]] uint64_t cow_block::block_id_from_name(const std::string & name)
 {
-    const std::vector<uint8_t> data(block_size, 0);
-    zero_pointer_name = bin2hex(hashcrc64(data));
-    mkdir_p(data_dir);
+    uint64_t block_id = 0;
+    if (name.size() != sizeof(block_id) * 2) {
+        throw block_manager_invalid_argument("Invalid block name \"" + name + "\"");
+    }
+
+    auto nibble = [&](const char hex) -> uint8_t
+    {
+        for (size_t i = 0; i < sizeof(hex_table); i += 2) {
+            if (hex_table[i] == std::tolower(hex)) {
+                return hex_table[i + 1];
+            }
+        }
+
+        throw block_manager_invalid_argument("Invalid block name \"" + name + "\"");
+    };
+
+    uint8_t bytes[sizeof(block_id)];
+    for (size_t i = 0; i < sizeof(block_id); i++) {
+        bytes[i] = static_cast<uint8_t>(nibble(name[i * 2]) << 4 | nibble(name[i * 2 + 1]));
+    }
+
+    std::memcpy(&block_id, bytes, sizeof(block_id));
+    return block_id;
+}
+
+block_manager::block_manager(std::string data_dir, const uint64_t blk_sz, const journal_mode_t mode)
+    : data_dir(std::move(data_dir)), tmp_dir(this->data_dir + "/.tmp"), block_size(blk_sz), journal_mode(mode)
+{
+    for (uint64_t size = block_size; zero_block_ids.empty() || size <= max_class_size; size <<= 1)
+    {
+        const std::vector<uint8_t> data(size, 0);
+        zero_block_ids.push_back(hashcrc64(data));
+    }
+    mkdir_p(this->data_dir);
+
+    // whatever is left here was never renamed into place, i.e., never referenced
+    std::filesystem::remove_all(tmp_dir);
+    mkdir_p(tmp_dir);
+}
+
+[[nodiscard]] std::string block_manager::make_tmp_path() const
+{
+    return tmp_dir + "/" + std::to_string(tmp_serial.fetch_add(1, std::memory_order_relaxed));
 }
 
-void block_manager::write_in_block(const std::vector < uint8_t > & data) const
+bool block_manager::store_file(const std::string & path_name, const std::vector < uint8_t > & data,
+    const bool exclusive) const
 {
-    if (data.size() != block_size) {
-        throw block_manager_invalid_argument("Data size is not equal to block size");
+    const std::string tmp_path = make_tmp_path();
+    const int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        easy_throw_except(write_into_data_block_failed, "Cannot create data block " + tmp_path);
+    }
+
+    uint64_t done = 0;
+    while (done < data.size())
+    {
+        const ssize_t written = ::write(fd, data.data() + done, data.size() - done);
+        if (written <= 0)
+        {
+            ::close(fd);
+            std::filesystem::remove(tmp_path);
+            easy_throw_except(write_into_data_block_failed, "Short write on data block " + path_name);
+        }
+        done += static_cast<uint64_t>(written);
+    }
+    ::close(fd);
+
+    if (!exclusive)
+    {
+        std::filesystem::rename(tmp_path, path_name);
+        return true;
     }
 
-    const std::string file_name = bin2hex(hashcrc64(data));
+    // one rename that refuses to replace, or a link and an unlink where that is unsupported
+    if (::renameat2(AT_FDCWD, tmp_path.c_str(), AT_FDCWD, path_name.c_str(), RENAME_NOREPLACE) == 0) {
+        return true;
+    }
+
+    bool stored = false;
+    if (errno == EINVAL || errno == ENOSYS) {
+        stored = ::link(tmp_path.c_str(), path_name.c_str()) == 0;
+    }
+
+    const int error = errno;
+    std::filesystem::remove(tmp_path);
+    if (!stored && error != EEXIST) {
+        easy_throw_except(write_into_data_block_failed, "Cannot store data block " + path_name + ": " + strerror(error));
+    }
+    return stored;
+}
+
+uint64_t block_manager::write_in_block(const std::vector < uint8_t > & data, write_outcome_t * outcome) const
+{
+    const auto size_class = size_class_of(data.size());
+    if (!size_class) {
+        throw block_manager_invalid_argument("Data size is not the size of a block size class");
+    }
+
+    const uint64_t block_id = hashcrc64(data);
+    const std::string file_name = bin2hex(block_id);
+
+    write_outcome_t result { .existed = true, .compressed = false };
+    if (outcome == nullptr) {
+        outcome = &result;
+    }
+    *outcome = result;
 
     // skip writes for full zeros
-    if (file_name == zero_pointer_name)
+    if (block_id == zero_block_ids[*size_class])
     {
-        return;
+        return block_id;
     }
 
     const std::string path_name = data_dir + "/" + file_name;
-    write_into(file_name, data);
+    if (std::filesystem::exists(path_name))
+    {
+        return block_id;
+    }
+
+    outcome->existed = false;
+    std::vector < uint8_t > compressed(LZ4_compressBound(static_cast<int>(data.size())));
+    const int compressed_size = LZ4_compress_default(
+        reinterpret_cast<const char*>(data.data()), reinterpret_cast<char*>(compressed.data()),
+        static_cast<int>(data.size()), static_cast<int>(compressed.size()));
+    if (compressed_size > 0 && static_cast<uint64_t>(compressed_size) <= data.size() - data.size() / 8)
+    {
+        compressed.resize(compressed_size);
+        store_file(path_name, compressed, false);
+        outcome->compressed = true;
+    }
+    else
+    {
+        store_file(path_name, data, false);
+    }
+
+    track_pending(path_name);
+    return block_id;
+}
+
+uint64_t block_manager::write_in_block_raw(const std::vector < uint8_t > & data) const
+{
+    const auto size_class = size_class_of(data.size());
+    if (!size_class) {
+        throw block_manager_invalid_argument("Data size is not the size of a block size class");
+    }
+
+    const uint64_t block_id = hashcrc64(data);
+    if (block_id == zero_block_ids[*size_class]) {
+        return block_id;
+    }
+
+    const std::string path_name = data_dir + "/" + bin2hex(block_id);
+    if (!store_file(path_name, data, true)) {
+        return block_id;
+    }
+
+    track_pending(path_name);
+    return block_id;
+}
+
+void block_manager::track_pending(const std::string & path_name) const
+{
+    if (journal_mode == JOURNAL_ORDERED)
+    {
+        std::lock_guard lock(pending_mutex);
+        pending_sync.push_back(path_name);
+    }
+}
+
+bool block_manager::clone_in_block(const uint64_t block_id, const int source_fd, const uint64_t source_offset,
+    const uint8_t size_class) const
+{
+    if (block_id == get_zero_block_id(size_class)) {
+        return true;
+    }
+
+    const std::string path_name = data_dir + "/" + bin2hex(block_id);
+    if (std::filesystem::exists(path_name)) {
+        return true;
+    }
+    if (!clone_supported && !copy_range_supported) {
+        return false;
+    }
+
+    // not supported here, as opposed to failed
+    const auto unsupported = [](const int error) {
+        return error == EOPNOTSUPP || error == ENOTTY || error == EXDEV || error == EINVAL || error == ENOSYS;
+    };
+
+    const std::string tmp_path = make_tmp_path();
+    const int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        easy_throw_except(write_into_data_block_failed, "Cannot create data block " + tmp_path);
+    }
+
+    const uint64_t length = get_block_size(size_class);
+    bool stored = false;
+    if (clone_supported)
+    {
+        const file_clone_range range {
+            .src_fd = source_fd,
+            .src_offset = source_offset,
+            .src_length = length,
+            .dest_offset = 0,
+        };
+        if (::ioctl(fd, FICLONERANGE, &range) == 0) {
+            stored = true;
+        } else if (unsupported(errno)) {
+            clone_supported = false;
+            debug_log("FICLONERANGE into ", data_dir, " unsupported: ", strerror(errno), "\n");
+        }
+    }
+
+    if (!stored && copy_range_supported)
+    {
+        auto input_offset = static_cast<off64_t>(source_offset);
+        uint64_t done = 0;
+        while (done < length)
+        {
+            const ssize_t copied = ::copy_file_range(source_fd, &input_offset, fd, nullptr, length - done, 0);
+            if (copied <= 0)
+            {
+                if (copied < 0 && unsupported(errno) && done == 0) {
+                    copy_range_supported = false;
+                    debug_log("copy_file_range() into ", data_dir, " unsupported: ", strerror(errno), "\n");
+                }
+                break;
+            }
+            done += static_cast<uint64_t>(copied);
+        }
+        stored = done == length;
+    }
+
+    ::close(fd);
+    if (!stored)
+    {
+        std::filesystem::remove(tmp_path);
+        return false;
+    }
+
+    std::filesystem::rename(tmp_path, path_name);
+    track_pending(path_name);
+    return true;
+}
+
+[[nodiscard]] std::vector < uint8_t > block_manager::read_block(const uint64_t block_id, const uint8_t size_class) const
+{
+    const uint64_t size = get_block_size(size_class);
+    if (block_id == get_zero_block_id(size_class)) {
+        return std::vector < uint8_t > (size, 0);
+    }
+
+    const std::string path_name = data_dir + "/" + bin2hex(block_id);
+    std::ifstream file(path_name, std::ios::binary | std::ios::ate);
+    if (const int error = errno; !file)
+    {
+        if (error == ENOENT) {
+            easy_throw_except(block_corrupted, "Missing data block " + path_name);
+        }
+        easy_throw_except(read_from_data_block_failed, "Cannot open data block " + path_name + ": " + strerror(error));
+    }
+
+    const auto stored_size = static_cast<uint64_t>(file.tellg());
+    if (stored_size > size) {
+        easy_throw_except(block_corrupted, "Oversized data block " + path_name);
+    }
+
+    std::vector < uint8_t > stored(stored_size);
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(stored.data()), static_cast<ssize_t>(stored_size));
+    if (static_cast<uint64_t>(file.gcount()) != stored_size) {
+        easy_throw_except(block_corrupted, "Short read on data block " + path_name);
+    }
+
+    if (stored_size == size) {
+        return stored;
+    }
+
+    std::vector < uint8_t > data(size);
+    if (LZ4_decompress_safe(reinterpret_cast<const char*>(stored.data()), reinterpret_cast<char*>(data.data()),
+            static_cast<int>(stored_size), static_cast<int>(size)) != static_cast<int>(size))
+    {
+        easy_throw_except(block_corrupted, "Cannot decompress data block " + path_name);
+    }
+
+    return data;
+}
+
+[[nodiscard]] int block_manager::open_raw_block(const uint64_t block_id, const uint8_t size_class) const
+{
+    if (block_id == get_zero_block_id(size_class)) {
+        return -1;
+    }
+
+    const std::string path_name = data_dir + "/" + bin2hex(block_id);
+    const int fd = ::open(path_name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT) {
+        easy_throw_except(block_corrupted, "Missing data block " + path_name);
+    }
+    if (fd < 0) {
+        return -1;  // e.g. out of descriptors, read_block() gets the content without keeping one
+    }
+
+    if (struct stat st { }; fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) != get_block_size(size_class))
+    {
+        ::close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+[[nodiscard]] bool block_manager::has_block(const uint64_t block_id) const
+{
+    return std::ranges::find(zero_block_ids, block_id) != zero_block_ids.end()
+        || std::filesystem::exists(data_dir + "/" + bin2hex(block_id));
+}
+
+void block_manager::flush() const
+{
+    std::vector < std::string > pending;
+    {
+        std::lock_guard lock(pending_mutex);
+        pending.swap(pending_sync);
+    }
+
+    if (pending.empty()) {
+        return;
+    }
+
+    for (const auto & path : pending)
+    {
+        if (!sync_path(path)) {
+            easy_throw_except(write_into_data_block_failed, "Failed to flush data block " + path);
+        }
+    }
+
+    // new blocks are new directory entries as well
+    if (!sync_path(data_dir)) {
+        easy_throw_except(write_into_data_block_failed, "Failed to flush data directory " + data_dir);
+    }
 }
 
 void block_manager::set_block_attribute(const std::string & block_name, const block_attribute_t& attributes) const
 {
-    write_pod(data_dir + "/" + block_name + ".attr", attributes);
+    replace_into(data_dir + "/" + block_name + ".attr",
+        std::vector<uint8_t>(
+            reinterpret_cast<const uint8_t*>(&attributes),
+            reinterpret_cast<const uint8_t*>(&attributes) + sizeof(attributes)));
+    if (journal_mode == JOURNAL_ORDERED)
+    {
+        std::lock_guard lock(pending_mutex);
+        pending_sync.push_back(data_dir + "/" + block_name + ".attr");
+    }
 }
 
 [[nodiscard]] block_attribute_t block_manager::get_block_attribute(const std::string & block_name) const
@@ -137,9 +469,188 @@ void block_manager::set_block_attribute(const std::string & block_name, const bl
     return attr;
 }
 
-[[nodiscard]] uint64_t block_manager::get_block_size() const
+[[nodiscard]] uint64_t block_manager::get_block_size(const uint8_t size_class) const
+{
+    return block_size << size_class;
+}
+
+[[nodiscard]] uint64_t block_manager::get_zero_block_id(const uint8_t size_class) const
+{
+    if (size_class >= zero_block_ids.size()) {
+        throw block_manager_invalid_argument("No block size class " + std::to_string(size_class));
+    }
+    return zero_block_ids[size_class];
+}
+
+[[nodiscard]] std::optional < uint8_t > block_manager::size_class_of(const uint64_t size) const
+{
+    for (uint8_t size_class = 0; size_class < zero_block_ids.size(); size_class++)
+    {
+        if (get_block_size(size_class) == size) {
+            return size_class;
+        }
+    }
+    return std::nullopt;
+}
+
+[[nodiscard]] std::string block_manager::get_data_dir() const
+{
+    return data_dir;
+}
+
+[[nodiscard]] bool block_manager::verify_block(const std::string & block_name) const
 {
-    return block_size;
+    const uint64_t block_id = block_id_from_name(block_name);
+    std::ifstream file(data_dir + "/" + block_name, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+
+    // the class is not known here: a file of a class size may be a raw block, any file may be a compressed one
+    const std::vector < uint8_t > stored((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (size_class_of(stored.size()) && hashcrc64(stored) == block_id) {
+        return true;
+    }
+
+    std::vector < uint8_t > data(std::max(max_class_size, block_size));
+    const int size = LZ4_decompress_safe(reinterpret_cast<const char*>(stored.data()), reinterpret_cast<char*>(data.data()),
+        static_cast<int>(stored.size()), static_cast<int>(data.size()));
+    if (size <= 0 || !size_class_of(static_cast<uint64_t>(size))) {
+        return false;
+    }
+
+    data.resize(size);
+    return hashcrc64(data) == block_id;
+}
+
+log_manager::log_manager(std::string log_dir, const journal_mode_t mode)
+    : log_dir(std::move(log_dir)), journal_mode(mode)
+{
+    mkdir_p(this->log_dir);
+
+    // continue the sequence after the last intact record
+    scan(0, [&](const log_t & log, uint64_t) -> bool
+    {
+        if (!is_valid(log) || log.sequence < next_sequence) {
+            return false;
+        }
+
+        next_sequence = log.sequence + 1;
+        clock.advance_to(log.timestamp);
+        return true;
+    });
+}
+
+[[nodiscard]] uint64_t log_manager::checksum_of(log_t log)
+{
+    log.checksum = 0;
+    return hashcrc64(log);
+}
+
+[[nodiscard]] bool log_manager::is_valid(const log_t & log)
+{
+    return log.checksum == checksum_of(log);
+}
+
+uint64_t log_manager::scan(uint64_t offset, const std::function<bool(const log_t &, uint64_t)> & callback) const
+{
+    std::ifstream file(log_dir + "/log", std::ios::binary);
+    if (!file)
+    {
+        return offset;
+    }
+
+    file.seekg(static_cast<ssize_t>(offset));
+    log_t log { };
+    while (file.read(reinterpret_cast<char*>(&log), sizeof(log)))
+    {
+        if (!callback(log, offset)) {
+            break;
+        }
+
+        offset += sizeof(log);
+    }
+
+    return offset;
+}
+
+void log_manager::discard_after(const uint64_t offset) const
+{
+    std::lock_guard lock(append_mutex);
+    if (const std::string path = log_dir + "/log";
+        std::filesystem::exists(path) && std::filesystem::file_size(path) > offset)
+    {
+        std::filesystem::resize_file(path, offset);
+    }
+}
+
+void log_manager::set_commit_barrier(std::function<void()> barrier)
+{
+    commit_barrier = std::move(barrier);
+}
+
+void log_manager::commit() const
+{
+    if (commit_barrier) {
+        commit_barrier();
+    }
+
+    append_log(LOG_COMMIT);
+    sync();
+}
+
+void log_manager::sync() const
+{
+    if (journal_mode != JOURNAL_UNSAFE && !sync_path(log_dir + "/log"))
+    {
+        easy_throw_except(log_io_failed, "Failed to flush log file");
+    }
+}
+
+void log_manager::append_raw(const log_t & log) const
+{
+    if (!is_valid(log)) {
+        easy_throw_except(log_io_failed, "Refusing to append a corrupted record");
+    }
+
+    std::lock_guard lock(append_mutex);
+    if (log.sequence < next_sequence) {
+        easy_throw_except(log_io_failed, "Record " + std::to_string(log.sequence) + " is already in the journal");
+    }
+
+    std::ofstream file(log_dir + "/log", std::ios::binary | std::ios::app);
+    if (!file)
+    {
+        easy_throw_except(log_io_failed, "Failed to open log file");
+    }
+    file.write(reinterpret_cast<const char*>(&log), sizeof(log));
+    next_sequence = log.sequence + 1;
+    clock.advance_to(log.timestamp);
+}
+
+[[nodiscard]] uint64_t log_manager::last_committed_sequence() const
+{
+    uint64_t last_commit = 0;
+    uint64_t last_sequence = 0;
+    scan(0, [&](const log_t & log, uint64_t) -> bool
+    {
+        if (!is_valid(log) || log.sequence <= last_sequence) {
+            return false;
+        }
+
+        last_sequence = log.sequence;
+        if (log.action == LOG_COMMIT) {
+            last_commit = log.sequence;
+        }
+        return true;
+    });
+
+    return last_commit;
+}
+
+[[nodiscard]] std::string log_manager::get_log_path() const
+{
+    return log_dir + "/log";
 }
 
 void log_manager::trunc_log(uint64_t time_point) const
@@ -175,12 +686,19 @@ void log_manager::append_log(const uint64_t action,
             const uint64_t param6,
             const uint64_t param7) const
 {
-    log_t log { };
-    if (timespec_get(&log.timestamp, TIME_UTC) == 0)
-    {
-        warning_log("Failed to get current time for log\n");
-    }
+    append_logs({ make_log(action, param1, param2, param3, param4, param5, param6, param7) });
+}
 
+[[nodiscard]] log_manager::log_t log_manager::make_log(const uint64_t action,
+            const uint64_t param1,
+            const uint64_t param2,
+            const uint64_t param3,
+            const uint64_t param4,
+            const uint64_t param5,
+            const uint64_t param6,
+            const uint64_t param7)
+{
+    log_t log { };
     log.params.generic.param1 = param1;
     log.params.generic.param2 = param2;
     log.params.generic.param3 = param3;
@@ -189,12 +707,31 @@ void log_manager::append_log(const uint64_t action,
     log.params.generic.param6 = param6;
     log.params.generic.param7 = param7;
     log.action = action;
+    return log;
+}
+
+void log_manager::append_logs(std::vector < log_t > logs) const
+{
+    if (logs.empty()) {
+        return;
+    }
+
+    // timestamps are taken under the append lock, so file order, sequence order and time order agree
+    std::lock_guard lock(append_mutex);
+    const uint64_t base = clock.reserve(logs.size());
+    for (uint64_t i = 0; i < logs.size(); i++)
+    {
+        logs[i].timestamp = journal_clock::to_timespec(base + i);
+        logs[i].sequence = next_sequence++;
+        logs[i].checksum = checksum_of(logs[i]);
+    }
+
     std::ofstream file(log_dir + "/log", std::ios::binary | std::ios::app);
     if (!file)
     {
         easy_throw_except(log_io_failed, "Failed to open log file");
     }
-    file.write(reinterpret_cast<const char*>(&log), sizeof(log));
+    file.write(reinterpret_cast<const char*>(logs.data()), static_cast<ssize_t>(logs.size() * sizeof(log_t)));
     file.close();
 }
 
@@ -0,0 +1,335 @@
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include "block_map.h"
+using namespace cow_block;
+
+block_map::block_map(const block_id_t zero_block) : zero_block(zero_block)
+{
+}
+
+[[nodiscard]] uint64_t block_map::span_of(const uint64_t level)
+{
+    return 1ULL << (fanout_shift * level);
+}
+
+[[nodiscard]] uint64_t block_map::capacity() const
+{
+    return height == 0 ? 0 : span_of(height);
+}
+
+[[nodiscard]] uint32_t block_map::alloc_node()
+{
+    if (!free_nodes.empty())
+    {
+        const uint32_t node = free_nodes.back();
+        free_nodes.pop_back();
+        nodes[node] = node_t { };
+        return node;
+    }
+
+    nodes.emplace_back();
+    return static_cast<uint32_t>(nodes.size() - 1);
+}
+
+void block_map::free_subtree(const uint32_t node, const uint64_t level)
+{
+    if (level != 0)
+    {
+        for (uint64_t bitmap = nodes[node].child_bitmap; bitmap != 0; bitmap &= bitmap - 1) {
+            free_subtree(static_cast<uint32_t>(nodes[node].slots[std::countr_zero(bitmap)]), level - 1);
+        }
+    }
+
+    free_nodes.push_back(node);
+}
+
+void block_map::grow_to(const uint64_t index)
+{
+    while (index >= capacity())
+    {
+        if (height == max_height) {
+            easy_throw_except(block_map_out_of_range, "Logical block " + std::to_string(index) + " is out of range");
+        }
+
+        const uint32_t new_root = alloc_node();
+        if (root != no_node)
+        {
+            nodes[new_root].child_bitmap = 1;
+            nodes[new_root].slots[0] = root;
+        }
+
+        root = new_root;
+        height++;
+    }
+}
+
+void block_map::collapse(const uint32_t parent, const uint64_t slot)
+{
+    const auto child = static_cast<uint32_t>(nodes[parent].slots[slot]);
+    const node_t & node = nodes[child];
+    if (node.child_bitmap != 0) {
+        return;
+    }
+
+    const uint64_t bit = 1ULL << slot;
+    if (node.extent_bitmap == 0)
+    {
+        free_nodes.push_back(child);
+        nodes[parent].child_bitmap &= ~bit;
+        nodes[parent].slots[slot] = 0;
+        return;
+    }
+
+    if (node.extent_bitmap == UINT64_MAX
+        && std::all_of(std::begin(node.slots), std::end(node.slots),
+            [&](const uint64_t value) { return value == node.slots[0]; }))
+    {
+        const uint64_t value = node.slots[0];
+        free_nodes.push_back(child);
+        nodes[parent].child_bitmap &= ~bit;
+        nodes[parent].extent_bitmap |= bit;
+        nodes[parent].slots[slot] = value;
+    }
+}
+
+void block_map::assign(const uint32_t node, const uint64_t level, const uint64_t base,
+    const uint64_t first, const uint64_t last, const std::optional < block_id_t > value)
+{
+    const uint64_t span = span_of(level);
+    const uint64_t first_slot = (std::max(first, base) - base) / span;
+    const uint64_t last_slot = (std::min(last, base + span * fanout - 1) - base) / span;
+
+    for (uint64_t slot = first_slot; slot <= last_slot; slot++)
+    {
+        const uint64_t bit = 1ULL << slot;
+        const uint64_t slot_first = base + slot * span;
+        const uint64_t slot_last = slot_first + span - 1;
+
+        if (first <= slot_first && slot_last <= last)
+        {
+            // fully covered, whatever was below is replaced
+            if (nodes[node].child_bitmap & bit)
+            {
+                free_subtree(static_cast<uint32_t>(nodes[node].slots[slot]), level - 1);
+                nodes[node].child_bitmap &= ~bit;
+            }
+
+            if (value)
+            {
+                nodes[node].extent_bitmap |= bit;
+                nodes[node].slots[slot] = *value;
+            }
+            else
+            {
+                nodes[node].extent_bitmap &= ~bit;
+                nodes[node].slots[slot] = 0;
+            }
+            continue;
+        }
+
+        // partially covered, split the slot into a child first
+        if (!(nodes[node].child_bitmap & bit))
+        {
+            const uint32_t child = alloc_node();
+            if (nodes[node].extent_bitmap & bit)
+            {
+                nodes[child].extent_bitmap = UINT64_MAX;
+                std::fill(std::begin(nodes[child].slots), std::end(nodes[child].slots), nodes[node].slots[slot]);
+            }
+
+            nodes[node].extent_bitmap &= ~bit;
+            nodes[node].child_bitmap |= bit;
+            nodes[node].slots[slot] = child;
+        }
+
+        assign(static_cast<uint32_t>(nodes[node].slots[slot]), level - 1, slot_first, first, last, value);
+        collapse(node, slot);
+    }
+}
+
+[[nodiscard]] std::optional < block_map::block_id_t > block_map::lookup(const uint64_t index) const
+{
+    if (index >= capacity()) {
+        return std::nullopt;
+    }
+
+    uint32_t node = root;
+    for (uint64_t level = height - 1; ; level--)
+    {
+        const uint64_t slot = index >> (fanout_shift * level) & (fanout - 1);
+        const uint64_t bit = 1ULL << slot;
+        const node_t & current = nodes[node];
+        if (current.extent_bitmap & bit) {
+            return current.slots[slot];
+        }
+
+        if (!(current.child_bitmap & bit)) {
+            return std::nullopt;
+        }
+
+        node = static_cast<uint32_t>(current.slots[slot]);
+    }
+}
+
+[[nodiscard]] std::optional < uint64_t > block_map::find(const uint32_t node, const uint64_t level, const uint64_t base,
+    const uint64_t from, const std::function<bool(std::optional < block_id_t >)> & match) const
+{
+    const uint64_t span = span_of(level);
+    for (uint64_t slot = from > base ? (from - base) / span : 0; slot < fanout; slot++)
+    {
+        const uint64_t bit = 1ULL << slot;
+        const uint64_t slot_first = base + slot * span;
+        const node_t & current = nodes[node];
+        if (current.extent_bitmap & bit)
+        {
+            if (match(current.slots[slot])) {
+                return std::max(from, slot_first);
+            }
+        }
+        else if (current.child_bitmap & bit)
+        {
+            if (const auto found = find(static_cast<uint32_t>(current.slots[slot]), level - 1, slot_first, from, match)) {
+                return found;
+            }
+        }
+        else if (match(std::nullopt))
+        {
+            return std::max(from, slot_first);
+        }
+    }
+    return std::nullopt;
+}
+
+[[nodiscard]] std::optional < uint64_t > block_map::find_next(const uint64_t index,
+    const std::function<bool(std::optional < block_id_t >)> & match) const
+{
+    // every block past capacity is a hole
+    if (index >= capacity()) {
+        return match(std::nullopt) ? std::optional < uint64_t > (index) : std::nullopt;
+    }
+    if (const auto found = find(root, height - 1, 0, index, match)) {
+        return found;
+    }
+    return match(std::nullopt) ? std::optional < uint64_t > (capacity()) : std::nullopt;
+}
+
+void block_map::set(const uint64_t index, const block_id_t block)
+{
+    set_range(index, 1, block);
+}
+
+void block_map::set_range(const uint64_t first, const uint64_t count, const block_id_t block)
+{
+    if (count == 0) {
+        return;
+    }
+
+    if (block == zero_block)
+    {
+        punch(first, count);
+        return;
+    }
+
+    const uint64_t last = first + count - 1;
+    grow_to(last);
+    assign(root, height - 1, 0, first, last, block);
+}
+
+void block_map::punch(const uint64_t first, const uint64_t count)
+{
+    if (count == 0 || first >= capacity()) {
+        return;
+    }
+
+    const uint64_t last = std::min(first + count - 1, capacity() - 1);
+    assign(root, height - 1, 0, first, last, std::nullopt);
+    if (nodes[root].child_bitmap == 0 && nodes[root].extent_bitmap == 0)
+    {
+        nodes.clear();
+        free_nodes.clear();
+        root = no_node;
+        height = 0;
+    }
+}
+
+void block_map::truncate(const uint64_t first)
+{
+    if (first < capacity()) {
+        punch(first, capacity() - first);
+    }
+}
+
+void block_map::walk(const uint32_t node, const uint64_t level, const uint64_t base,
+    const std::function<void(uint64_t, uint64_t, block_id_t)> & callback) const
+{
+    const uint64_t span = span_of(level);
+    const node_t & current = nodes[node];
+    for (uint64_t bitmap = current.child_bitmap | current.extent_bitmap; bitmap != 0; bitmap &= bitmap - 1)
+    {
+        const auto slot = static_cast<uint64_t>(std::countr_zero(bitmap));
+        if (current.extent_bitmap & 1ULL << slot) {
+            callback(base + slot * span, span, current.slots[slot]);
+        } else {
+            walk(static_cast<uint32_t>(current.slots[slot]), level - 1, base + slot * span, callback);
+        }
+    }
+}
+
+void block_map::for_each_extent(const std::function<void(const extent_t &)> & callback) const
+{
+    if (root == no_node) {
+        return;
+    }
+
+    std::optional < extent_t > pending;
+    walk(root, height - 1, 0, [&](const uint64_t first, const uint64_t count, const block_id_t block)
+    {
+        if (pending && pending->block == block && pending->first + pending->count == first)
+        {
+            pending->count += count;
+            return;
+        }
+
+        if (pending) {
+            callback(*pending);
+        }
+        pending = extent_t { .first = first, .count = count, .block = block };
+    });
+
+    if (pending) {
+        callback(*pending);
+    }
+}
+
+[[nodiscard]] std::vector < uint8_t > block_map::serialize() const
+{
+    std::vector < extent_t > extents;
+    for_each_extent([&](const extent_t & extent) { extents.push_back(extent); });
+
+    std::vector < uint8_t > data(extents.size() * sizeof(extent_t));
+    std::memcpy(data.data(), extents.data(), data.size());
+    return data;
+}
+
+[[nodiscard]] block_map block_map::deserialize(const std::vector < uint8_t > & data, const block_id_t zero_block)
+{
+    if (data.size() % sizeof(extent_t) != 0) {
+        easy_throw_except(block_map_corrupted, "Serialized block map has a partial extent");
+    }
+
+    block_map map(zero_block);
+    for (uint64_t offset = 0; offset < data.size(); offset += sizeof(extent_t))
+    {
+        extent_t extent { };
+        std::memcpy(&extent, data.data() + offset, sizeof(extent));
+        map.set_range(extent.first, extent.count, extent.block);
+    }
+
+    return map;
+}
+
+[[nodiscard]] uint64_t block_map::node_count() const
+{
+    return nodes.size() - free_nodes.size();
+}
@@ -0,0 +1,384 @@
+#include <algorithm>
+#include "cow_btree.h"
+using namespace cow_block;
+
+namespace
+{
+    // on-disk node: header, then per entry either (key, value length, value) for leaves or
+    // (key, child block id) for inner nodes, zero padded to block_size
+    struct node_header_t
+    {
+        uint32_t magic;
+        uint16_t level;
+        uint16_t count;
+    };
+    constexpr uint32_t node_magic = 0x444E5442; // "BTND"
+    constexpr uint64_t leaf_entry_overhead = sizeof(uint64_t) + sizeof(uint16_t);
+    constexpr uint64_t inner_entry_size = sizeof(uint64_t) * 2;
+
+    template < typename Type >
+    void put_pod(std::vector < uint8_t > & buffer, uint64_t & offset, const Type & value)
+    {
+        std::memcpy(buffer.data() + offset, &value, sizeof(value));
+        offset += sizeof(value);
+    }
+
+    template < typename Type >
+    Type get_pod(const std::vector < uint8_t > & buffer, uint64_t & offset)
+    {
+        Type value { };
+        if (offset + sizeof(value) > buffer.size()) {
+            easy_throw_except(btree_corrupted, "Node entry runs past the block");
+        }
+        std::memcpy(&value, buffer.data() + offset, sizeof(value));
+        offset += sizeof(value);
+        return value;
+    }
+}
+
+cow_btree::cow_btree(const block_manager & blocks, buffer_pool & pool, const log_manager * journal)
+    : blocks(blocks), pool(pool), journal(journal), block_size(blocks.get_block_size()),
+      max_value_size((blocks.get_block_size() - sizeof(node_header_t)) / 4 - leaf_entry_overhead)
+{
+    cow_assert_wm(block_size >= 256, btree_corrupted, "Block size too small for metadata nodes");
+}
+
+[[nodiscard]] std::shared_ptr < const btree_node_t > cow_btree::load(const uint64_t block_id) const
+{
+    if (auto cached = pool.get(block_id)) {
+        return *cached;
+    }
+
+    const auto data = blocks.read_block(block_id);
+    uint64_t offset = 0;
+    const auto header = get_pod<node_header_t>(data, offset);
+    if (header.magic != node_magic) {
+        easy_throw_except(btree_corrupted, "Block " + bin2hex(block_id) + " is not a metadata node");
+    }
+
+    auto node = std::make_shared<btree_node_t>();
+    node->level = header.level;
+    for (uint16_t i = 0; i < header.count; i++)
+    {
+        node->keys.push_back(get_pod<uint64_t>(data, offset));
+        if (header.level == 0)
+        {
+            const auto length = get_pod<uint16_t>(data, offset);
+            if (offset + length > data.size()) {
+                easy_throw_except(btree_corrupted, "Value runs past the block in node " + bin2hex(block_id));
+            }
+            node->values.emplace_back(data.begin() + static_cast<ssize_t>(offset),
+                data.begin() + static_cast<ssize_t>(offset + length));
+            offset += length;
+        }
+        else
+        {
+            node->children.push_back(get_pod<uint64_t>(data, offset));
+        }
+    }
+
+    std::shared_ptr < const btree_node_t > result = std::move(node);
+    pool.put(block_id, result);
+    return result;
+}
+
+[[nodiscard]] uint64_t cow_btree::node_size(const btree_node_t & node, const uint64_t first, const uint64_t last) const
+{
+    uint64_t size = sizeof(node_header_t);
+    for (uint64_t i = first; i < last; i++) {
+        size += node.level == 0 ? leaf_entry_overhead + node.values[i].size() : inner_entry_size;
+    }
+    return size;
+}
+
+[[nodiscard]] uint64_t cow_btree::store(const btree_node_t & node, std::vector < uint64_t > & written) const
+{
+    std::vector < uint8_t > data(block_size, 0);
+    uint64_t offset = 0;
+    put_pod(data, offset, node_header_t {
+        .magic = node_magic, .level = node.level, .count = static_cast<uint16_t>(node.keys.size()) });
+    for (uint64_t i = 0; i < node.keys.size(); i++)
+    {
+        put_pod(data, offset, node.keys[i]);
+        if (node.level == 0)
+        {
+            put_pod(data, offset, static_cast<uint16_t>(node.values[i].size()));
+            std::memcpy(data.data() + offset, node.values[i].data(), node.values[i].size());
+            offset += node.values[i].size();
+        }
+        else
+        {
+            put_pod(data, offset, node.children[i]);
+        }
+    }
+
+    const uint64_t block_id = blocks.write_in_block(data);
+    pool.put(block_id, std::make_shared<const btree_node_t>(node));
+    written.push_back(block_id);
+    return block_id;
+}
+
+[[nodiscard]] std::vector < cow_btree::piece_t > cow_btree::store_split(const btree_node_t & node,
+    std::vector < uint64_t > & written) const
+{
+    const uint64_t total = node_size(node, 0, node.keys.size());
+    if (total <= block_size) {
+        return { { node.keys.empty() ? 0 : node.keys.front(), store(node, written) } };
+    }
+
+    // cut into pieces of roughly equal byte size, none of them over block_size
+    const uint64_t piece_count = (total + block_size - 1) / block_size + 1;
+    const uint64_t target = total / piece_count;
+    std::vector < piece_t > pieces;
+    uint64_t first = 0;
+    while (first < node.keys.size())
+    {
+        uint64_t last = first + 1;
+        while (last < node.keys.size()
+            && node_size(node, first, last + 1) <= block_size
+            && node_size(node, first, last) < target)
+        {
+            last++;
+        }
+
+        btree_node_t piece;
+        piece.level = node.level;
+        piece.keys.assign(node.keys.begin() + static_cast<ssize_t>(first), node.keys.begin() + static_cast<ssize_t>(last));
+        if (node.level == 0) {
+            piece.values.assign(node.values.begin() + static_cast<ssize_t>(first), node.values.begin() + static_cast<ssize_t>(last));
+        } else {
+            piece.children.assign(node.children.begin() + static_cast<ssize_t>(first), node.children.begin() + static_cast<ssize_t>(last));
+        }
+
+        pieces.emplace_back(piece.keys.front(), store(piece, written));
+        first = last;
+    }
+
+    return pieces;
+}
+
+[[nodiscard]] uint64_t cow_btree::child_index(const btree_node_t & node, const uint64_t key)
+{
+    const auto it = std::upper_bound(node.keys.begin(), node.keys.end(), key);
+    return it == node.keys.begin() ? 0 : static_cast<uint64_t>(it - node.keys.begin() - 1);
+}
+
+[[nodiscard]] std::vector < cow_btree::piece_t > cow_btree::insert_into(const uint64_t block_id, const uint64_t key,
+    const value_t & value, std::vector < uint64_t > & written) const
+{
+    btree_node_t node = *load(block_id);
+    if (node.level == 0)
+    {
+        const auto it = std::lower_bound(node.keys.begin(), node.keys.end(), key);
+        const auto index = it - node.keys.begin();
+        if (it != node.keys.end() && *it == key)
+        {
+            node.values[index] = value;
+        }
+        else
+        {
+            node.keys.insert(it, key);
+            node.values.insert(node.values.begin() + index, value);
+        }
+
+        return store_split(node, written);
+    }
+
+    const uint64_t index = child_index(node, key);
+    const auto pieces = insert_into(node.children[index], key, value, written);
+    node.keys[index] = pieces.front().first;
+    node.children[index] = pieces.front().second;
+    for (uint64_t i = 1; i < pieces.size(); i++)
+    {
+        node.keys.insert(node.keys.begin() + static_cast<ssize_t>(index + i), pieces[i].first);
+        node.children.insert(node.children.begin() + static_cast<ssize_t>(index + i), pieces[i].second);
+    }
+
+    return store_split(node, written);
+}
+
+[[nodiscard]] std::optional < cow_btree::piece_t > cow_btree::erase_from(const uint64_t block_id, const uint64_t key,
+    bool & found, std::vector < uint64_t > & written) const
+{
+    btree_node_t node = *load(block_id);
+    if (node.level == 0)
+    {
+        const auto it = std::lower_bound(node.keys.begin(), node.keys.end(), key);
+        if (it == node.keys.end() || *it != key) {
+            return piece_t { node.keys.empty() ? 0 : node.keys.front(), block_id };
+        }
+
+        found = true;
+        node.values.erase(node.values.begin() + (it - node.keys.begin()));
+        node.keys.erase(it);
+    }
+    else
+    {
+        const uint64_t index = child_index(node, key);
+        const auto piece = erase_from(node.children[index], key, found, written);
+        if (!found) {
+            return piece_t { node.keys.front(), block_id };
+        }
+
+        if (piece)
+        {
+            node.keys[index] = piece->first;
+            node.children[index] = piece->second;
+
+            // keep children at least a quarter full, or create/delete churn leaves a tree of
+            // near-empty nodes that every lookup and path copy still goes through
+            if (const auto child = load(piece->second);
+                node.children.size() > 1 && node_size(*child, 0, child->keys.size()) < block_size / 4)
+            {
+                merge_children(node, index + 1 == node.children.size() ? index - 1 : index, written);
+            }
+        }
+        else
+        {
+            node.keys.erase(node.keys.begin() + static_cast<ssize_t>(index));
+            node.children.erase(node.children.begin() + static_cast<ssize_t>(index));
+        }
+    }
+
+    if (node.keys.empty()) {
+        return std::nullopt;
+    }
+
+    return piece_t { node.keys.front(), store(node, written) };
+}
+
+void cow_btree::merge_children(btree_node_t & node, const uint64_t left, std::vector < uint64_t > & written) const
+{
+    btree_node_t merged = *load(node.children[left]);
+    const auto right = load(node.children[left + 1]);
+    merged.keys.insert(merged.keys.end(), right->keys.begin(), right->keys.end());
+    merged.values.insert(merged.values.end(), right->values.begin(), right->values.end());
+    merged.children.insert(merged.children.end(), right->children.begin(), right->children.end());
+
+    // one node if both fit, otherwise two evenly filled ones
+    const auto pieces = store_split(merged, written);
+    const auto first = static_cast<ssize_t>(left);
+    node.keys.erase(node.keys.begin() + first, node.keys.begin() + first + 2);
+    node.children.erase(node.children.begin() + first, node.children.begin() + first + 2);
+    for (uint64_t i = 0; i < pieces.size(); i++)
+    {
+        node.keys.insert(node.keys.begin() + first + static_cast<ssize_t>(i), pieces[i].first);
+        node.children.insert(node.children.begin() + first + static_cast<ssize_t>(i), pieces[i].second);
+    }
+}
+
+void cow_btree::journal_written(const std::vector < uint64_t > & written) const
+{
+    if (journal == nullptr || written.empty()) {
+        return;
+    }
+
+    std::vector < log_manager::log_t > logs;
+    logs.reserve(written.size());
+    for (const auto block_id : written) {
+        logs.push_back(log_manager::make_log(LOG_WRITE_BLOCK, block_id));
+    }
+    journal->append_logs(std::move(logs));
+}
+
+[[nodiscard]] uint64_t cow_btree::create() const
+{
+    std::vector < uint64_t > written;
+    const uint64_t root = store(btree_node_t { }, written);
+    journal_written(written);
+    return root;
+}
+
+[[nodiscard]] std::optional < cow_btree::value_t > cow_btree::get(const uint64_t root, const uint64_t key) const
+{
+    auto node = load(root);
+    while (node->level != 0) {
+        node = load(node->children[child_index(*node, key)]);
+    }
+
+    const auto it = std::lower_bound(node->keys.begin(), node->keys.end(), key);
+    if (it == node->keys.end() || *it != key) {
+        return std::nullopt;
+    }
+
+    return node->values[it - node->keys.begin()];
+}
+
+[[nodiscard]] uint64_t cow_btree::put(const uint64_t root, const uint64_t key, const value_t & value) const
+{
+    if (value.size() > max_value_size) {
+        easy_throw_except(btree_value_too_large, "Value of " + std::to_string(value.size()) + " bytes exceeds "
+            + std::to_string(max_value_size));
+    }
+
+    std::vector < uint64_t > written;
+    auto pieces = insert_into(root, key, value, written);
+    while (pieces.size() > 1)
+    {
+        // the root split, grow the tree by one level
+        btree_node_t new_root;
+        new_root.level = load(pieces.front().second)->level + 1;
+        for (const auto & [lowest_key, block_id] : pieces)
+        {
+            new_root.keys.push_back(lowest_key);
+            new_root.children.push_back(block_id);
+        }
+        pieces = store_split(new_root, written);
+    }
+
+    journal_written(written);
+    return pieces.front().second;
+}
+
+[[nodiscard]] uint64_t cow_btree::erase(const uint64_t root, const uint64_t key) const
+{
+    bool found = false;
+    std::vector < uint64_t > written;
+    const auto piece = erase_from(root, key, found, written);
+    if (!found) {
+        return root;
+    }
+
+    uint64_t new_root = piece ? piece->second : store(btree_node_t { }, written);
+
+    // an inner root with a single child is just a taller version of that child
+    for (auto node = load(new_root); node->level != 0 && node->children.size() == 1; node = load(new_root)) {
+        new_root = node->children.front();
+    }
+
+    journal_written(written);
+    return new_root;
+}
+
+bool cow_btree::scan_from(const uint64_t block_id, const uint64_t from, const scan_callback_t & callback) const
+{
+    const auto node = load(block_id);
+    if (node->level == 0)
+    {
+        for (auto it = std::lower_bound(node->keys.begin(), node->keys.end(), from); it != node->keys.end(); ++it)
+        {
+            if (!callback(*it, node->values[it - node->keys.begin()])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    for (uint64_t i = child_index(*node, from); i < node->children.size(); i++)
+    {
+        if (!scan_from(node->children[i], from, callback)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void cow_btree::scan(const uint64_t root, const uint64_t from, const scan_callback_t & callback) const
+{
+    scan_from(root, from, callback);
+}
+
+[[nodiscard]] uint64_t cow_btree::get_max_value_size() const
+{
+    return max_value_size;
+}
@@ -0,0 +1,2202 @@
+#include <algorithm>
+#include <ranges>
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <unistd.h>
+#include "cow_filesystem.h"
+#include "log.hpp"
+using namespace cow_block;
+
+namespace
+{
+    timespec now()
+    {
+        timespec ts { };
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return ts;
+    }
+
+    constexpr uint64_t max_name_length = 255;
+
+    void check_name(const std::string & name)
+    {
+        if (name.size() > max_name_length) {
+            throw fs_error(ENAMETOOLONG, "Name too long: " + name);
+        }
+    }
+
+    uint8_t dirent_type_of(const uint32_t mode)
+    {
+        return static_cast<uint8_t>((mode & S_IFMT) >> 12);
+    }
+}
+
+cow_filesystem::file_handle_t::~file_handle_t()
+{
+    if (lower_fd >= 0) {
+        ::close(lower_fd);
+    }
+}
+
+cow_filesystem::read_piece_t::read_piece_t(read_piece_t && other) noexcept
+    : data(std::move(other.data)), fd(std::exchange(other.fd, -1)), owns_fd(std::exchange(other.owns_fd, false)),
+      fd_offset(other.fd_offset), length(other.length)
+{
+}
+
+cow_filesystem::read_piece_t::~read_piece_t()
+{
+    if (owns_fd && fd >= 0) {
+        ::close(fd);
+    }
+}
+
+cow_filesystem::cow_filesystem(const block_manager & blocks, const log_manager & journal, options_t options)
+    : blocks(blocks), journal(journal), options(std::move(options)),
+      pool(this->options.buffer_pool_entries),
+      tree(blocks, pool, &journal),
+      table(tree, blocks, this->options.inline_threshold, &journal),
+      directories(tree),
+      cache(this->options.inode_cache_entries, this->options.dentry_cache_entries),
+      lower(this->options.lower_dirs, this->options.lower_cache_entries),
+      fingerprints(this->options.fingerprint_path, this->options.fingerprint_xattr),
+      block_cache(this->options.block_cache_entries),
+      prefetcher(this->options.read_ahead_threads, this->options.read_ahead_blocks),
+      writes(this->options.bypass_probe_blocks, this->options.bypass_reprobe_blocks)
+{
+    nodes[root_node_id] = node_t {
+        .upper = true,
+        .lower_path = this->options.lower_dirs.empty() ? std::nullopt : std::optional < std::string > (""),
+        .parent = root_node_id,
+        .name = "",
+        .lookups = 1,
+    };
+
+    const auto size_class_of = [&](const uint64_t size)
+    {
+        const auto size_class = blocks.size_class_of(size);
+        if (!size_class) {
+            easy_throw_except(block_size_class_invalid, "Block size " + std::to_string(size) + " is not a power of two multiple of "
+                + std::to_string(blocks.get_block_size()) + " up to " + std::to_string(block_manager::max_class_size));
+        }
+        return *size_class;
+    };
+    for (const auto & [suffix, size] : this->options.block_size_rules) {
+        size_class_rules.emplace_back(suffix, size_class_of(size));
+    }
+    if (this->options.large_block_size != 0) {
+        large_size_class = size_class_of(this->options.large_block_size);
+    }
+
+    if (struct stat st { }; ::stat(blocks.get_data_dir().c_str(), &st) == 0)
+    {
+        data_device = static_cast<uint64_t>(st.st_dev);
+        for (const auto & layer : this->options.lower_dirs)
+        {
+            if (struct stat layer_st { }; ::stat(layer.c_str(), &layer_st) == 0 && static_cast<uint64_t>(layer_st.st_dev) == data_device) {
+                info_log("Lower layer ", layer, " shares the block store's file system, copy-up clones its blocks\n");
+            }
+        }
+    }
+
+    {
+        std::unique_lock lock(metadata_lock);
+        load_root();
+    }
+
+    if (!this->options.read_only)
+    {
+        committer = std::thread([this]
+        {
+            while (true)
+            {
+                {
+                    std::unique_lock lock(committer_mutex);
+                    if (committer_cond.wait_for(lock, this->options.commit_interval, [this] { return committer_stop; })) {
+                        return;
+                    }
+                }
+
+                try {
+                    commit();
+                } catch (const std::exception & e) {
+                    error_log("Periodic commit failed: ", e.what(), "\n");
+                }
+            }
+        });
+    }
+}
+
+cow_filesystem::~cow_filesystem()
+{
+    if (committer.joinable())
+    {
+        {
+            std::lock_guard lock(committer_mutex);
+            committer_stop = true;
+        }
+        committer_cond.notify_all();
+        committer.join();
+    }
+
+    try {
+        commit();
+    } catch (const std::exception & e) {
+        error_log("Final commit failed: ", e.what(), "\n");
+    }
+}
+
+void cow_filesystem::load_root()
+{
+    std::optional < std::pair < uint64_t, uint64_t > > pending, committed;
+    journal.scan(0, [&](const log_manager::log_t & log, uint64_t) -> bool
+    {
+        if (log.action == LOG_ROOT_UPDATE) {
+            pending = { log.params.generic.param1, log.params.generic.param2 };
+        } else if (log.action == LOG_COMMIT && pending) {
+            committed = pending;
+            pending.reset();
+        }
+        return true;
+    });
+
+    if (committed)
+    {
+        table_root = committed->first;
+        next_inode = committed->second;
+        info_log("Mounting inode table ", bin2hex(table_root), " from the journal\n");
+    }
+    else if (options.initial_root != 0
+        && std::filesystem::exists(blocks.get_data_dir() + "/" + bin2hex(options.initial_root)))
+    {
+        table_root = options.initial_root;
+        uint64_t highest = root_node_id;
+        tree.scan(table_root, 0, [&](const uint64_t key, const cow_btree::value_t &) -> bool
+        {
+            highest = std::max(highest, key);
+            return true;
+        });
+        next_inode = highest + 1;
+        info_log("Mounting inode table ", bin2hex(table_root), " from the configuration\n");
+    }
+    else
+    {
+        if (options.read_only) {
+            throw fs_error(EROFS, "Nothing to mount and the file system is read only");
+        }
+
+        info_log("No inode table found, formatting an empty file system\n");
+        table_root = table.create();
+        inode root(root_node_id, blocks.get_zero_block_id());
+        auto & attributes = root.get_attributes();
+        attributes.mode = S_IFDIR | 0755;
+        attributes.nlink = 2;
+        attributes.uid = getuid();
+        attributes.gid = getgid();
+        attributes.atime = attributes.mtime = attributes.ctime = now();
+        if (!options.lower_dirs.empty()) {
+            root.set_flags(inode::INODE_MERGED);
+        }
+        dirty_inodes[root_node_id] = std::make_shared<inode>(std::move(root));
+        next_inode = root_node_id + 1;
+        mark_dirty();
+        commit_locked();
+    }
+
+    if (!get_inode(root_node_id)) {
+        throw fs_error(EIO, "Inode table " + bin2hex(table_root) + " has no root directory");
+    }
+}
+
+[[nodiscard]] cow_filesystem::node_t cow_filesystem::node_of(const uint64_t node_id) const
+{
+    std::lock_guard lock(nodes_mutex);
+    const auto it = nodes.find(node_id);
+    if (it == nodes.end()) {
+        throw fs_error(ESTALE, "Unknown node " + std::to_string(node_id));
+    }
+    return it->second;
+}
+
+[[nodiscard]] uint64_t cow_filesystem::remember(uint64_t node_id, const uint64_t parent, const std::string & name,
+    const bool upper, const std::optional < std::string > & lower_path, const uint64_t references)
+{
+    std::lock_guard lock(nodes_mutex);
+    if (node_id == 0)
+    {
+        // lower-only node, the same lower path always gets the same id while it is referenced
+        const auto [it, inserted] = lower_nodes.try_emplace(*lower_path, 0);
+        if (inserted) {
+            it->second = next_inode.fetch_add(1);
+        }
+        node_id = it->second;
+    }
+
+    auto & node = nodes[node_id];
+    node.upper = upper;
+    node.lower_path = lower_path;
+    node.parent = parent;
+    node.name = name;
+    node.lookups += references;
+    return node_id;
+}
+
+[[nodiscard]] std::string cow_filesystem::lower_full_path(const std::string & lower_path) const
+{
+    auto path = lower.locate(lower_path);
+    if (!path) {
+        throw fs_error(ENOENT, "No lower layer holds " + lower_path);
+    }
+    return *path;
+}
+
+[[nodiscard]] std::string cow_filesystem::child_path(const std::string & parent, const std::string & name)
+{
+    return parent + "/" + name;
+}
+
+[[nodiscard]] std::shared_ptr < const inode > cow_filesystem::get_inode(const uint64_t number)
+{
+    if (const auto it = dirty_inodes.find(number); it != dirty_inodes.end()) {
+        return it->second;
+    }
+
+    return cache.get_inode(number, [&]() -> metadata_cache::inode_ptr
+    {
+        auto node = table.load(table_root, number);
+        return node ? std::make_shared<const inode>(std::move(*node)) : nullptr;
+    });
+}
+
+[[nodiscard]] inode & cow_filesystem::mutable_inode(const uint64_t number)
+{
+    if (const auto it = dirty_inodes.find(number); it != dirty_inodes.end()) {
+        return *it->second;
+    }
+
+    const auto current = get_inode(number);
+    if (!current) {
+        throw fs_error(ENOENT, "No inode " + std::to_string(number));
+    }
+
+    auto copy = std::make_shared<inode>(*current);
+    dirty_inodes[number] = copy;
+    cache.forget_inode(number);
+    mark_dirty();
+    return *copy;
+}
+
+void cow_filesystem::drop_inode(const uint64_t number)
+{
+    if (const auto it = pending_writes.find(number); it != pending_writes.end())
+    {
+        pending_block_count -= it->second.size();
+        pending_writes.erase(it);
+    }
+    dirty_inodes.erase(number);
+    cache.forget_inode(number);
+    table_root = table.remove(table_root, number);
+    mark_dirty();
+}
+
+void cow_filesystem::flush_dirty()
+{
+    for (auto & [number, node] : dirty_inodes)
+    {
+        table.settle(*node);
+        table_root = table.store(table_root, *node);
+        cache.put_inode(std::make_shared<const inode>(std::move(*node)));
+    }
+    dirty_inodes.clear();
+}
+
+void cow_filesystem::mark_dirty()
+{
+    dirty = true;
+}
+
+[[nodiscard]] struct stat cow_filesystem::stat_of(const inode & node) const
+{
+    const auto & attributes = node.get_attributes();
+    struct stat st { };
+    st.st_ino = node.get_number();
+    st.st_mode = attributes.mode;
+    st.st_nlink = attributes.nlink;
+    st.st_uid = attributes.uid;
+    st.st_gid = attributes.gid;
+    st.st_rdev = attributes.rdev;
+    st.st_size = S_ISDIR(attributes.mode) ? static_cast<off_t>(blocks.get_block_size()) : static_cast<off_t>(attributes.size);
+    st.st_blksize = static_cast<blksize_t>(block_size_of(node));
+    st.st_blocks = static_cast<blkcnt_t>((st.st_size + 511) / 512);
+    st.st_atim = attributes.atime;
+    st.st_mtim = attributes.mtime;
+    st.st_ctim = attributes.ctime;
+    return st;
+}
+
+[[nodiscard]] uint64_t cow_filesystem::block_size_of(const inode & node) const
+{
+    return blocks.get_block_size(node.get_size_class());
+}
+
+[[nodiscard]] uint64_t cow_filesystem::zero_block_of(const inode & node) const
+{
+    return blocks.get_zero_block_id(node.get_size_class());
+}
+
+void cow_filesystem::choose_size_class(inode & node, const std::string & name, const uint64_t size_hint) const
+{
+    for (const auto & [suffix, size_class] : size_class_rules)
+    {
+        if (name.ends_with(suffix))
+        {
+            node.set_size_class(size_class, blocks.get_zero_block_id(size_class));
+            return;
+        }
+    }
+
+    const uint8_t size_class = size_hint >= options.large_file_size ? large_size_class : 0;
+    node.set_size_class(size_class, blocks.get_zero_block_id(size_class));
+}
+
+void cow_filesystem::hint_size(inode & node, const uint64_t size) const
+{
+    // only a file with nothing stored yet can change class, and a rule or an earlier hint is not overridden
+    if (node.get_size_class() == 0 && large_size_class != 0 && size >= options.large_file_size
+        && node.get_attributes().size == 0 && node.get_storage() == inode::STORAGE_INLINE
+        && !pending_writes.contains(node.get_number()))
+    {
+        node.set_size_class(large_size_class, blocks.get_zero_block_id(large_size_class));
+    }
+}
+
+[[nodiscard]] struct stat cow_filesystem::stat_of(const uint64_t node_id, const node_t & node)
+{
+    if (node.upper)
+    {
+        const auto current = get_inode(node_id);
+        if (!current) {
+            throw fs_error(ESTALE, "Node " + std::to_string(node_id) + " has no inode");
+        }
+        return stat_of(*current);
+    }
+
+    struct stat st { };
+    if (::lstat(lower_full_path(*node.lower_path).c_str(), &st) != 0) {
+        throw fs_error(errno, "Cannot stat lower " + *node.lower_path);
+    }
+    st.st_ino = node_id;
+    return st;
+}
+
+[[nodiscard]] std::optional < dirent_t > cow_filesystem::upper_entry(const node_t & dir, const uint64_t dir_id,
+    const std::string & name)
+{
+    if (!dir.upper) {
+        return std::nullopt;
+    }
+
+    return cache.lookup(dir_id, name, [&]() -> std::optional < dirent_t >
+    {
+        const auto current = get_inode(dir_id);
+        return current ? directories.lookup(*current, name) : std::nullopt;
+    });
+}
+
+[[nodiscard]] bool cow_filesystem::lower_exists(const node_t & dir, const std::string & name, struct stat * attributes) const
+{
+    return dir.lower_path && lower.exists(child_path(*dir.lower_path, name), attributes);
+}
+
+[[nodiscard]] std::vector < std::pair < std::string, uint8_t > > cow_filesystem::list_lower(const std::string & lower_path) const
+{
+    return lower.list(lower_path);
+}
+
+[[nodiscard]] std::optional < cow_filesystem::resolved_t > cow_filesystem::resolve(const uint64_t parent_id,
+    const node_t & parent, const std::string & name)
+{
+    if (const auto entry = upper_entry(parent, parent_id, name))
+    {
+        if (entry->type == DIRENT_WHITEOUT) {
+            return std::nullopt;
+        }
+
+        std::optional < std::string > lower_path;
+        if (parent.lower_path && entry->type == dirent_type_of(S_IFDIR))
+        {
+            if (const auto child = get_inode(entry->inode); child && child->get_flags() & inode::INODE_MERGED) {
+                lower_path = child_path(*parent.lower_path, name);
+            }
+        }
+
+        return resolved_t { .node_id = entry->inode, .upper = true, .lower_path = lower_path };
+    }
+
+    if (lower_exists(parent, name))
+    {
+        const std::string lower_path = child_path(*parent.lower_path, name);
+        std::lock_guard lock(nodes_mutex);
+        const auto it = lower_nodes.find(lower_path);
+        return resolved_t { .node_id = it == lower_nodes.end() ? 0 : it->second, .upper = false, .lower_path = lower_path };
+    }
+
+    return std::nullopt;
+}
+
+[[nodiscard]] cow_filesystem::node_t cow_filesystem::as_node(const resolved_t & resolved)
+{
+    return node_t { .upper = resolved.upper, .lower_path = resolved.lower_path, .parent = 0, .name = "", .lookups = 0 };
+}
+
+[[nodiscard]] bool cow_filesystem::is_empty_dir(const uint64_t node_id, const node_t & node)
+{
+    bool empty = true;
+    if (node.upper)
+    {
+        directories.readdir(*get_inode(node_id), 0, [&](const dirent_t & entry, uint64_t) -> bool
+        {
+            empty = entry.type == DIRENT_WHITEOUT;
+            return empty;
+        });
+    }
+
+    if (empty && node.lower_path)
+    {
+        for (const auto & name : list_lower(*node.lower_path) | std::views::keys)
+        {
+            if (!upper_entry(node, node_id, name)) {
+                return false;
+            }
+        }
+    }
+
+    return empty;
+}
+
+void cow_filesystem::check_writable() const
+{
+    if (options.read_only) {
+        throw fs_error(EROFS, "File system is read only");
+    }
+}
+
+void cow_filesystem::copy_up(const uint64_t node_id)
+{
+    const node_t node = node_of(node_id);
+    if (node.upper) {
+        return;
+    }
+
+    copy_up(node.parent);
+
+    struct stat st { };
+    const std::string path = lower_full_path(*node.lower_path);
+    if (::lstat(path.c_str(), &st) != 0) {
+        throw fs_error(errno, "Cannot stat lower " + *node.lower_path);
+    }
+
+    auto copy = std::make_shared<inode>(node_id, blocks.get_zero_block_id());
+    auto & attributes = copy->get_attributes();
+    attributes.mode = st.st_mode;
+    attributes.uid = st.st_uid;
+    attributes.gid = st.st_gid;
+    attributes.rdev = st.st_rdev;
+    attributes.nlink = S_ISDIR(st.st_mode) ? 2 : 1;
+    if (S_ISREG(st.st_mode)) {
+        choose_size_class(*copy, node.name, static_cast<uint64_t>(st.st_size));
+    }
+
+    if (S_ISDIR(st.st_mode))
+    {
+        copy->set_flags(inode::INODE_MERGED);
+    }
+    else if (S_ISREG(st.st_mode) && static_cast<uint64_t>(st.st_size) > table.get_inline_threshold()
+        && copy_from_fingerprint(*copy, path, st))
+    {
+        // every block is already stored, the copy needs no lower origin
+        debug_log("Copied up ", *node.lower_path, " from its fingerprint\n");
+    }
+    else if (S_ISREG(st.st_mode) && static_cast<uint64_t>(st.st_size) > table.get_inline_threshold()
+        && node.lower_path->size() < blocks.get_block_size())
+    {
+        // lazy: every block keeps reading from the lower file until it is written
+        const uint64_t block_size = block_size_of(*copy);
+        copy->use_blocks();
+        copy->get_block_map().set_range(0, (static_cast<uint64_t>(st.st_size) + block_size - 1) / block_size,
+            block_map::lower_block);
+        copy->set_lower_origin(*node.lower_path);
+        attributes.size = static_cast<uint64_t>(st.st_size);
+    }
+    else if (S_ISREG(st.st_mode))
+    {
+        copy_content_up(*copy, *node.lower_path, path, st);
+    }
+    else if (S_ISLNK(st.st_mode))
+    {
+        std::vector < char > target(PATH_MAX);
+        const ssize_t length = ::readlink(path.c_str(), target.data(), target.size());
+        if (length < 0) {
+            throw fs_error(errno, "Cannot read lower link " + *node.lower_path);
+        }
+        write_upper(*copy, 0, reinterpret_cast<const uint8_t *>(target.data()), static_cast<uint64_t>(length));
+    }
+
+    attributes.atime = st.st_atim;
+    attributes.mtime = st.st_mtim;
+    attributes.ctime = st.st_ctim;
+    dirty_inodes[node_id] = copy;
+    mark_dirty();
+
+    add_entry(node.parent, node.name, dirent_t { .name = node.name, .inode = node_id, .type = dirent_type_of(st.st_mode) });
+
+    std::lock_guard lock(nodes_mutex);
+    auto & current = nodes[node_id];
+    current.upper = true;
+    lower_nodes.erase(*node.lower_path);
+    if (!S_ISDIR(st.st_mode)) {
+        current.lower_path.reset();
+    }
+    debug_log("Copied up ", *node.lower_path, " as inode ", node_id, "\n");
+
+    // attributes now come from the upper inode (directory size and link count differ)
+    if (invalidation_handler) {
+        invalidation_handler(node_id);
+    }
+}
+
+[[nodiscard]] bool cow_filesystem::copy_from_fingerprint(inode & copy, const std::string & path, const struct stat & st)
+{
+    const uint64_t block_size = block_size_of(copy);
+    const uint64_t block_count = (static_cast<uint64_t>(st.st_size) + block_size - 1) / block_size;
+    const auto block_ids = fingerprints.lookup(path, st, block_size);
+    if (!block_ids || block_ids->size() != block_count) {
+        return false;
+    }
+
+    // blocks gone from the store are cloned back from the file, which still reads nothing
+    if (uint64_t index = 0; !std::ranges::all_of(*block_ids, [this](const uint64_t id) { return blocks.has_block(id); }))
+    {
+        if (static_cast<uint64_t>(st.st_dev) != data_device) {
+            return false;
+        }
+
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        for (; index < block_count; index++)
+        {
+            if (!blocks.has_block((*block_ids)[index])
+                && !clone_lower_block(copy, fd, st, index, (*block_ids)[index]))
+            {
+                break;
+            }
+        }
+        ::close(fd);
+        if (index != block_count) {
+            return false;
+        }
+    }
+
+    std::vector < log_manager::log_t > logs;
+    copy.use_blocks();
+    for (uint64_t index = 0; index < block_count; index++)
+    {
+        copy.get_block_map().set(index, (*block_ids)[index]);
+        if ((*block_ids)[index] != zero_block_of(copy)) {
+            logs.push_back(log_manager::make_log(LOG_WRITE_BLOCK, (*block_ids)[index]));
+        }
+    }
+
+    if (!logs.empty()) {
+        journal.append_logs(std::move(logs));
+    }
+    copy.get_attributes().size = static_cast<uint64_t>(st.st_size);
+    return true;
+}
+
+[[nodiscard]] bool cow_filesystem::clone_lower_block(const inode & copy, const int fd, const struct stat & st, const uint64_t index,
+    const uint64_t block_id) const
+{
+    const uint64_t block_size = block_size_of(copy);
+    return static_cast<uint64_t>(st.st_dev) == data_device
+        && (index + 1) * block_size <= static_cast<uint64_t>(st.st_size)
+        && blocks.clone_in_block(block_id, fd, index * block_size, copy.get_size_class());
+}
+
+void cow_filesystem::copy_content_up(inode & copy, const std::string & lower_path, const std::string & path, const struct stat & st)
+{
+    const uint64_t block_size = block_size_of(copy);
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw fs_error(errno, "Cannot open lower " + lower_path);
+    }
+
+    const bool in_blocks = static_cast<uint64_t>(st.st_size) > table.get_inline_threshold();
+    if (in_blocks) {
+        copy.use_blocks();
+    }
+
+    // whole blocks are still read to be named, but stored by the file system sharing their extents
+    std::vector < log_manager::log_t > cloned;
+    std::vector < uint8_t > buffer(block_size);
+    uint64_t offset = 0;
+    while (true)
+    {
+        const ssize_t got = ::pread(fd, buffer.data(), buffer.size(), static_cast<off_t>(offset));
+        if (got < 0)
+        {
+            const int error = errno;
+            ::close(fd);
+            throw fs_error(error, "Cannot read lower " + lower_path);
+        }
+        if (got == 0) {
+            break;
+        }
+
+        if (const uint64_t block_id = in_blocks && static_cast<uint64_t>(got) == block_size && offset % block_size == 0
+                ? hashcrc64(buffer) : zero_block_of(copy);
+            block_id != zero_block_of(copy) && clone_lower_block(copy, fd, st, offset / block_size, block_id))
+        {
+            copy.get_block_map().set(offset / block_size, block_id);
+            copy.get_attributes().size = std::max(copy.get_attributes().size, offset + block_size);
+            cloned.push_back(log_manager::make_log(LOG_WRITE_BLOCK, block_id));
+        }
+        else
+        {
+            write_upper(copy, offset, buffer.data(), static_cast<uint64_t>(got));
+        }
+        offset += static_cast<uint64_t>(got);
+    }
+    ::close(fd);
+
+    if (!cloned.empty()) {
+        journal.append_logs(std::move(cloned));
+    }
+
+    if (in_blocks && offset == static_cast<uint64_t>(st.st_size))
+    {
+        const uint64_t block_count = (offset + block_size - 1) / block_size;
+        std::vector < uint64_t > block_ids(block_count);
+        for (uint64_t index = 0; index < block_count; index++) {
+            block_ids[index] = copy.get_block_map().lookup(index).value_or(zero_block_of(copy));
+        }
+        fingerprints.store(path, st, block_size, std::move(block_ids));
+    }
+}
+
+[[nodiscard]] inode & cow_filesystem::new_inode(const uint32_t mode, const uint32_t uid, const uint32_t gid, const uint64_t rdev)
+{
+    const uint64_t number = next_inode.fetch_add(1);
+    auto node = std::make_shared<inode>(number, blocks.get_zero_block_id());
+    auto & attributes = node->get_attributes();
+    attributes.mode = mode;
+    attributes.uid = uid;
+    attributes.gid = gid;
+    attributes.rdev = rdev;
+    attributes.nlink = S_ISDIR(mode) ? 2 : 1;
+    attributes.atime = attributes.mtime = attributes.ctime = now();
+    dirty_inodes[number] = node;
+    mark_dirty();
+    return *node;
+}
+
+void cow_filesystem::add_entry(const uint64_t dir_id, const std::string & name, const dirent_t & entry)
+{
+    inode & dir = mutable_inode(dir_id);
+    directories.insert(dir, entry, table.get_inline_threshold());
+    dir.get_attributes().mtime = dir.get_attributes().ctime = now();
+    cache.put_dentry(dir_id, name, entry);
+}
+
+void cow_filesystem::remove_entry(const uint64_t dir_id, const node_t & dir, const std::string & name)
+{
+    inode & current = mutable_inode(dir_id);
+    if (lower_exists(dir, name))
+    {
+        const dirent_t whiteout { .name = name, .inode = 0, .type = DIRENT_WHITEOUT };
+        directories.insert(current, whiteout, table.get_inline_threshold());
+        cache.put_dentry(dir_id, name, whiteout);
+    }
+    else
+    {
+        directories.remove(current, name);
+        cache.put_dentry(dir_id, name, std::nullopt);
+    }
+    current.get_attributes().mtime = current.get_attributes().ctime = now();
+}
+
+[[nodiscard]] cow_filesystem::entry_t cow_filesystem::make_node(const uint64_t parent, const std::string & name,
+    const uint32_t mode, const uint32_t uid, const uint32_t gid, const uint64_t rdev, const std::string & symlink_target)
+{
+    check_name(name);
+    std::unique_lock lock(metadata_lock);
+    check_writable();
+    const node_t dir = node_of(parent);
+    if (!S_ISDIR(stat_of(parent, dir).st_mode)) {
+        throw fs_error(ENOTDIR, "Not a directory");
+    }
+    if (resolve(parent, dir, name)) {
+        throw fs_error(EEXIST, name + " exists");
+    }
+
+    copy_up(parent);
+    inode & node = new_inode(mode, uid, gid, rdev);
+    if (S_ISREG(mode)) {
+        choose_size_class(node, name, 0);
+    }
+    if (S_ISLNK(mode)) {
+        write_upper(node, 0, reinterpret_cast<const uint8_t *>(symlink_target.data()), symlink_target.size());
+    }
+
+    const uint64_t node_id = node.get_number();
+    const struct stat attributes = stat_of(node);
+    add_entry(parent, name, dirent_t { .name = name, .inode = node_id, .type = dirent_type_of(mode) });
+    if (S_ISDIR(mode)) {
+        mutable_inode(parent).get_attributes().nlink++;
+    }
+
+    (void)remember(node_id, parent, name, true, std::nullopt, 1);
+    return entry_t { .node_id = node_id, .attributes = attributes };
+}
+
+[[nodiscard]] std::shared_ptr < const std::vector < uint8_t > > cow_filesystem::cached_block(const uint64_t block_id,
+    const uint8_t size_class) const
+{
+    // ids are hashes of content, the size tells blocks of different classes apart should two ever collide
+    if (auto cached = block_cache.get(block_id); cached && (*cached)->size() == blocks.get_block_size(size_class)) {
+        return *cached;
+    }
+
+    auto data = std::make_shared<const std::vector < uint8_t >>(blocks.read_block(block_id, size_class));
+    block_cache.put(block_id, data);
+    return data;
+}
+
+void cow_filesystem::read_ahead_of(const inode & node, const file_handle_t & handle, const uint64_t offset, const uint64_t size)
+{
+    const uint64_t block_size = block_size_of(node);
+    const uint64_t file_size = node.get_attributes().size;
+    if (!prefetcher.enabled() || node.get_storage() != inode::STORAGE_BLOCKS || size == 0 || offset >= file_size) {
+        return;
+    }
+
+    const auto range = prefetcher.advise(handle.stream, offset / block_size, (offset + size + block_size - 1) / block_size);
+    if (!range) {
+        return;
+    }
+
+    // block ids are resolved now, under the metadata lock; being content hashes they stay valid
+    std::vector < uint64_t > block_ids;
+    for (uint64_t index = range->first; index < std::min(range->end, (file_size + block_size - 1) / block_size); index++)
+    {
+        if (const auto block = node.get_block_map().lookup(index);
+            block && *block != block_map::lower_block && *block != zero_block_of(node))
+        {
+            block_ids.push_back(*block);
+        }
+    }
+
+    if (!block_ids.empty()) {
+        prefetcher.submit([this, block_ids = std::move(block_ids), size_class = node.get_size_class()]
+            { prefetch_blocks(block_ids, size_class); });
+    }
+}
+
+void cow_filesystem::prefetch_blocks(const std::vector < uint64_t > & block_ids, const uint8_t size_class) const
+{
+    for (const uint64_t block_id : block_ids)
+    {
+        if (block_cache.get(block_id)) {
+            continue;
+        }
+
+        // uncompressed blocks are spliced or read as they are: warming the page cache is enough
+        if (const int fd = blocks.open_raw_block(block_id, size_class); fd >= 0)
+        {
+            ::posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+            ::close(fd);
+            continue;
+        }
+        (void)cached_block(block_id, size_class);
+    }
+}
+
+[[nodiscard]] std::vector < uint8_t > cow_filesystem::load_block(const inode & node, const uint64_t index,
+    const uint64_t block_id, int lower_fd) const
+{
+    if (block_id != block_map::lower_block) {
+        return *cached_block(block_id, node.get_size_class());
+    }
+
+    const auto & origin = node.get_lower_origin();
+    const bool own_fd = lower_fd < 0;
+    if (own_fd && (lower_fd = ::open(lower_full_path(origin).c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+        throw fs_error(errno, "Cannot open lower origin " + origin);
+    }
+
+    // past the end of the lower file reads as zeros, the file may have been truncated and grown since
+    const uint64_t block_size = block_size_of(node);
+    std::vector < uint8_t > data(block_size, 0);
+    uint64_t done = 0;
+    while (done < block_size)
+    {
+        const ssize_t got = ::pread(lower_fd, data.data() + done, block_size - done, static_cast<off_t>(index * block_size + done));
+        if (got < 0)
+        {
+            const int error = errno;
+            if (own_fd) {
+                ::close(lower_fd);
+            }
+            throw fs_error(error, "Cannot read lower origin " + origin);
+        }
+        if (got == 0) {
+            break;
+        }
+        done += static_cast<uint64_t>(got);
+    }
+
+    if (own_fd) {
+        ::close(lower_fd);
+    }
+    return data;
+}
+
+[[nodiscard]] std::vector < uint8_t > cow_filesystem::read_upper(const inode & node, const uint64_t offset, uint64_t size,
+    const int lower_fd) const
+{
+    const uint64_t file_size = node.get_attributes().size;
+    if (offset >= file_size) {
+        return { };
+    }
+    size = std::min(size, file_size - offset);
+
+    if (node.get_storage() == inode::STORAGE_INLINE)
+    {
+        const auto & content = node.get_inline_data();
+        std::vector < uint8_t > result(size, 0);
+        if (offset < content.size()) {
+            std::memcpy(result.data(), content.data() + offset, std::min<uint64_t>(size, content.size() - offset));
+        }
+        return result;
+    }
+
+    const uint64_t block_size = block_size_of(node);
+    const auto pending = pending_writes.find(node.get_number());
+    std::vector < uint8_t > result(size, 0);
+    for (uint64_t position = offset; position < offset + size; )
+    {
+        const uint64_t in_block = position % block_size;
+        const uint64_t length = std::min(block_size - in_block, offset + size - position);
+        const auto block = node.block_at(position, block_size);
+        const auto held = pending == pending_writes.end() ? nullptr : [&]() -> const pending_block_t *
+        {
+            const auto it = pending->second.find(position / block_size);
+            return it == pending->second.end() ? nullptr : &it->second;
+        }();
+
+        if (held != nullptr)
+        {
+            auto data = block ? load_block(node, position / block_size, *block, lower_fd) : std::vector < uint8_t > (block_size, 0);
+            held->overlay(data);
+            std::memcpy(result.data() + (position - offset), data.data() + in_block, length);
+        }
+        else if (block)
+        {
+            const auto data = load_block(node, position / block_size, *block, lower_fd);
+            std::memcpy(result.data() + (position - offset), data.data() + in_block, length);
+        }
+        position += length;
+    }
+    return result;
+}
+
+uint64_t cow_filesystem::store_block(write_policy::stream_t & stream, const std::vector < uint8_t > & data) const
+{
+    if (writes.bypass(stream)) {
+        return blocks.write_in_block_raw(data);
+    }
+
+    block_manager::write_outcome_t outcome;
+    const uint64_t block_id = blocks.write_in_block(data, &outcome);
+    writes.record(stream, data, outcome.existed, outcome.compressed);
+    return block_id;
+}
+
+void cow_filesystem::pending_block_t::add(const uint64_t begin, const uint8_t * bytes, const uint64_t length)
+{
+    std::memcpy(data.data() + begin, bytes, length);
+
+    uint64_t first = begin;
+    uint64_t last = begin + length;
+    std::vector < std::pair < uint64_t, uint64_t > > merged;
+    for (const auto & [range_begin, range_end] : written)
+    {
+        if (range_end < first || range_begin > last) {
+            merged.emplace_back(range_begin, range_end);
+        } else {
+            first = std::min(first, range_begin);
+            last = std::max(last, range_end);
+        }
+    }
+    merged.emplace_back(first, last);
+    std::ranges::sort(merged);
+    written = std::move(merged);
+}
+
+[[nodiscard]] bool cow_filesystem::pending_block_t::complete() const
+{
+    return written.size() == 1 && written.front().first == 0 && written.front().second == data.size();
+}
+
+[[nodiscard]] bool cow_filesystem::pending_block_t::completed_by(const uint64_t begin, const uint64_t length) const
+{
+    auto ranges = written;
+    ranges.emplace_back(begin, begin + length);
+    std::ranges::sort(ranges);
+
+    uint64_t reach = 0;
+    for (const auto & [range_begin, range_end] : ranges)
+    {
+        if (range_begin > reach) {
+            return false;
+        }
+        reach = std::max(reach, range_end);
+    }
+    return reach == data.size();
+}
+
+void cow_filesystem::pending_block_t::overlay(std::vector < uint8_t > & block) const
+{
+    for (const auto & [begin, end] : written) {
+        std::memcpy(block.data() + begin, data.data() + begin, end - begin);
+    }
+}
+
+[[nodiscard]] bool cow_filesystem::write_blocks(const uint64_t number, writer_t & writer, const uint64_t offset,
+    const uint8_t * data, const uint64_t size)
+{
+    // a block the write touches: merged content to store, or none for a partial block held back
+    struct staged_t
+    {
+        uint64_t index;
+        uint64_t in_block;
+        uint64_t length;
+        std::optional < std::vector < uint8_t > > content;
+        uint64_t block_id = 0;
+    };
+
+    const uint64_t end = offset + size;
+    std::vector < staged_t > staged;
+    uint8_t size_class;
+    uint64_t zero_block;
+    {
+        std::shared_lock lock(metadata_lock);
+        check_writable();
+        const auto current = node_of(number).upper ? get_inode(number) : nullptr;
+        if (!current) {
+            return false;
+        }
+        if (!S_ISREG(current->get_attributes().mode)) {
+            throw fs_error(EINVAL, "Not a regular file");
+        }
+        if (current->get_storage() != inode::STORAGE_BLOCKS) {
+            return false;
+        }
+
+        size_class = current->get_size_class();
+        zero_block = zero_block_of(*current);
+        const uint64_t block_size = block_size_of(*current);
+        const auto pending = pending_writes.find(number);
+        for (uint64_t position = offset; position < end; )
+        {
+            staged_t block { .index = position / block_size, .in_block = position % block_size,
+                .length = std::min(block_size - position % block_size, end - position), .content = std::nullopt };
+            const uint8_t * bytes = data + (position - offset);
+            position += block.length;
+            if (block.length == block_size) {
+                block.content.emplace(bytes, bytes + block_size);
+            }
+            else if (options.write_buffer_blocks != 0)
+            {
+                // a partial block is only read, merged and hashed once, when nothing more is coming for it
+                if (pending != pending_writes.end())
+                {
+                    if (const auto held = pending->second.find(block.index);
+                        held != pending->second.end() && held->second.completed_by(block.in_block, block.length))
+                    {
+                        block.content = held->second.data;
+                        std::memcpy(block.content->data() + block.in_block, bytes, block.length);
+                    }
+                }
+            }
+            else
+            {
+                const auto existing = current->get_block_map().lookup(block.index);
+                block.content = existing ? load_block(*current, block.index, *existing) : std::vector < uint8_t > (block_size, 0);
+                std::memcpy(block.content->data() + block.in_block, bytes, block.length);
+            }
+            staged.push_back(std::move(block));
+        }
+    }
+
+    for (auto & block : staged)
+    {
+        if (block.content) {
+            block.block_id = store_block(writer.stream, *block.content);
+        }
+    }
+
+    std::unique_lock lock(metadata_lock);
+    inode & node = mutable_inode(number);
+    if (node.get_storage() != inode::STORAGE_BLOCKS || node.get_size_class() != size_class) {
+        return false;   // moved inline by a commit meanwhile, what was stored is just not referenced
+    }
+
+    const uint64_t block_size = block_size_of(node);
+    auto & pending = pending_writes[number];
+    std::vector < log_manager::log_t > logs;
+    for (const auto & block : staged)
+    {
+        if (block.content)
+        {
+            node.get_block_map().set(block.index, block.block_id);
+            if (block.block_id != zero_block) {
+                logs.push_back(log_manager::make_log(LOG_WRITE_BLOCK, block.block_id));
+            }
+            if (pending.erase(block.index) != 0) {
+                pending_block_count--;
+            }
+            continue;
+        }
+
+        auto it = pending.find(block.index);
+        if (it == pending.end())
+        {
+            it = pending.emplace(block.index, pending_block_t { .data = std::vector < uint8_t > (block_size), .written = { } }).first;
+            pending_block_count++;
+        }
+        it->second.add(block.in_block, data + (block.index * block_size + block.in_block - offset), block.length);
+    }
+
+    if (pending.empty()) {
+        pending_writes.erase(number);
+    }
+    if (!logs.empty()) {
+        journal.append_logs(std::move(logs));
+    }
+    auto & attributes = node.get_attributes();
+    attributes.size = std::max(attributes.size, end);
+    attributes.mtime = attributes.ctime = now();
+    return true;
+}
+
+void cow_filesystem::store_pending(const uint64_t number, writer_t & writer)
+{
+    struct staged_t
+    {
+        uint64_t index;
+        std::vector < uint8_t > content;
+        uint64_t block_id = 0;
+    };
+
+    std::vector < staged_t > staged;
+    uint64_t zero_block;
+    {
+        std::shared_lock lock(metadata_lock);
+        const auto pending = pending_writes.find(number);
+        const auto current = pending == pending_writes.end() ? nullptr : get_inode(number);
+        if (!current) {
+            return;
+        }
+
+        zero_block = zero_block_of(*current);
+        for (const auto & [index, block] : pending->second)
+        {
+            const auto existing = current->get_block_map().lookup(index);
+            auto content = existing ? load_block(*current, index, *existing) : std::vector < uint8_t > (block_size_of(*current), 0);
+            block.overlay(content);
+            staged.push_back(staged_t { .index = index, .content = std::move(content) });
+        }
+    }
+
+    for (auto & block : staged) {
+        block.block_id = store_block(writer.stream, block.content);
+    }
+
+    std::unique_lock lock(metadata_lock);
+    const auto pending = pending_writes.find(number);
+    if (pending == pending_writes.end()) {
+        return;
+    }
+
+    // a block no longer held was stored by a commit meanwhile, to the same content: writes to it wait for the writer
+    inode & node = mutable_inode(number);
+    std::vector < log_manager::log_t > logs;
+    for (const auto & block : staged)
+    {
+        if (pending->second.erase(block.index) == 0) {
+            continue;
+        }
+
+        pending_block_count--;
+        node.get_block_map().set(block.index, block.block_id);
+        if (block.block_id != zero_block) {
+            logs.push_back(log_manager::make_log(LOG_WRITE_BLOCK, block.block_id));
+        }
+    }
+
+    if (pending->second.empty()) {
+        pending_writes.erase(pending);
+    }
+    if (!logs.empty()) {
+        journal.append_logs(std::move(logs));
+    }
+}
+
+void cow_filesystem::store_all_pending()
+{
+    std::vector < uint64_t > numbers;
+    {
+        std::shared_lock lock(metadata_lock);
+        for (const auto & number : pending_writes | std::views::keys) {
+            numbers.push_back(number);
+        }
+    }
+
+    for (const uint64_t number : numbers)
+    {
+        const writer_lock_t writer(*this, number);
+        store_pending(number, writer.get());
+    }
+}
+
+void cow_filesystem::flush_pending(const uint64_t number)
+{
+    const auto it = pending_writes.find(number);
+    if (it == pending_writes.end()) {
+        return;
+    }
+
+    const auto pending = std::move(it->second);
+    pending_writes.erase(it);
+    pending_block_count -= pending.size();
+
+    inode & node = mutable_inode(number);
+    std::vector < log_manager::log_t > logs;
+    for (const auto & [index, block] : pending)
+    {
+        std::vector < uint8_t > content(block_size_of(node), 0);
+        if (const auto existing = node.get_block_map().lookup(index)) {
+            content = load_block(node, index, *existing);
+        }
+        block.overlay(content);
+
+        const uint64_t block_id = blocks.write_in_block(content);
+        node.get_block_map().set(index, block_id);
+        if (block_id != zero_block_of(node)) {
+            logs.push_back(log_manager::make_log(LOG_WRITE_BLOCK, block_id));
+        }
+    }
+
+    if (!logs.empty()) {
+        journal.append_logs(std::move(logs));
+    }
+}
+
+void cow_filesystem::flush_all_pending()
+{
+    while (!pending_writes.empty()) {
+        flush_pending(pending_writes.begin()->first);
+    }
+}
+
+[[nodiscard]] bool cow_filesystem::has_pending(const inode & node, const uint64_t offset, const uint64_t size) const
+{
+    const auto it = pending_writes.find(node.get_number());
+    if (it == pending_writes.end() || size == 0) {
+        return false;
+    }
+
+    const uint64_t block_size = block_size_of(node);
+    const auto first = it->second.lower_bound(offset / block_size);
+    return first != it->second.end() && first->first <= (offset + size - 1) / block_size;
+}
+
+void cow_filesystem::write_upper(inode & node, const uint64_t offset, const uint8_t * data, const uint64_t size)
+{
+    auto & attributes = node.get_attributes();
+    const uint64_t end = offset + size;
+    if (node.get_storage() == inode::STORAGE_INLINE)
+    {
+        if (std::max(attributes.size, end) <= table.get_inline_threshold())
+        {
+            auto content = node.get_inline_data();
+            content.resize(std::max(attributes.size, end), 0);
+            std::memcpy(content.data() + offset, data, size);
+            attributes.size = content.size();
+            node.set_inline_data(std::move(content));
+            return;
+        }
+
+        table.spill(node);
+    }
+
+    const uint64_t block_size = block_size_of(node);
+    std::vector < log_manager::log_t > logs;
+    for (uint64_t position = offset; position < end; )
+    {
+        const uint64_t index = position / block_size;
+        const uint64_t in_block = position % block_size;
+        const uint64_t length = std::min(block_size - in_block, end - position);
+
+        std::vector < uint8_t > block;
+        if (length == block_size) {
+            block.assign(data + (position - offset), data + (position - offset) + block_size);
+        } else if (const auto existing = node.get_block_map().lookup(index)) {
+            block = load_block(node, index, *existing);
+        } else {
+            block.assign(block_size, 0);
+        }
+
+        if (length != block_size) {
+            std::memcpy(block.data() + in_block, data + (position - offset), length);
+        }
+
+        const uint64_t block_id = blocks.write_in_block(block);
+        node.get_block_map().set(index, block_id);
+        if (block_id != zero_block_of(node)) {
+            logs.push_back(log_manager::make_log(LOG_WRITE_BLOCK, block_id));
+        }
+        position += length;
+    }
+
+    if (!logs.empty()) {
+        journal.append_logs(std::move(logs));
+    }
+    attributes.size = std::max(attributes.size, end);
+}
+
+void cow_filesystem::truncate_upper(inode & node, const uint64_t size)
+{
+    flush_pending(node.get_number());
+    auto & attributes = node.get_attributes();
+    if (node.get_storage() == inode::STORAGE_INLINE)
+    {
+        if (size <= table.get_inline_threshold())
+        {
+            auto content = node.get_inline_data();
+            content.resize(size, 0);
+            attributes.size = size;
+            node.set_inline_data(std::move(content));
+            return;
+        }
+
+        table.spill(node);
+    }
+
+    const uint64_t block_size = block_size_of(node);
+    if (size < attributes.size)
+    {
+        node.get_block_map().truncate((size + block_size - 1) / block_size);
+
+        // the tail of the last block must read as zeros if the file grows again
+        if (const uint64_t in_block = size % block_size; in_block != 0)
+        {
+            if (const auto existing = node.get_block_map().lookup(size / block_size))
+            {
+                auto block = load_block(node, size / block_size, *existing);
+                std::fill(block.begin() + static_cast<ssize_t>(in_block), block.end(), 0);
+                const uint64_t block_id = blocks.write_in_block(block);
+                node.get_block_map().set(size / block_size, block_id);
+                if (block_id != zero_block_of(node)) {
+                    journal.append_log(LOG_WRITE_BLOCK, block_id);
+                }
+            }
+        }
+    }
+
+    attributes.size = size;
+}
+
+void cow_filesystem::commit_locked()
+{
+    if (!dirty || options.read_only) {
+        return;
+    }
+
+    flush_all_pending();
+    flush_dirty();
+    journal.append_log(LOG_ROOT_UPDATE, table_root, next_inode.load());
+    journal.commit();
+    dirty = false;
+}
+
+[[nodiscard]] cow_filesystem::entry_t cow_filesystem::lookup(const uint64_t parent, const std::string & name)
+{
+    check_name(name);
+    std::shared_lock lock(metadata_lock);
+    const node_t dir = node_of(parent);
+    const auto resolved = resolve(parent, dir, name);
+    if (!resolved) {
+        throw fs_error(ENOENT, name + " not found");
+    }
+
+    const uint64_t node_id = remember(resolved->node_id, parent, name, resolved->upper, resolved->lower_path, 1);
+    return entry_t { .node_id = node_id, .attributes = stat_of(node_id, node_of(node_id)) };
+}
+
+void cow_filesystem::forget(const uint64_t node_id, const uint64_t count)
+{
+    bool released_upper = false;
+    {
+        std::lock_guard lock(nodes_mutex);
+        const auto it = nodes.find(node_id);
+        if (it == nodes.end() || node_id == root_node_id) {
+            return;
+        }
+
+        it->second.lookups -= std::min(count, it->second.lookups);
+        if (it->second.lookups != 0) {
+            return;
+        }
+
+        if (!it->second.upper && it->second.lower_path)
+        {
+            if (const auto lower = lower_nodes.find(*it->second.lower_path);
+                lower != lower_nodes.end() && lower->second == node_id)
+            {
+                lower_nodes.erase(lower);
+            }
+        }
+        released_upper = it->second.upper;
+        nodes.erase(it);
+    }
+
+    if (!released_upper || options.read_only) {
+        return;
+    }
+
+    // an unlinked inode lives until the kernel lets go of it
+    std::unique_lock lock(metadata_lock);
+    {
+        std::lock_guard nodes_lock(nodes_mutex);
+        if (nodes.contains(node_id)) {
+            return;
+        }
+    }
+
+    if (const auto current = get_inode(node_id); current && current->get_attributes().nlink == 0) {
+        drop_inode(node_id);
+    }
+}
+
+[[nodiscard]] struct stat cow_filesystem::getattr(const uint64_t node_id)
+{
+    std::shared_lock lock(metadata_lock);
+    return stat_of(node_id, node_of(node_id));
+}
+
+[[nodiscard]] struct stat cow_filesystem::setattr(const uint64_t node_id, const struct stat & attributes, const uint32_t to_set)
+{
+    std::optional < writer_lock_t > writer;
+    if (to_set & SET_SIZE)
+    {
+        writer.emplace(*this, node_id);
+        store_pending(node_id, writer->get());
+    }
+
+    std::unique_lock lock(metadata_lock);
+    check_writable();
+    copy_up(node_id);
+    inode & node = mutable_inode(node_id);
+    auto & current = node.get_attributes();
+    const timespec time = now();
+
+    if (to_set & SET_MODE) {
+        current.mode = (current.mode & S_IFMT) | (attributes.st_mode & ~S_IFMT);
+    }
+    if (to_set & SET_UID) {
+        current.uid = attributes.st_uid;
+    }
+    if (to_set & SET_GID) {
+        current.gid = attributes.st_gid;
+    }
+    if (to_set & SET_SIZE)
+    {
+        if (!S_ISREG(current.mode)) {
+            throw fs_error(S_ISDIR(current.mode) ? EISDIR : EINVAL, "Cannot truncate a non-regular file");
+        }
+        hint_size(node, static_cast<uint64_t>(attributes.st_size));
+        truncate_upper(node, static_cast<uint64_t>(attributes.st_size));
+        current.mtime = time;
+    }
+    if (to_set & SET_ATIME) {
+        current.atime = attributes.st_atim;
+    }
+    if (to_set & SET_ATIME_NOW) {
+        current.atime = time;
+    }
+    if (to_set & SET_MTIME) {
+        current.mtime = attributes.st_mtim;
+    }
+    if (to_set & SET_MTIME_NOW) {
+        current.mtime = time;
+    }
+    current.ctime = (to_set & SET_CTIME) ? attributes.st_ctim : time;
+
+    return stat_of(node);
+}
+
+[[nodiscard]] std::string cow_filesystem::readlink(const uint64_t node_id)
+{
+    std::shared_lock lock(metadata_lock);
+    const node_t node = node_of(node_id);
+    if (node.upper)
+    {
+        const auto current = get_inode(node_id);
+        if (!S_ISLNK(current->get_attributes().mode)) {
+            throw fs_error(EINVAL, "Not a symbolic link");
+        }
+        const auto target = read_upper(*current, 0, current->get_attributes().size);
+        return { target.begin(), target.end() };
+    }
+
+    std::vector < char > target(PATH_MAX);
+    const ssize_t length = ::readlink(lower_full_path(*node.lower_path).c_str(), target.data(), target.size());
+    if (length < 0) {
+        throw fs_error(errno, "Cannot read lower link " + *node.lower_path);
+    }
+    return { target.data(), static_cast<size_t>(length) };
+}
+
+[[nodiscard]] cow_filesystem::entry_t cow_filesystem::mknod(const uint64_t parent, const std::string & name,
+    const uint32_t mode, const uint64_t rdev, const uint32_t uid, const uint32_t gid)
+{
+    return make_node(parent, name, mode, uid, gid, rdev, "");
+}
+
+[[nodiscard]] cow_filesystem::entry_t cow_filesystem::mkdir(const uint64_t parent, const std::string & name,
+    const uint32_t mode, const uint32_t uid, const uint32_t gid)
+{
+    return make_node(parent, name, S_IFDIR | (mode & ~S_IFMT), uid, gid, 0, "");
+}
+
+[[nodiscard]] cow_filesystem::entry_t cow_filesystem::symlink(const uint64_t parent, const std::string & name,
+    const std::string & target, const uint32_t uid, const uint32_t gid)
+{
+    return make_node(parent, name, S_IFLNK | 0777, uid, gid, 0, target);
+}
+
+[[nodiscard]] cow_filesystem::entry_t cow_filesystem::link(const uint64_t node_id, const uint64_t new_parent,
+    const std::string & new_name)
+{
+    check_name(new_name);
+    std::unique_lock lock(metadata_lock);
+    check_writable();
+    const node_t source = node_of(node_id);
+    if (S_ISDIR(stat_of(node_id, source).st_mode)) {
+        throw fs_error(EPERM, "Cannot hard link a directory");
+    }
+    if (resolve(new_parent, node_of(new_parent), new_name)) {
+        throw fs_error(EEXIST, new_name + " exists");
+    }
+
+    copy_up(node_id);
+    copy_up(new_parent);
+    inode & node = mutable_inode(node_id);
+    node.get_attributes().nlink++;
+    node.get_attributes().ctime = now();
+    add_entry(new_parent, new_name, dirent_t { .name = new_name, .inode = node_id,
+        .type = dirent_type_of(node.get_attributes().mode) });
+
+    (void)remember(node_id, new_parent, new_name, true, std::nullopt, 1);
+    return entry_t { .node_id = node_id, .attributes = stat_of(node) };
+}
+
+void cow_filesystem::unlink(const uint64_t parent, const std::string & name)
+{
+    std::unique_lock lock(metadata_lock);
+    check_writable();
+    const auto resolved = resolve(parent, node_of(parent), name);
+    if (!resolved) {
+        throw fs_error(ENOENT, name + " not found");
+    }
+
+    const node_t target = as_node(*resolved);
+    if (S_ISDIR(stat_of(resolved->node_id, target).st_mode)) {
+        throw fs_error(EISDIR, name + " is a directory");
+    }
+
+    copy_up(parent);
+    remove_entry(parent, node_of(parent), name);
+    if (resolved->upper)
+    {
+        inode & node = mutable_inode(resolved->node_id);
+        node.get_attributes().nlink--;
+        node.get_attributes().ctime = now();
+
+        std::lock_guard nodes_lock(nodes_mutex);
+        if (node.get_attributes().nlink == 0 && !nodes.contains(resolved->node_id)) {
+            drop_inode(resolved->node_id);
+        }
+    }
+}
+
+void cow_filesystem::rmdir(const uint64_t parent, const std::string & name)
+{
+    std::unique_lock lock(metadata_lock);
+    check_writable();
+    const auto resolved = resolve(parent, node_of(parent), name);
+    if (!resolved) {
+        throw fs_error(ENOENT, name + " not found");
+    }
+
+    const node_t target = as_node(*resolved);
+    if (!S_ISDIR(stat_of(resolved->node_id, target).st_mode)) {
+        throw fs_error(ENOTDIR, name + " is not a directory");
+    }
+    if (!is_empty_dir(resolved->node_id, target)) {
+        throw fs_error(ENOTEMPTY, name + " is not empty");
+    }
+
+    copy_up(parent);
+    remove_entry(parent, node_of(parent), name);
+    if (resolved->upper && !resolved->lower_path) {
+        // only directories created in the upper layer count towards the parent's links
+        mutable_inode(parent).get_attributes().nlink--;
+    }
+    if (resolved->upper)
+    {
+        mutable_inode(resolved->node_id).get_attributes().nlink = 0;
+        std::lock_guard nodes_lock(nodes_mutex);
+        if (!nodes.contains(resolved->node_id)) {
+            drop_inode(resolved->node_id);
+        }
+    }
+}
+
+void cow_filesystem::rename(const uint64_t parent, const std::string & name, const uint64_t new_parent,
+    const std::string & new_name, const uint32_t flags)
+{
+    constexpr uint32_t rename_noreplace = 1;
+    check_name(new_name);
+    if (flags & ~rename_noreplace) {
+        throw fs_error(EINVAL, "Unsupported rename flags");
+    }
+
+    std::unique_lock lock(metadata_lock);
+    check_writable();
+    const auto source = resolve(parent, node_of(parent), name);
+    if (!source) {
+        throw fs_error(ENOENT, name + " not found");
+    }
+
+    const node_t source_node = as_node(*source);
+    const uint32_t source_mode = stat_of(source->node_id, source_node).st_mode;
+    const bool source_dir = S_ISDIR(source_mode);
+    if (source_dir && (!source->upper || source->lower_path)) {
+        // like overlayfs without redirects: a directory with lower content cannot move
+        throw fs_error(EXDEV, "Cannot rename a merged directory");
+    }
+
+    const auto target = resolve(new_parent, node_of(new_parent), new_name);
+    if (target)
+    {
+        if (flags & rename_noreplace) {
+            throw fs_error(EEXIST, new_name + " exists");
+        }
+        if (target->upper == source->upper && target->node_id == source->node_id && target->lower_path == source->lower_path) {
+            return;
+        }
+
+        const node_t target_node = as_node(*target);
+        const bool target_dir = S_ISDIR(stat_of(target->node_id, target_node).st_mode);
+        if (source_dir && !target_dir) {
+            throw fs_error(ENOTDIR, new_name + " is not a directory");
+        }
+        if (!source_dir && target_dir) {
+            throw fs_error(EISDIR, new_name + " is a directory");
+        }
+        if (target_dir && !is_empty_dir(target->node_id, target_node)) {
+            throw fs_error(ENOTEMPTY, new_name + " is not empty");
+        }
+    }
+
+    if (source_dir)
+    {
+        // a directory cannot move below itself
+        for (uint64_t ancestor = new_parent; ; ancestor = node_of(ancestor).parent)
+        {
+            if (ancestor == source->node_id) {
+                throw fs_error(EINVAL, "Cannot move a directory below itself");
+            }
+            if (ancestor == root_node_id) {
+                break;
+            }
+        }
+    }
+
+    const uint64_t source_id = remember(source->node_id, parent, name, source->upper, source->lower_path, 0);
+    copy_up(source_id);
+    copy_up(parent);
+    copy_up(new_parent);
+
+    if (target && target->upper)
+    {
+        inode & replaced = mutable_inode(target->node_id);
+        replaced.get_attributes().nlink = S_ISDIR(replaced.get_attributes().mode) ? 0 : replaced.get_attributes().nlink - 1;
+        replaced.get_attributes().ctime = now();
+        if (source_dir && !target->lower_path) {
+            mutable_inode(new_parent).get_attributes().nlink--;
+        }
+
+        std::lock_guard nodes_lock(nodes_mutex);
+        if (replaced.get_attributes().nlink == 0 && !nodes.contains(target->node_id)) {
+            drop_inode(target->node_id);
+        }
+    }
+
+    add_entry(new_parent, new_name, dirent_t { .name = new_name, .inode = source_id, .type = dirent_type_of(source_mode) });
+    remove_entry(parent, node_of(parent), name);
+    if (source_dir && parent != new_parent)
+    {
+        mutable_inode(parent).get_attributes().nlink--;
+        mutable_inode(new_parent).get_attributes().nlink++;
+    }
+    mutable_inode(source_id).get_attributes().ctime = now();
+
+    std::lock_guard nodes_lock(nodes_mutex);
+    auto & moved = nodes[source_id];
+    moved.parent = new_parent;
+    moved.name = new_name;
+}
+
+[[nodiscard]] std::unique_ptr < cow_filesystem::file_handle_t > cow_filesystem::open(const uint64_t node_id, const int flags)
+{
+    auto handle = std::make_unique<file_handle_t>();
+    if ((flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC))
+    {
+        std::optional < writer_lock_t > writer;
+        if (flags & O_TRUNC) {
+            writer.emplace(*this, node_id);
+        }
+        std::unique_lock lock(metadata_lock);
+        check_writable();
+        copy_up(node_id);
+        if (flags & O_TRUNC)
+        {
+            inode & node = mutable_inode(node_id);
+            truncate_upper(node, 0);
+            node.get_attributes().mtime = node.get_attributes().ctime = now();
+        }
+
+        if (const auto current = get_inode(node_id); !current->get_lower_origin().empty()) {
+            handle->lower_fd = ::open(lower_full_path(current->get_lower_origin()).c_str(), O_RDONLY | O_CLOEXEC);
+        }
+        return handle;
+    }
+
+    std::shared_lock lock(metadata_lock);
+    if (const node_t node = node_of(node_id); !node.upper)
+    {
+        handle->unmodified = true;
+        handle->lower_fd = ::open(lower_full_path(*node.lower_path).c_str(), O_RDONLY | O_CLOEXEC);
+        if (handle->lower_fd < 0) {
+            throw fs_error(errno, "Cannot open lower " + *node.lower_path);
+        }
+    }
+    else if (const auto current = get_inode(node_id); !current->get_lower_origin().empty())
+    {
+        // keep the origin open for the blocks not copied up yet, a failure only costs an open per read
+        handle->lower_fd = ::open(lower_full_path(current->get_lower_origin()).c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    return handle;
+}
+
+[[nodiscard]] std::vector < uint8_t > cow_filesystem::read(const uint64_t node_id, const file_handle_t & handle,
+    const uint64_t offset, const uint64_t size)
+{
+    std::shared_lock lock(metadata_lock);
+    const node_t node = node_of(node_id);
+    if (node.upper)
+    {
+        const auto current = get_inode(node_id);
+        read_ahead_of(*current, handle, offset, size);
+        return read_upper(*current, offset, size, handle.lower_fd);
+    }
+
+    if (handle.lower_fd < 0) {
+        throw fs_error(EBADF, "Lower file is not open");
+    }
+
+    std::vector < uint8_t > result(size);
+    uint64_t done = 0;
+    while (done < size)
+    {
+        const ssize_t got = ::pread(handle.lower_fd, result.data() + done, size - done, static_cast<off_t>(offset + done));
+        if (got < 0) {
+            throw fs_error(errno, "Cannot read lower " + *node.lower_path);
+        }
+        if (got == 0) {
+            break;
+        }
+        done += static_cast<uint64_t>(got);
+    }
+    result.resize(done);
+    return result;
+}
+
+[[nodiscard]] std::vector < cow_filesystem::read_piece_t > cow_filesystem::read_pieces(const uint64_t node_id,
+    const file_handle_t & handle, const uint64_t offset, uint64_t size)
+{
+    std::vector < read_piece_t > pieces;
+    auto add_bytes = [&](const uint8_t * data, const uint64_t length)
+    {
+        if (pieces.empty() || pieces.back().fd >= 0) {
+            pieces.emplace_back();
+        }
+        auto & piece = pieces.back();
+        piece.data.insert(piece.data.end(), data, data + length);
+        piece.length += length;
+    };
+
+    std::shared_lock lock(metadata_lock);
+    const node_t node = node_of(node_id);
+    if (!node.upper)
+    {
+        struct stat st { };
+        if (handle.lower_fd < 0 || fstat(handle.lower_fd, &st) != 0) {
+            throw fs_error(EBADF, "Lower file is not open");
+        }
+
+        const auto file_size = static_cast<uint64_t>(st.st_size);
+        if (offset < file_size)
+        {
+            auto & piece = pieces.emplace_back();
+            piece.fd = handle.lower_fd;
+            piece.fd_offset = offset;
+            piece.length = std::min(size, file_size - offset);
+        }
+        return pieces;
+    }
+
+    const auto current = get_inode(node_id);
+    const uint64_t file_size = current->get_attributes().size;
+    if (offset >= file_size) {
+        return pieces;
+    }
+    size = std::min(size, file_size - offset);
+
+    if (current->get_storage() == inode::STORAGE_INLINE || has_pending(*current, offset, size))
+    {
+        const auto data = read_upper(*current, offset, size, handle.lower_fd);
+        add_bytes(data.data(), data.size());
+        return pieces;
+    }
+
+    read_ahead_of(*current, handle, offset, size);
+
+    // blocks still in the lower file are spliced from it as far as it reaches
+    uint64_t lower_size = 0;
+    if (struct stat st { }; handle.lower_fd >= 0 && fstat(handle.lower_fd, &st) == 0) {
+        lower_size = static_cast<uint64_t>(st.st_size);
+    }
+
+    const uint64_t block_size = block_size_of(*current);
+    const std::vector < uint8_t > zeros(block_size, 0);
+    uint64_t open_fds = 0;
+    for (uint64_t position = offset; position < offset + size; )
+    {
+        const uint64_t in_block = position % block_size;
+        const uint64_t length = std::min(block_size - in_block, offset + size - position);
+        if (const auto block = current->block_at(position, block_size))
+        {
+            if (*block == block_map::lower_block)
+            {
+                if (position + length <= lower_size && !pieces.empty() && pieces.back().fd == handle.lower_fd
+                    && pieces.back().fd_offset + pieces.back().length == position)
+                {
+                    pieces.back().length += length;
+                }
+                else if (position + length <= lower_size)
+                {
+                    auto & piece = pieces.emplace_back();
+                    piece.fd = handle.lower_fd;
+                    piece.fd_offset = position;
+                    piece.length = length;
+                }
+                else
+                {
+                    const auto data = load_block(*current, position / block_size, *block, handle.lower_fd);
+                    add_bytes(data.data() + in_block, length);
+                }
+            }
+            else if (const auto cached = block_cache.get(*block); cached && (*cached)->size() == block_size)
+            {
+                add_bytes((*cached)->data() + in_block, length);
+            }
+            else if (const int fd = open_fds < max_read_fds ? blocks.open_raw_block(*block, current->get_size_class()) : -1; fd >= 0)
+            {
+                open_fds++;
+                auto & piece = pieces.emplace_back();
+                piece.fd = fd;
+                piece.owns_fd = true;
+                piece.fd_offset = in_block;
+                piece.length = length;
+            }
+            else
+            {
+                const auto data = cached_block(*block, current->get_size_class());
+                add_bytes(data->data() + in_block, length);
+            }
+        }
+        else
+        {
+            add_bytes(zeros.data(), length);
+        }
+        position += length;
+    }
+    return pieces;
+}
+
+cow_filesystem::writer_lock_t::writer_lock_t(cow_filesystem & filesystem, const uint64_t number)
+    : filesystem(filesystem), number(number)
+{
+    {
+        std::lock_guard writers_lock(filesystem.writers_mutex);
+        auto & slot = filesystem.writers[number];
+        if (!slot) {
+            slot = std::make_shared<writer_t>();
+        }
+        writer = slot;
+    }
+    lock = std::unique_lock(writer->mutex);
+}
+
+cow_filesystem::writer_lock_t::~writer_lock_t()
+{
+    const bool idle = writer->stream.blocks == 0 && !writer->stream.bypass;
+    lock.unlock();
+    std::lock_guard writers_lock(filesystem.writers_mutex);
+    writer.reset();
+    if (const auto it = filesystem.writers.find(number);
+        idle && it != filesystem.writers.end() && it->second.use_count() == 1)
+    {
+        filesystem.writers.erase(it);
+    }
+}
+
+[[nodiscard]] uint64_t cow_filesystem::write(const uint64_t node_id, const uint64_t offset, const uint8_t * data, const uint64_t size)
+{
+    {
+        const writer_lock_t writer(*this, node_id);
+        while (!write_blocks(node_id, writer.get(), offset, data, size))
+        {
+            // copying up, and writing content that stays inline, is done under the lock, anything larger spills first
+            std::unique_lock lock(metadata_lock);
+            check_writable();
+            copy_up(node_id);
+            inode & node = mutable_inode(node_id);
+            auto & attributes = node.get_attributes();
+            if (!S_ISREG(attributes.mode)) {
+                throw fs_error(EINVAL, "Not a regular file");
+            }
+            if (node.get_storage() == inode::STORAGE_INLINE && std::max(attributes.size, offset + size) <= table.get_inline_threshold())
+            {
+                write_upper(node, offset, data, size);
+                attributes.mtime = attributes.ctime = now();
+                return size;
+            }
+            table.spill(node);
+        }
+    }
+
+    if (pending_block_count > options.write_buffer_blocks) {
+        store_all_pending();
+    }
+    return size;
+}
+
+void cow_filesystem::flush(const uint64_t node_id)
+{
+    const writer_lock_t writer(*this, node_id);
+    store_pending(node_id, writer.get());
+    writer.get().stream = { };
+}
+
+[[nodiscard]] uint64_t cow_filesystem::seek(const uint64_t node_id, const file_handle_t & handle, const uint64_t offset,
+    const int whence)
+{
+    if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+        throw fs_error(EINVAL, "Only SEEK_DATA and SEEK_HOLE are served");
+    }
+
+    // held back writes are not in the block map yet, they are stored before it is searched
+    const writer_lock_t writer(*this, node_id);
+    store_pending(node_id, writer.get());
+    std::shared_lock lock(metadata_lock);
+    if (!node_of(node_id).upper)
+    {
+        if (handle.lower_fd < 0) {
+            throw fs_error(EBADF, "Lower file is not open");
+        }
+
+        const off_t result = ::lseek(handle.lower_fd, static_cast<off_t>(offset), whence);
+        if (result < 0) {
+            throw fs_error(errno, "Cannot seek in lower file");
+        }
+        return static_cast<uint64_t>(result);
+    }
+
+    const auto current = get_inode(node_id);
+    const uint64_t file_size = current->get_attributes().size;
+    if (offset >= file_size) {
+        throw fs_error(ENXIO, "Offset is past the end of the file");
+    }
+    if (current->get_storage() != inode::STORAGE_BLOCKS) {
+        return whence == SEEK_DATA ? offset : file_size;
+    }
+
+    // holes are unmapped blocks; blocks still in the lower file are asked about where the lower file has holes,
+    // through the origin opened here if the handle has none. Lower blocks nobody can ask about are data
+    int lower_fd = handle.lower_fd;
+    if (lower_fd < 0 && !current->get_lower_origin().empty()) {
+        lower_fd = ::open(lower_full_path(current->get_lower_origin()).c_str(), O_RDONLY | O_CLOEXEC);
+    }
+
+    const uint64_t block_size = block_size_of(*current);
+    const auto & map = current->get_block_map();
+    const auto is_lower = [](const std::optional < block_map::block_id_t > block) { return block == block_map::lower_block; };
+    const auto search = [&]() -> std::optional < uint64_t >
+    {
+        for (uint64_t position = offset; position < file_size; )
+        {
+            const auto index = map.find_next(position / block_size, [&](const std::optional < block_map::block_id_t > block)
+                { return whence == SEEK_DATA ? block.has_value() : !block || is_lower(block); });
+            if (!index) {
+                break;
+            }
+
+            position = std::max(position, *index * block_size);
+            if (position >= file_size) {
+                break;
+            }
+            if (!is_lower(map.lookup(*index))) {
+                return position;
+            }
+
+            const uint64_t run_end = map.find_next(*index, [&](const std::optional < block_map::block_id_t > block)
+                { return !is_lower(block); }).value_or(UINT64_MAX / block_size) * block_size;
+            const off_t found = lower_fd < 0 ? -1 : ::lseek(lower_fd, static_cast<off_t>(position), whence);
+            const int error = lower_fd < 0 ? EBADF : errno;
+            if (found >= 0 && static_cast<uint64_t>(found) < run_end)
+            {
+                if (whence == SEEK_HOLE) {
+                    return std::min(static_cast<uint64_t>(found), file_size);
+                }
+                if (static_cast<uint64_t>(found) < file_size) {
+                    return static_cast<uint64_t>(found);
+                }
+                break;
+            }
+
+            // past the end of the lower file, which reads as zeros
+            if (found < 0 && error == ENXIO && whence == SEEK_HOLE) {
+                return position;
+            }
+            if (found < 0 && error != ENXIO && whence == SEEK_DATA) {
+                return position;
+            }
+            position = run_end;
+        }
+        return std::nullopt;
+    };
+
+    std::optional < uint64_t > result;
+    try {
+        result = search();
+    } catch (...) {
+        if (lower_fd >= 0 && lower_fd != handle.lower_fd) {
+            ::close(lower_fd);
+        }
+        throw;
+    }
+    if (lower_fd >= 0 && lower_fd != handle.lower_fd) {
+        ::close(lower_fd);
+    }
+
+    if (result) {
+        return *result;
+    }
+    if (whence == SEEK_DATA) {
+        throw fs_error(ENXIO, "No data past the offset");
+    }
+    return file_size;
+}
+
+void cow_filesystem::zero_upper(inode & node, const uint64_t offset, const uint64_t end)
+{
+    const uint64_t block_size = block_size_of(node);
+    const uint64_t first_full = (offset + block_size - 1) / block_size;
+    const uint64_t end_full = end / block_size;
+    if (node.get_storage() != inode::STORAGE_BLOCKS || first_full >= end_full)
+    {
+        const std::vector < uint8_t > zeros(end - offset, 0);
+        write_upper(node, offset, zeros.data(), zeros.size());
+        return;
+    }
+
+    // partial blocks at either edge are rewritten, whole blocks in between become holes without being hashed
+    const std::vector < uint8_t > zeros(block_size, 0);
+    if (offset < first_full * block_size) {
+        write_upper(node, offset, zeros.data(), first_full * block_size - offset);
+    }
+    node.get_block_map().punch(first_full, end_full - first_full);
+    if (end > end_full * block_size) {
+        write_upper(node, end_full * block_size, zeros.data(), end - end_full * block_size);
+    }
+}
+
+void cow_filesystem::fallocate(const uint64_t node_id, const int mode, const uint64_t offset, const uint64_t length)
+{
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)
+        || ((mode & FALLOC_FL_PUNCH_HOLE) && (mode & FALLOC_FL_ZERO_RANGE))
+        || ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)))
+    {
+        throw fs_error(EOPNOTSUPP, "Unsupported fallocate mode");
+    }
+    if (length == 0) {
+        throw fs_error(EINVAL, "Empty fallocate range");
+    }
+
+    const writer_lock_t writer(*this, node_id);
+    store_pending(node_id, writer.get());
+    std::unique_lock lock(metadata_lock);
+    check_writable();
+    copy_up(node_id);
+    inode & node = mutable_inode(node_id);
+    auto & attributes = node.get_attributes();
+    if (!S_ISREG(attributes.mode)) {
+        throw fs_error(S_ISDIR(attributes.mode) ? EISDIR : ENODEV, "Not a regular file");
+    }
+
+    // blocks are shared by content, reserving space for them is not possible: plain allocation only sets the size
+    const uint64_t end = offset + length;
+    if (!(mode & (FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))) {
+        hint_size(node, end);
+    }
+    if ((mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) && offset < attributes.size) {
+        zero_upper(node, offset, std::min(end, attributes.size));
+    }
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > attributes.size) {
+        truncate_upper(node, end);
+    }
+    attributes.mtime = attributes.ctime = now();
+}
+
+[[nodiscard]] std::unique_ptr < cow_filesystem::dir_handle_t > cow_filesystem::opendir(const uint64_t node_id)
+{
+    std::shared_lock lock(metadata_lock);
+    const node_t node = node_of(node_id);
+    if (!S_ISDIR(stat_of(node_id, node).st_mode)) {
+        throw fs_error(ENOTDIR, "Not a directory");
+    }
+
+    auto handle = std::make_unique<dir_handle_t>();
+    if (node.lower_path) {
+        handle->lower_entries = list_lower(*node.lower_path);
+    }
+    return handle;
+}
+
+void cow_filesystem::readdir(const uint64_t node_id, const dir_handle_t & handle, const uint64_t cookie,
+    const readdir_callback_t & callback)
+{
+    std::shared_lock lock(metadata_lock);
+    const node_t node = node_of(node_id);
+    if (cookie < 1 && !callback(".", node_id, S_IFDIR, 1)) {
+        return;
+    }
+    if (cookie < 2 && !callback("..", node.parent, S_IFDIR, 2)) {
+        return;
+    }
+
+    if (cookie < lower_cookie_base && node.upper)
+    {
+        bool stopped = false;
+        directories.readdir(*get_inode(node_id), cookie > 2 ? cookie - 2 : 0, [&](const dirent_t & entry, const uint64_t next) -> bool
+        {
+            if (entry.type == DIRENT_WHITEOUT) {
+                return true;
+            }
+            stopped = !callback(entry.name, entry.inode, static_cast<uint32_t>(entry.type) << 12, next + 2);
+            return !stopped;
+        });
+
+        if (stopped) {
+            return;
+        }
+    }
+
+    const uint64_t first = cookie >= lower_cookie_base ? cookie - lower_cookie_base : 0;
+    for (uint64_t i = first; i < handle.lower_entries.size(); i++)
+    {
+        const auto & [name, type] = handle.lower_entries[i];
+        if (upper_entry(node, node_id, name)) {
+            continue;
+        }
+
+        uint64_t ino = UINT32_MAX;
+        {
+            std::lock_guard nodes_lock(nodes_mutex);
+            if (const auto it = lower_nodes.find(child_path(*node.lower_path, name)); it != lower_nodes.end()) {
+                ino = it->second;
+            }
+        }
+
+        if (!callback(name, ino, static_cast<uint32_t>(type) << 12, lower_cookie_base + i + 1)) {
+            return;
+        }
+    }
+}
+
+[[nodiscard]] struct statvfs cow_filesystem::statfs() const
+{
+    struct statvfs st { };
+    if (::statvfs(blocks.get_data_dir().c_str(), &st) != 0) {
+        throw fs_error(errno, "Cannot stat the data directory");
+    }
+
+    // report the store in units of our own blocks
+    const uint64_t scale = std::max<uint64_t>(st.f_frsize, 1);
+    const uint64_t block_size = blocks.get_block_size();
+    st.f_blocks = st.f_blocks * scale / block_size;
+    st.f_bfree = st.f_bfree * scale / block_size;
+    st.f_bavail = st.f_bavail * scale / block_size;
+    st.f_bsize = block_size;
+    st.f_frsize = block_size;
+    st.f_namemax = max_name_length;
+    return st;
+}
+
+void cow_filesystem::set_invalidation_handler(invalidation_handler_t handler)
+{
+    std::unique_lock lock(metadata_lock);
+    invalidation_handler = std::move(handler);
+}
+
+void cow_filesystem::commit()
+{
+    // held back blocks are stored file by file first, leaving little to hash under the exclusive lock
+    store_all_pending();
+    std::unique_lock lock(metadata_lock);
+    commit_locked();
+}
+
+[[nodiscard]] uint64_t cow_filesystem::get_block_size() const
+{
+    return blocks.get_block_size();
+}
@@ -0,0 +1,280 @@
+#include <algorithm>
+#include "directory.h"
+using namespace cow_block;
+
+directory_index::directory_index(const cow_btree & tree) : tree(tree)
+{
+}
+
+[[nodiscard]] uint64_t directory_index::name_hash(const std::string & name)
+{
+    // FNV-1a, folded to 54 bits: cookies (hash << 7 | slot) stay below 2^61, which leaves the
+    // file system room for cookies of its own
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (const char c : name)
+    {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 0x100000001B3ULL;
+    }
+
+    return (hash ^ hash >> 54) & 0x003FFFFFFFFFFFFFULL;
+}
+
+[[nodiscard]] std::vector < directory_index::chain_entry_t > directory_index::decode_chain(const cow_btree::value_t & value)
+{
+    std::vector < chain_entry_t > chain;
+    uint64_t offset = 0;
+    auto take = [&](void * dest, const uint64_t length)
+    {
+        if (offset + length > value.size()) {
+            easy_throw_except(directory_corrupted, "Collision chain runs past its value");
+        }
+        std::memcpy(dest, value.data() + offset, length);
+        offset += length;
+    };
+
+    while (offset < value.size())
+    {
+        chain_entry_t entry { };
+        uint16_t name_length = 0;
+        take(&entry.slot, sizeof(entry.slot));
+        take(&entry.entry.type, sizeof(entry.entry.type));
+        take(&entry.entry.inode, sizeof(entry.entry.inode));
+        take(&name_length, sizeof(name_length));
+        entry.entry.name.resize(name_length);
+        take(entry.entry.name.data(), name_length);
+        chain.emplace_back(std::move(entry));
+    }
+
+    return chain;
+}
+
+[[nodiscard]] cow_btree::value_t directory_index::encode_chain(const std::vector < chain_entry_t > & chain)
+{
+    cow_btree::value_t value;
+    auto give = [&](const void * src, const uint64_t length)
+    {
+        value.insert(value.end(), static_cast<const uint8_t *>(src), static_cast<const uint8_t *>(src) + length);
+    };
+
+    for (const auto & [slot, entry] : chain)
+    {
+        const auto name_length = static_cast<uint16_t>(entry.name.size());
+        give(&slot, sizeof(slot));
+        give(&entry.type, sizeof(entry.type));
+        give(&entry.inode, sizeof(entry.inode));
+        give(&name_length, sizeof(name_length));
+        give(entry.name.data(), name_length);
+    }
+
+    return value;
+}
+
+[[nodiscard]] uint64_t directory_index::create() const
+{
+    return tree.create();
+}
+
+[[nodiscard]] std::optional < dirent_t > directory_index::lookup(const uint64_t root, const std::string & name) const
+{
+    const auto value = tree.get(root, name_hash(name));
+    if (!value) {
+        return std::nullopt;
+    }
+
+    for (auto & [slot, entry] : decode_chain(*value))
+    {
+        if (entry.name == name) {
+            return std::move(entry);
+        }
+    }
+
+    return std::nullopt;
+}
+
+[[nodiscard]] uint64_t directory_index::cookie_of(const chain_entry_t & entry)
+{
+    return name_hash(entry.entry.name) << 7 | (entry.slot + 1ULL);
+}
+
+void directory_index::place(std::vector < chain_entry_t > & entries, const dirent_t & entry)
+{
+    if (const auto it = std::ranges::find_if(entries, [&](const chain_entry_t & e) { return e.entry.name == entry.name; });
+        it != entries.end())
+    {
+        it->entry = entry;
+        return;
+    }
+
+    // entries of one hash are kept sorted by slot, take the lowest free one
+    const uint64_t hash = name_hash(entry.name);
+    uint8_t slot = 0;
+    for (const auto & existing : entries)
+    {
+        if (name_hash(existing.entry.name) != hash) {
+            continue;
+        }
+
+        if (existing.slot != slot) {
+            break;
+        }
+        slot++;
+    }
+
+    if (slot >= max_chain_length) {
+        easy_throw_except(directory_hash_chain_full, "Too many names sharing one hash with " + entry.name);
+    }
+
+    chain_entry_t placed { .slot = slot, .entry = entry };
+    const uint64_t cookie = cookie_of(placed);
+    const auto pos = std::ranges::find_if(entries, [&](const chain_entry_t & e) { return cookie_of(e) > cookie; });
+    entries.insert(pos, std::move(placed));
+}
+
+[[nodiscard]] uint64_t directory_index::insert(const uint64_t root, const dirent_t & entry) const
+{
+    const uint64_t hash = name_hash(entry.name);
+    const auto value = tree.get(root, hash);
+    auto chain = value ? decode_chain(*value) : std::vector < chain_entry_t > { };
+    place(chain, entry);
+
+    const auto encoded = encode_chain(chain);
+    if (encoded.size() > tree.get_max_value_size()) {
+        easy_throw_except(directory_hash_chain_full, "Collision chain for " + entry.name + " does not fit a node");
+    }
+
+    return tree.put(root, hash, encoded);
+}
+
+[[nodiscard]] uint64_t directory_index::remove(const uint64_t root, const std::string & name) const
+{
+    const uint64_t hash = name_hash(name);
+    const auto value = tree.get(root, hash);
+    if (!value) {
+        return root;
+    }
+
+    auto chain = decode_chain(*value);
+    const auto removed = std::erase_if(chain, [&](const chain_entry_t & e) { return e.entry.name == name; });
+    if (removed == 0) {
+        return root;
+    }
+
+    return chain.empty() ? tree.erase(root, hash) : tree.put(root, hash, encode_chain(chain));
+}
+
+void directory_index::readdir(const uint64_t root, const uint64_t cookie, const readdir_callback_t & callback) const
+{
+    tree.scan(root, cookie >> 7, [&](const uint64_t hash, const cow_btree::value_t & value) -> bool
+    {
+        for (const auto & [slot, entry] : decode_chain(value))
+        {
+            const uint64_t entry_cookie = hash << 7 | (slot + 1ULL);
+            if (entry_cookie <= cookie) {
+                continue;
+            }
+
+            if (!callback(entry, entry_cookie)) {
+                return false;
+            }
+        }
+        return true;
+    });
+}
+
+[[nodiscard]] bool directory_index::empty(const uint64_t root) const
+{
+    bool has_entry = false;
+    tree.scan(root, 0, [&](uint64_t, const cow_btree::value_t &) -> bool
+    {
+        has_entry = true;
+        return false;
+    });
+    return !has_entry;
+}
+
+[[nodiscard]] std::optional < dirent_t > directory_index::lookup(const inode & dir, const std::string & name) const
+{
+    if (dir.get_storage() == inode::STORAGE_INDEX) {
+        return lookup(dir.get_index_root(), name);
+    }
+
+    for (auto & [slot, entry] : decode_chain(dir.get_inline_data()))
+    {
+        if (entry.name == name) {
+            return std::move(entry);
+        }
+    }
+
+    return std::nullopt;
+}
+
+void directory_index::insert(inode & dir, const dirent_t & entry, const uint64_t inline_threshold) const
+{
+    if (dir.get_storage() == inode::STORAGE_INDEX)
+    {
+        dir.set_index_root(insert(dir.get_index_root(), entry));
+        return;
+    }
+
+    auto entries = decode_chain(dir.get_inline_data());
+    place(entries, entry);
+    if (auto encoded = encode_chain(entries); encoded.size() <= inline_threshold)
+    {
+        dir.set_inline_data(std::move(encoded));
+        return;
+    }
+
+    // outgrew the inode record, move every chain as is so cookies handed out so far stay valid
+    uint64_t root = create();
+    for (auto first = entries.begin(); first != entries.end(); )
+    {
+        const uint64_t hash = name_hash(first->entry.name);
+        const auto last = std::find_if(first, entries.end(),
+            [&](const chain_entry_t & e) { return name_hash(e.entry.name) != hash; });
+        root = tree.put(root, hash, encode_chain({ first, last }));
+        first = last;
+    }
+
+    dir.set_index_root(root);
+}
+
+void directory_index::remove(inode & dir, const std::string & name) const
+{
+    if (dir.get_storage() == inode::STORAGE_INDEX)
+    {
+        dir.set_index_root(remove(dir.get_index_root(), name));
+        return;
+    }
+
+    auto entries = decode_chain(dir.get_inline_data());
+    if (std::erase_if(entries, [&](const chain_entry_t & e) { return e.entry.name == name; }) != 0) {
+        dir.set_inline_data(encode_chain(entries));
+    }
+}
+
+void directory_index::readdir(const inode & dir, const uint64_t cookie, const readdir_callback_t & callback) const
+{
+    if (dir.get_storage() == inode::STORAGE_INDEX)
+    {
+        readdir(dir.get_index_root(), cookie, callback);
+        return;
+    }
+
+    for (const auto & entry : decode_chain(dir.get_inline_data()))
+    {
+        const uint64_t entry_cookie = cookie_of(entry);
+        if (entry_cookie > cookie && !callback(entry.entry, entry_cookie)) {
+            return;
+        }
+    }
+}
+
+[[nodiscard]] bool directory_index::empty(const inode & dir) const
+{
+    if (dir.get_storage() == inode::STORAGE_INDEX) {
+        return empty(dir.get_index_root());
+    }
+
+    return dir.get_inline_data().empty();
+}
@@ -0,0 +1,209 @@
+#include <fstream>
+#include <iterator>
+#include <ranges>
+#include <sys/xattr.h>
+#include "fingerprint_cache.h"
+#include "block.h"
+#include "log.hpp"
+using namespace cow_block;
+
+uint64_t fingerprint_cache::key_hash_t::operator()(const key_t & key) const
+{
+    return hashcrc64(key);
+}
+
+fingerprint_cache::fingerprint_cache(std::string store_path, const bool use_xattr)
+    : store_path(std::move(store_path)), use_xattr(use_xattr)
+{
+    if (!this->store_path.empty()) {
+        load();
+    }
+}
+
+[[nodiscard]] fingerprint_cache::key_t fingerprint_cache::key_of(const struct stat & st)
+{
+    return key_t {
+        .device = static_cast<uint64_t>(st.st_dev),
+        .inode = static_cast<uint64_t>(st.st_ino),
+        .mtime_sec = static_cast<int64_t>(st.st_mtim.tv_sec),
+        .mtime_nsec = static_cast<int64_t>(st.st_mtim.tv_nsec),
+        .size = static_cast<uint64_t>(st.st_size),
+    };
+}
+
+[[nodiscard]] std::vector < uint8_t > fingerprint_cache::encode(const key_t & key, const uint64_t block_size,
+    const std::vector < uint64_t > & block_ids)
+{
+    const record_header_t header { .key = key, .block_size = block_size, .count = block_ids.size() };
+    std::vector < uint8_t > record(sizeof(header) + block_ids.size() * sizeof(uint64_t) + sizeof(uint64_t));
+    std::memcpy(record.data(), &header, sizeof(header));
+    std::memcpy(record.data() + sizeof(header), block_ids.data(), block_ids.size() * sizeof(uint64_t));
+
+    CRC64 hash;
+    hash.update(record.data(), record.size() - sizeof(uint64_t));
+    const uint64_t checksum = hash.get_checksum();
+    std::memcpy(record.data() + record.size() - sizeof(uint64_t), &checksum, sizeof(checksum));
+    return record;
+}
+
+[[nodiscard]] uint64_t fingerprint_cache::decode(const uint8_t * data, const uint64_t size, key_t & key,
+    uint64_t & block_size, std::vector < uint64_t > & block_ids)
+{
+    record_header_t header { };
+    if (size < sizeof(header)) {
+        return 0;
+    }
+
+    std::memcpy(&header, data, sizeof(header));
+    if (header.count > (size - sizeof(header)) / sizeof(uint64_t)) {
+        return 0;
+    }
+
+    const uint64_t length = sizeof(header) + header.count * sizeof(uint64_t) + sizeof(uint64_t);
+    if (length > size) {
+        return 0;
+    }
+
+    CRC64 hash;
+    hash.update(data, length - sizeof(uint64_t));
+    uint64_t checksum = 0;
+    std::memcpy(&checksum, data + length - sizeof(uint64_t), sizeof(checksum));
+    if (checksum != hash.get_checksum()) {
+        return 0;
+    }
+
+    key = header.key;
+    block_size = header.block_size;
+    block_ids.resize(header.count);
+    std::memcpy(block_ids.data(), data + sizeof(header), header.count * sizeof(uint64_t));
+    return length;
+}
+
+void fingerprint_cache::load()
+{
+    std::ifstream file(store_path, std::ios::binary);
+    if (!file) {
+        return;
+    }
+
+    const std::vector < uint8_t > content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    uint64_t offset = 0;
+    uint64_t records = 0;
+    while (offset < content.size())
+    {
+        key_t key { };
+        uint64_t block_size = 0;
+        std::vector < uint64_t > block_ids;
+        const uint64_t length = decode(content.data() + offset, content.size() - offset, key, block_size, block_ids);
+        if (length == 0) {
+            break;
+        }
+
+        entries[key][block_size] = std::move(block_ids);
+        offset += length;
+        records++;
+    }
+
+    uint64_t fingerprints = 0;
+    for (const auto & sizes : entries | std::views::values) {
+        fingerprints += sizes.size();
+    }
+    if (offset == content.size() && records <= fingerprints * 2) {
+        return;
+    }
+
+    // drop the torn tail and records superseded by later ones
+    std::ofstream file_new(store_path + ".new", std::ios::binary | std::ios::trunc);
+    if (!file_new) {
+        easy_throw_except(fingerprint_cache_io_failed, "Failed to open " + store_path + ".new");
+    }
+    for (const auto & [key, sizes] : entries)
+    {
+        for (const auto & [block_size, block_ids] : sizes)
+        {
+            const auto record = encode(key, block_size, block_ids);
+            file_new.write(reinterpret_cast<const char*>(record.data()), static_cast<std::streamsize>(record.size()));
+        }
+    }
+    file_new.close();
+    std::filesystem::rename(store_path + ".new", store_path);
+    info_log("Compacted lower fingerprints in ", store_path, ": ", records, " records, ", entries.size(), " files\n");
+}
+
+void fingerprint_cache::append(const std::vector < uint8_t > & record) const
+{
+    std::ofstream file(store_path, std::ios::binary | std::ios::app);
+    if (!file) {
+        easy_throw_except(fingerprint_cache_io_failed, "Failed to open " + store_path);
+    }
+    file.write(reinterpret_cast<const char*>(record.data()), static_cast<std::streamsize>(record.size()));
+}
+
+[[nodiscard]] std::optional < std::vector < uint64_t > > fingerprint_cache::lookup(const std::string & path, const struct stat & st,
+    const uint64_t block_size)
+{
+    const key_t key = key_of(st);
+    {
+        std::lock_guard lock(mutex);
+        if (const auto it = entries.find(key); it != entries.end())
+        {
+            if (const auto ids = it->second.find(block_size); ids != it->second.end()) {
+                return ids->second;
+            }
+        }
+    }
+
+    if (!use_xattr) {
+        return std::nullopt;
+    }
+
+    const ssize_t size = ::lgetxattr(path.c_str(), xattr_name, nullptr, 0);
+    if (size <= 0) {
+        return std::nullopt;
+    }
+
+    std::vector < uint8_t > value(size);
+    if (::lgetxattr(path.c_str(), xattr_name, value.data(), value.size()) != size) {
+        return std::nullopt;
+    }
+
+    // the xattr moves with the file, so device and inode number may legitimately differ
+    key_t stored { };
+    uint64_t stored_block_size = 0;
+    std::vector < uint64_t > block_ids;
+    if (decode(value.data(), value.size(), stored, stored_block_size, block_ids) != value.size()
+        || stored.mtime_sec != key.mtime_sec || stored.mtime_nsec != key.mtime_nsec || stored.size != key.size
+        || stored_block_size != block_size)
+    {
+        return std::nullopt;
+    }
+
+    std::lock_guard lock(mutex);
+    entries[key][block_size] = block_ids;
+    if (!store_path.empty()) {
+        append(encode(key, block_size, block_ids));
+    }
+    return block_ids;
+}
+
+void fingerprint_cache::store(const std::string & path, const struct stat & st, const uint64_t block_size,
+    std::vector < uint64_t > block_ids)
+{
+    const key_t key = key_of(st);
+    const auto record = encode(key, block_size, block_ids);
+    if (use_xattr && ::lsetxattr(path.c_str(), xattr_name, record.data(), record.size(), 0) != 0) {
+        debug_log("Cannot keep the fingerprint of ", path, " in an xattr: ", strerror(errno), "\n");
+    }
+
+    std::lock_guard lock(mutex);
+    entries[key][block_size] = std::move(block_ids);
+    if (!store_path.empty()) {
+        append(record);
+    }
+}
+
+[[nodiscard]] uint64_t fingerprint_cache::get_entry_count() const
+{
+    std::lock_guard lock(mutex);
+    return entries.size();
+}
@@ -1 +1,131 @@
 #include "inode.h"
+
+inode::inode(const uint64_t number, const cow_block::block_map::block_id_t zero_block_id)
+    : number(number), map(zero_block_id)
+{
+}
+
+[[nodiscard]] uint64_t inode::get_number() const
+{
+    return number;
+}
+
+[[nodiscard]] inode::attributes_t & inode::get_attributes()
+{
+    return attributes;
+}
+
+[[nodiscard]] const inode::attributes_t & inode::get_attributes() const
+{
+    return attributes;
+}
+
+[[nodiscard]] uint8_t inode::get_flags() const
+{
+    return flags;
+}
+
+void inode::set_flags(const uint8_t new_flags)
+{
+    flags = new_flags;
+}
+
+[[nodiscard]] uint8_t inode::get_size_class() const
+{
+    return size_class;
+}
+
+void inode::set_size_class(const uint8_t new_size_class, const cow_block::block_map::block_id_t zero_block_id)
+{
+    size_class = new_size_class;
+    map = cow_block::block_map(zero_block_id);
+    set_extent_root(0, { });
+}
+
+[[nodiscard]] inode::storage_t inode::get_storage() const
+{
+    return storage;
+}
+
+[[nodiscard]] const std::vector < uint8_t > & inode::get_inline_data() const
+{
+    return inline_data;
+}
+
+void inode::set_inline_data(std::vector < uint8_t > data)
+{
+    storage = STORAGE_INLINE;
+    inline_data = std::move(data);
+    map.truncate(0);
+    set_extent_root(0, { });
+    lower_origin.clear();
+    index_root = 0;
+}
+
+void inode::use_blocks()
+{
+    storage = STORAGE_BLOCKS;
+    inline_data.clear();
+    index_root = 0;
+}
+
+[[nodiscard]] uint64_t inode::get_index_root() const
+{
+    return index_root;
+}
+
+void inode::set_index_root(const uint64_t root)
+{
+    storage = STORAGE_INDEX;
+    index_root = root;
+    inline_data.clear();
+    map.truncate(0);
+    set_extent_root(0, { });
+    lower_origin.clear();
+}
+
+[[nodiscard]] uint64_t inode::get_extent_root() const
+{
+    return extent_root;
+}
+
+[[nodiscard]] const std::vector < cow_block::block_map::extent_t > & inode::get_stored_extents() const
+{
+    return stored_extents;
+}
+
+void inode::set_extent_root(const uint64_t root, std::vector < cow_block::block_map::extent_t > extents)
+{
+    extent_root = root;
+    stored_extents = std::move(extents);
+}
+
+[[nodiscard]] const std::string & inode::get_lower_origin() const
+{
+    return lower_origin;
+}
+
+void inode::set_lower_origin(std::string path)
+{
+    lower_origin = std::move(path);
+}
+
+[[nodiscard]] std::optional < cow_block::block_map::block_id_t > inode::block_at(const uint64_t offset,
+    const uint64_t block_size) const
+{
+    if (storage != STORAGE_BLOCKS) {
+        return std::nullopt;
+    }
+
+    return map.lookup(offset / block_size);
+}
+
+[[nodiscard]] cow_block::block_map & inode::get_block_map()
+{
+    return map;
+}
+
+[[nodiscard]] const cow_block::block_map & inode::get_block_map() const
+{
+    return map;
+}
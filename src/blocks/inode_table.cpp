@@ -0,0 +1,348 @@
+#include <algorithm>
+#include "inode_table.h"
+using namespace cow_block;
+
+namespace
+{
+    // record layout: header, then the block holding the lower origin path if the record has
+    // one, then by storage either the inline content, the extent list, the extent tree root or
+    // the directory index root
+    enum record_storage_t : uint8_t
+    {
+        RECORD_INLINE = 0,
+        RECORD_EXTENTS = 1,
+        RECORD_EXTENT_TREE = 2,
+        RECORD_INDEX = 3,
+    };
+
+    struct record_header_t
+    {
+        uint32_t mode;
+        uint32_t uid;
+        uint32_t gid;
+        uint32_t nlink;
+        uint64_t size;
+        uint64_t rdev;
+        int64_t atime_sec;
+        int64_t mtime_sec;
+        int64_t ctime_sec;
+        uint32_t atime_nsec;
+        uint32_t mtime_nsec;
+        uint32_t ctime_nsec;
+        uint8_t storage;
+        uint8_t flags;
+        uint8_t record_flags;
+        uint8_t size_class;         /// block size class of the content, 0 in records from before size classes
+    };
+
+    enum record_flags_t : uint8_t
+    {
+        RECORD_LOWER_ORIGIN = 1 << 0,
+    };
+
+    struct extent_value_t
+    {
+        uint64_t count;
+        uint64_t block;
+    };
+
+    template < typename Type >
+    void append_pod(std::vector < uint8_t > & buffer, const Type & value)
+    {
+        const auto * bytes = reinterpret_cast<const uint8_t *>(&value);
+        buffer.insert(buffer.end(), bytes, bytes + sizeof(value));
+    }
+
+    template < typename Type >
+    Type read_pod(const std::vector < uint8_t > & buffer, const uint64_t offset)
+    {
+        Type value { };
+        if (offset + sizeof(value) > buffer.size()) {
+            easy_throw_except(inode_corrupted, "Inode record is truncated");
+        }
+        std::memcpy(&value, buffer.data() + offset, sizeof(value));
+        return value;
+    }
+}
+
+inode_table::inode_table(const cow_btree & tree, const block_manager & blocks, const std::optional < uint64_t > inline_threshold,
+    const log_manager * journal)
+    : tree(tree), blocks(blocks), journal(journal), inline_threshold(inline_threshold.value_or(max_inline_size(tree)))
+{
+    if (this->inline_threshold > max_inline_size(tree)) {
+        easy_throw_except(inline_threshold_too_large, "Inline threshold " + std::to_string(this->inline_threshold)
+            + " exceeds the largest inline content of " + std::to_string(max_inline_size(tree)) + " bytes");
+    }
+}
+
+[[nodiscard]] uint64_t inode_table::max_inline_size(const cow_btree & tree)
+{
+    return tree.get_max_value_size() - sizeof(record_header_t);
+}
+
+[[nodiscard]] uint64_t inode_table::get_inline_threshold() const
+{
+    return inline_threshold;
+}
+
+[[nodiscard]] uint64_t inode_table::create() const
+{
+    return tree.create();
+}
+
+[[nodiscard]] std::optional < inode > inode_table::load(const uint64_t root, const uint64_t number) const
+{
+    const auto value = tree.get(root, number);
+    if (!value) {
+        return std::nullopt;
+    }
+
+    const auto header = read_pod<record_header_t>(*value, 0);
+    inode node(number, blocks.get_zero_block_id());
+    node.set_size_class(header.size_class, blocks.get_zero_block_id(header.size_class));
+    auto & attributes = node.get_attributes();
+    attributes.mode = header.mode;
+    attributes.uid = header.uid;
+    attributes.gid = header.gid;
+    attributes.nlink = header.nlink;
+    attributes.size = header.size;
+    attributes.rdev = header.rdev;
+    attributes.atime = { .tv_sec = header.atime_sec, .tv_nsec = header.atime_nsec };
+    attributes.mtime = { .tv_sec = header.mtime_sec, .tv_nsec = header.mtime_nsec };
+    attributes.ctime = { .tv_sec = header.ctime_sec, .tv_nsec = header.ctime_nsec };
+    node.set_flags(header.flags);
+
+    uint64_t payload_offset = sizeof(record_header_t);
+    if (header.record_flags & RECORD_LOWER_ORIGIN)
+    {
+        const auto origin = blocks.read_block(read_pod<uint64_t>(*value, payload_offset));
+        node.set_lower_origin(std::string(origin.begin(), std::ranges::find(origin, 0)));
+        payload_offset += sizeof(uint64_t);
+    }
+
+    const std::vector < uint8_t > payload(value->begin() + static_cast<ssize_t>(payload_offset), value->end());
+    switch (header.storage)
+    {
+    case RECORD_INLINE:
+        node.set_inline_data(payload);
+        break;
+    case RECORD_EXTENTS:
+        node.use_blocks();
+        node.get_block_map() = block_map::deserialize(payload, blocks.get_zero_block_id(header.size_class));
+        break;
+    case RECORD_EXTENT_TREE:
+    {
+        node.use_blocks();
+        const auto extent_root = read_pod<uint64_t>(payload, 0);
+        std::vector < block_map::extent_t > extents;
+        tree.scan(extent_root, 0, [&](const uint64_t first, const cow_btree::value_t & extent) -> bool
+        {
+            const auto [count, block] = read_pod<extent_value_t>(extent, 0);
+            node.get_block_map().set_range(first, count, block);
+            extents.push_back({ .first = first, .count = count, .block = block });
+            return true;
+        });
+        node.set_extent_root(extent_root, std::move(extents));
+        break;
+    }
+    case RECORD_INDEX:
+        node.set_index_root(read_pod<uint64_t>(payload, 0));
+        break;
+    default:
+        easy_throw_except(inode_corrupted, "Inode " + std::to_string(number) + " has unknown storage "
+            + std::to_string(header.storage));
+    }
+
+    if (!node.get_lower_origin().empty() && node.get_storage() != inode::STORAGE_BLOCKS) {
+        easy_throw_except(inode_corrupted, "Inode " + std::to_string(number) + " has a lower origin but no blocks");
+    }
+    return node;
+}
+
+[[nodiscard]] bool inode_table::references_lower(const inode & node)
+{
+    if (node.get_lower_origin().empty() || node.get_storage() != inode::STORAGE_BLOCKS) {
+        return false;
+    }
+
+    bool found = false;
+    node.get_block_map().for_each_extent([&](const block_map::extent_t & extent) {
+        found = found || extent.block == block_map::lower_block;
+    });
+    return found;
+}
+
+void inode_table::store_extents(inode & node) const
+{
+    std::vector < block_map::extent_t > extents;
+    node.get_block_map().for_each_extent([&](const block_map::extent_t & extent) { extents.push_back(extent); });
+
+    // both lists are in logical order, walk them side by side
+    uint64_t extent_root = node.get_extent_root() == 0 ? tree.create() : node.get_extent_root();
+    const auto & stored = node.get_stored_extents();
+    auto previous = stored.begin();
+    for (const auto & extent : extents)
+    {
+        for (; previous != stored.end() && previous->first < extent.first; ++previous) {
+            extent_root = tree.erase(extent_root, previous->first);
+        }
+
+        if (previous != stored.end() && previous->first == extent.first)
+        {
+            const bool unchanged = previous->count == extent.count && previous->block == extent.block;
+            ++previous;
+            if (unchanged) {
+                continue;
+            }
+        }
+
+        std::vector < uint8_t > value;
+        append_pod(value, extent_value_t { .count = extent.count, .block = extent.block });
+        extent_root = tree.put(extent_root, extent.first, value);
+    }
+
+    for (; previous != stored.end(); ++previous) {
+        extent_root = tree.erase(extent_root, previous->first);
+    }
+
+    node.set_extent_root(extent_root, std::move(extents));
+}
+
+[[nodiscard]] uint64_t inode_table::store(const uint64_t root, inode & node) const
+{
+    const auto & attributes = node.get_attributes();
+    record_header_t header {
+        .mode = attributes.mode, .uid = attributes.uid, .gid = attributes.gid, .nlink = attributes.nlink,
+        .size = attributes.size, .rdev = attributes.rdev,
+        .atime_sec = attributes.atime.tv_sec, .mtime_sec = attributes.mtime.tv_sec, .ctime_sec = attributes.ctime.tv_sec,
+        .atime_nsec = static_cast<uint32_t>(attributes.atime.tv_nsec),
+        .mtime_nsec = static_cast<uint32_t>(attributes.mtime.tv_nsec),
+        .ctime_nsec = static_cast<uint32_t>(attributes.ctime.tv_nsec),
+        .storage = RECORD_INLINE, .flags = node.get_flags(), .record_flags = 0, .size_class = node.get_size_class() };
+
+    // the origin path may be as long as PATH_MAX, more than a record holds, so it gets a block
+    std::vector < uint8_t > origin;
+    if (references_lower(node))
+    {
+        const auto & path = node.get_lower_origin();
+        if (path.size() >= blocks.get_block_size()) {
+            easy_throw_except(inode_corrupted, "Lower origin of inode " + std::to_string(node.get_number()) + " is too long");
+        }
+
+        std::vector < uint8_t > data(blocks.get_block_size(), 0);
+        std::memcpy(data.data(), path.data(), path.size());
+        const uint64_t block_id = blocks.write_in_block(data);
+        if (journal != nullptr) {
+            journal->append_log(LOG_WRITE_BLOCK, block_id);
+        }
+        append_pod(origin, block_id);
+        header.record_flags |= RECORD_LOWER_ORIGIN;
+    }
+
+    std::vector < uint8_t > payload;
+    switch (node.get_storage())
+    {
+    case inode::STORAGE_INLINE:
+        if (node.get_inline_data().size() > inline_threshold) {
+            easy_throw_except(inode_corrupted, "Inline content of inode " + std::to_string(node.get_number())
+                + " is over the inline threshold");
+        }
+        payload = node.get_inline_data();
+        break;
+    case inode::STORAGE_BLOCKS:
+        if (node.get_extent_root() == 0)
+        {
+            payload = node.get_block_map().serialize();
+            header.storage = RECORD_EXTENTS;
+            if (sizeof(header) + origin.size() + payload.size() <= tree.get_max_value_size()) {
+                break;
+            }
+        }
+
+        // too fragmented for the record, keep the extents in a tree of their own
+        store_extents(node);
+        payload.clear();
+        append_pod(payload, node.get_extent_root());
+        header.storage = RECORD_EXTENT_TREE;
+        break;
+    case inode::STORAGE_INDEX:
+        append_pod(payload, node.get_index_root());
+        header.storage = RECORD_INDEX;
+        break;
+    }
+
+    std::vector < uint8_t > value;
+    value.reserve(sizeof(header) + origin.size() + payload.size());
+    append_pod(value, header);
+    value.insert(value.end(), origin.begin(), origin.end());
+    value.insert(value.end(), payload.begin(), payload.end());
+    return tree.put(root, node.get_number(), value);
+}
+
+[[nodiscard]] uint64_t inode_table::remove(const uint64_t root, const uint64_t number) const
+{
+    return tree.erase(root, number);
+}
+
+[[nodiscard]] std::vector < uint8_t > inode_table::read_content(const inode & node) const
+{
+    const uint64_t size = node.get_attributes().size;
+    const uint64_t block_size = blocks.get_block_size(node.get_size_class());
+    std::vector < uint8_t > content(size, 0);
+    for (uint64_t offset = 0; offset < size; offset += block_size)
+    {
+        if (const auto block = node.block_at(offset, block_size))
+        {
+            const auto data = blocks.read_block(*block, node.get_size_class());
+            std::memcpy(content.data() + offset, data.data(), std::min(block_size, size - offset));
+        }
+    }
+    return content;
+}
+
+void inode_table::spill(inode & node) const
+{
+    if (node.get_storage() != inode::STORAGE_INLINE) {
+        return;
+    }
+
+    const uint64_t size = node.get_attributes().size;
+    const uint64_t block_size = blocks.get_block_size(node.get_size_class());
+    auto content = node.get_inline_data();
+    content.resize(size, 0);
+    node.use_blocks();
+
+    std::vector < log_manager::log_t > logs;
+    for (uint64_t offset = 0; offset < size; offset += block_size)
+    {
+        std::vector < uint8_t > data(block_size, 0);
+        std::memcpy(data.data(), content.data() + offset, std::min(block_size, size - offset));
+        const uint64_t block_id = blocks.write_in_block(data);
+        node.get_block_map().set(offset / block_size, block_id);
+        if (block_id != blocks.get_zero_block_id(node.get_size_class())) {
+            logs.push_back(log_manager::make_log(LOG_WRITE_BLOCK, block_id));
+        }
+    }
+
+    if (journal != nullptr && !logs.empty()) {
+        journal->append_logs(std::move(logs));
+    }
+}
+
+void inode_table::settle(inode & node) const
+{
+    const uint32_t type = node.get_attributes().mode & S_IFMT;
+    if (type != S_IFREG && type != S_IFLNK) {
+        return;
+    }
+
+    const uint64_t size = node.get_attributes().size;
+    if (node.get_storage() == inode::STORAGE_INLINE && size > inline_threshold)
+    {
+        spill(node);
+    }
+    else if (node.get_storage() == inode::STORAGE_BLOCKS && size <= inline_threshold && !references_lower(node))
+    {
+        node.set_inline_data(read_content(node));
+    }
+}
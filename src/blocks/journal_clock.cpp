@@ -0,0 +1,39 @@
+#include <algorithm>
+#include "journal_clock.h"
+using namespace cow_block;
+
+void journal_clock::advance_to(const timespec & timestamp)
+{
+    const uint64_t target = from_timespec(timestamp);
+    uint64_t current = last_issued.load(std::memory_order_relaxed);
+    while (current < target && !last_issued.compare_exchange_weak(current, target, std::memory_order_relaxed)) { }
+}
+
+[[nodiscard]] uint64_t journal_clock::reserve(const uint64_t count)
+{
+    timespec now { };
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    const uint64_t wall = from_timespec(now);
+
+    uint64_t current = last_issued.load(std::memory_order_relaxed);
+    uint64_t base;
+    do {
+        base = std::max(wall, current + 1);
+    } while (!last_issued.compare_exchange_weak(current, base + std::max<uint64_t>(count, 1) - 1,
+        std::memory_order_relaxed));
+
+    return base;
+}
+
+[[nodiscard]] timespec journal_clock::to_timespec(const uint64_t nanoseconds)
+{
+    return {
+        .tv_sec = static_cast<time_t>(nanoseconds / 1000000000ULL),
+        .tv_nsec = static_cast<long>(nanoseconds % 1000000000ULL)
+    };
+}
+
+[[nodiscard]] uint64_t journal_clock::from_timespec(const timespec & timestamp)
+{
+    return static_cast<uint64_t>(timestamp.tv_sec) * 1000000000ULL + static_cast<uint64_t>(timestamp.tv_nsec);
+}
@@ -0,0 +1,110 @@
+#include <thread>
+#include "journal_feed.h"
+using namespace cow_block;
+
+journal_feed::journal_feed(const log_manager & journal, std::string cursor_path, const uint64_t after_sequence)
+    : journal(journal), cursor_path(std::move(cursor_path))
+{
+    cursor.sequence = after_sequence;
+    if (this->cursor_path.empty() || !std::filesystem::exists(this->cursor_path)) {
+        return;
+    }
+
+    std::ifstream file(this->cursor_path, std::ios::binary);
+    cursor_t saved { };
+    if (!file.read(reinterpret_cast<char*>(&saved), sizeof(saved)) || saved.magic != cursor_magic) {
+        easy_throw_except(journal_feed_cursor_invalid, "Corrupted cursor file " + this->cursor_path);
+    }
+
+    cursor = saved;
+}
+
+void journal_feed::revalidate_offset()
+{
+    if (cursor.offset >= sizeof(log_t))
+    {
+        bool still_valid = false;
+        journal.scan(cursor.offset - sizeof(log_t), [&](const log_t & log, uint64_t) -> bool
+        {
+            still_valid = log_manager::is_valid(log) && log.sequence == cursor.sequence;
+            return false;
+        });
+
+        if (still_valid) {
+            return;
+        }
+    }
+
+    // rescan from the start, records up to the cursor are skipped on delivery
+    cursor.offset = 0;
+}
+
+void journal_feed::save_cursor() const
+{
+    if (cursor_path.empty()) {
+        return;
+    }
+
+    replace_into(cursor_path,
+        std::vector<uint8_t>(
+            reinterpret_cast<const uint8_t*>(&cursor),
+            reinterpret_cast<const uint8_t*>(&cursor) + sizeof(cursor)));
+}
+
+uint64_t journal_feed::poll(const consumer_t & consumer)
+{
+    revalidate_offset();
+
+    std::vector < log_t > pending;
+    uint64_t delivered = 0;
+    uint64_t last_sequence = 0;
+    journal.scan(cursor.offset, [&](const log_t & log, const uint64_t offset) -> bool
+    {
+        // a torn record is either being appended right now or will be discarded by recovery,
+        // both mean there is nothing committed past it yet
+        if (!log_manager::is_valid(log) || log.sequence <= last_sequence) {
+            return false;
+        }
+
+        last_sequence = log.sequence;
+        pending.push_back(log);
+        if (log.action != LOG_COMMIT) {
+            return true;
+        }
+
+        if (log.sequence > cursor.sequence)
+        {
+            for (const auto & record : pending) {
+                consumer(record);
+            }
+            delivered++;
+            cursor.sequence = log.sequence;
+        }
+
+        cursor.offset = offset + sizeof(log_t);
+        pending.clear();
+        return true;
+    });
+
+    if (delivered != 0) {
+        save_cursor();
+    }
+
+    return delivered;
+}
+
+void journal_feed::follow(const consumer_t & consumer, const std::atomic_bool & stop,
+    const std::chrono::milliseconds interval)
+{
+    while (!stop)
+    {
+        if (poll(consumer) == 0) {
+            std::this_thread::sleep_for(interval);
+        }
+    }
+}
+
+[[nodiscard]] uint64_t journal_feed::get_cursor() const
+{
+    return cursor.sequence;
+}
@@ -0,0 +1,515 @@
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include "journal_shipping.h"
+#include "journal_feed.h"
+using namespace cow_block;
+
+namespace
+{
+    // socket protocol: the receiver greets with FRAME_HELLO carrying its last commit, then the
+    // primary streams blocks, each stored on arrival, and one FRAME_RECORDS per batch once the
+    // blocks it references are sent, each answered by FRAME_ACK
+    enum frame_type_t : uint64_t { FRAME_HELLO = 1, FRAME_BLOCK, FRAME_BLOCK_ATTRIBUTE, FRAME_RECORDS, FRAME_ACK };
+    constexpr uint64_t frame_magic = 0x5050494853574F43; // "COWSHIPP"
+
+    struct frame_header_t
+    {
+        uint64_t magic;
+        uint64_t type;
+        uint64_t param;
+        uint64_t length;
+    };
+
+    void write_full(const int fd, const void * data, size_t length)
+    {
+        auto ptr = static_cast<const uint8_t *>(data);
+        while (length != 0)
+        {
+            const ssize_t ret = ::send(fd, ptr, length, MSG_NOSIGNAL);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (ret <= 0) {
+                easy_throw_except(journal_shipping_failed, std::string("send() failed: ") + strerror(errno));
+            }
+
+            ptr += ret;
+            length -= ret;
+        }
+    }
+
+    void read_full(const int fd, void * data, size_t length)
+    {
+        auto ptr = static_cast<uint8_t *>(data);
+        while (length != 0)
+        {
+            const ssize_t ret = ::recv(fd, ptr, length, 0);
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (ret == 0) {
+                throw journal_shipping_peer_closed("Connection closed");
+            }
+
+            if (ret < 0) {
+                easy_throw_except(journal_shipping_failed, std::string("recv() failed: ") + strerror(errno));
+            }
+
+            ptr += ret;
+            length -= ret;
+        }
+    }
+
+    void send_frame(const int fd, const uint64_t type, const uint64_t param, const void * payload, const uint64_t length)
+    {
+        const frame_header_t header { frame_magic, type, param, length };
+        write_full(fd, &header, sizeof(header));
+        if (length != 0) {
+            write_full(fd, payload, length);
+        }
+    }
+
+    frame_header_t receive_frame(const int fd, std::vector < uint8_t > & payload)
+    {
+        frame_header_t header { };
+        read_full(fd, &header, sizeof(header));
+        if (header.magic != frame_magic) {
+            easy_throw_except(journal_shipping_failed, "Bad frame from peer");
+        }
+
+        payload.resize(header.length);
+        if (header.length != 0) {
+            read_full(fd, payload.data(), header.length);
+        }
+        return header;
+    }
+
+    std::vector < uint8_t > read_file(const std::string & path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            return { };
+        }
+
+        return { std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+    }
+
+    sockaddr_un make_address(const std::string & socket_path)
+    {
+        sockaddr_un address { };
+        address.sun_family = AF_UNIX;
+        if (socket_path.size() >= sizeof(address.sun_path)) {
+            easy_throw_except(journal_shipping_failed, "Socket path too long: " + socket_path);
+        }
+        std::strncpy(address.sun_path, socket_path.c_str(), sizeof(address.sun_path) - 1);
+        return address;
+    }
+}
+
+standby_store::standby_store(const std::string & data_dir, const std::string & log_dir, const uint64_t block_size)
+    : blocks(data_dir, block_size), journal(log_dir), recovery(journal, blocks),
+      applied_sequence(journal.last_committed_sequence())
+{
+}
+
+[[nodiscard]] uint64_t standby_store::last_sequence() const
+{
+    return applied_sequence;
+}
+
+void standby_store::store_block(const shipped_block_t & block)
+{
+    const std::string path = blocks.get_data_dir() + "/" + bin2hex(block.hash);
+    replace_into(path, block.content);
+    if (!block.attribute.empty()) {
+        replace_into(path + ".attr", block.attribute);
+    }
+
+    if (!sync_path(path)) {
+        easy_throw_except(journal_shipping_failed, "Failed to flush shipped block " + path);
+    }
+    blocks_unsynced = true;
+}
+
+void standby_store::apply(const std::vector < log_manager::log_t > & records)
+{
+    // blocks first, so no record on the standby ever references a block it doesn't have
+    if (blocks_unsynced && !sync_path(blocks.get_data_dir())) {
+        easy_throw_except(journal_shipping_failed, "Failed to flush standby data directory");
+    }
+    blocks_unsynced = false;
+
+    for (const auto & record : records) {
+        journal.append_raw(record);
+    }
+    journal.sync();
+
+    recovery.apply(records);
+    if (!records.empty()) {
+        applied_sequence = records.back().sequence;
+    }
+}
+
+directory_target::directory_target(const std::string & data_dir, const std::string & log_dir, const uint64_t block_size)
+    : store(data_dir, log_dir, block_size)
+{
+}
+
+[[nodiscard]] uint64_t directory_target::last_sequence()
+{
+    return store.last_sequence();
+}
+
+void directory_target::ship_blocks(const std::vector < shipped_block_t > & shipped_blocks)
+{
+    for (const auto & block : shipped_blocks) {
+        store.store_block(block);
+    }
+}
+
+void directory_target::ship(const std::vector < log_manager::log_t > & records)
+{
+    store.apply(records);
+}
+
+socket_target::socket_target(std::string socket_path) : socket_path(std::move(socket_path))
+{
+}
+
+void socket_target::disconnect()
+{
+    if (fd >= 0)
+    {
+        ::close(fd);
+        fd = -1;
+    }
+}
+
+[[nodiscard]] uint64_t socket_target::last_sequence()
+{
+    if (fd >= 0) {
+        return hello_sequence;
+    }
+
+    fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        easy_throw_except(journal_shipping_failed, std::string("socket() failed: ") + strerror(errno));
+    }
+
+    if (const sockaddr_un address = make_address(socket_path);
+        ::connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        const std::string error = strerror(errno);
+        disconnect();
+        easy_throw_except(journal_shipping_failed, "Cannot connect to standby " + socket_path + ": " + error);
+    }
+
+    try
+    {
+        std::vector < uint8_t > payload;
+        const auto header = receive_frame(fd, payload);
+        if (header.type != FRAME_HELLO) {
+            easy_throw_except(journal_shipping_failed, "Standby did not greet");
+        }
+        hello_sequence = header.param;
+    }
+    catch (...)
+    {
+        disconnect();
+        throw;
+    }
+
+    return hello_sequence;
+}
+
+void socket_target::ship_blocks(const std::vector < shipped_block_t > & shipped_blocks)
+{
+    try
+    {
+        (void)last_sequence();
+        for (const auto & [hash, content, attribute] : shipped_blocks)
+        {
+            send_frame(fd, FRAME_BLOCK, hash, content.data(), content.size());
+            if (!attribute.empty()) {
+                send_frame(fd, FRAME_BLOCK_ATTRIBUTE, hash, attribute.data(), attribute.size());
+            }
+        }
+    }
+    catch (...)
+    {
+        disconnect();
+        throw;
+    }
+}
+
+void socket_target::ship(const std::vector < log_manager::log_t > & records)
+{
+    try
+    {
+        (void)last_sequence();
+        send_frame(fd, FRAME_RECORDS, records.size(), records.data(), records.size() * sizeof(log_manager::log_t));
+
+        std::vector < uint8_t > payload;
+        const auto header = receive_frame(fd, payload);
+        if (header.type != FRAME_ACK) {
+            easy_throw_except(journal_shipping_failed, "Standby did not acknowledge the batch");
+        }
+        hello_sequence = header.param;
+    }
+    catch (...)
+    {
+        disconnect();
+        throw;
+    }
+}
+
+socket_target::~socket_target()
+{
+    disconnect();
+}
+
+journal_shipper::journal_shipper(const log_manager & journal, const block_manager & blocks,
+    std::unique_ptr < ship_target > target, const uint64_t batch_records, const std::chrono::milliseconds max_delay,
+    const uint64_t max_batch_bytes)
+    : journal(journal), blocks(blocks), target(std::move(target)),
+      batch_records(std::max<uint64_t>(batch_records, 1)), max_delay(max_delay), max_batch_bytes(max_batch_bytes)
+{
+}
+
+[[nodiscard]] shipped_block_t journal_shipper::load_block(const uint64_t hash) const
+{
+    const std::string path = blocks.get_data_dir() + "/" + bin2hex(hash);
+    return { .hash = hash, .content = read_file(path), .attribute = read_file(path + ".attr") };
+}
+
+void journal_shipper::run()
+{
+    while (true)
+    {
+        try
+        {
+            journal_feed feed(journal, "", target->last_sequence());
+            std::vector < log_manager::log_t > batch;
+            std::vector < shipped_block_t > batch_blocks;
+            uint64_t batch_block_bytes = 0;
+            auto oldest = std::chrono::steady_clock::now();
+
+            auto send_blocks = [&]
+            {
+                if (batch_blocks.empty()) {
+                    return;
+                }
+
+                target->ship_blocks(batch_blocks);
+                batch_blocks.clear();
+                batch_block_bytes = 0;
+            };
+
+            auto flush = [&]
+            {
+                if (batch.empty()) {
+                    return;
+                }
+
+                send_blocks();
+                target->ship(batch);
+                shipped_sequence = batch.back().sequence;
+                batch.clear();
+            };
+
+            auto collect = [&](const log_manager::log_t & log)
+            {
+                if (batch.empty()) {
+                    oldest = std::chrono::steady_clock::now();
+                }
+
+                batch.push_back(log);
+                if (log.action == LOG_WRITE_BLOCK)
+                {
+                    if (auto block = load_block(log.params.generic.param1); !block.content.empty())
+                    {
+                        batch_block_bytes += block.content.size() + block.attribute.size();
+                        batch_blocks.emplace_back(std::move(block));
+                    }
+                    if (batch_block_bytes >= max_batch_bytes) {
+                        send_blocks();
+                    }
+                }
+
+                if (log.action == LOG_COMMIT && batch.size() >= batch_records) {
+                    flush();
+                }
+            };
+
+            while (!stop)
+            {
+                feed.poll(collect);
+                if (!batch.empty() && std::chrono::steady_clock::now() - oldest >= max_delay) {
+                    flush();
+                }
+
+                std::unique_lock lock(wait_mutex);
+                wait_cond.wait_for(lock, max_delay, [&] { return stop.load(); });
+            }
+
+            // drain whatever got committed before shutdown
+            feed.poll(collect);
+            flush();
+            return;
+        }
+        catch (const std::exception & e)
+        {
+            warning_log("Journal shipping interrupted, retrying: ", e.what(), "\n");
+        }
+
+        if (stop) {
+            return;
+        }
+
+        std::unique_lock lock(wait_mutex);
+        wait_cond.wait_for(lock, std::chrono::seconds(1), [&] { return stop.load(); });
+    }
+}
+
+void journal_shipper::start()
+{
+    if (!worker.joinable()) {
+        worker = std::thread(&journal_shipper::run, this);
+    }
+}
+
+void journal_shipper::shutdown()
+{
+    {
+        std::lock_guard lock(wait_mutex);
+        stop = true;
+    }
+    wait_cond.notify_all();
+
+    if (worker.joinable()) {
+        worker.join();
+    }
+}
+
+[[nodiscard]] uint64_t journal_shipper::get_shipped_sequence() const
+{
+    return shipped_sequence;
+}
+
+journal_shipper::~journal_shipper()
+{
+    shutdown();
+}
+
+standby_receiver::standby_receiver(standby_store & store, std::string socket_path)
+    : store(store), socket_path(std::move(socket_path))
+{
+    listen_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        easy_throw_except(journal_shipping_failed, std::string("socket() failed: ") + strerror(errno));
+    }
+
+    std::filesystem::remove(this->socket_path);
+    if (const sockaddr_un address = make_address(this->socket_path);
+        ::bind(listen_fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0
+        || ::listen(listen_fd, 1) != 0)
+    {
+        const std::string error = strerror(errno);
+        ::close(listen_fd);
+        easy_throw_except(journal_shipping_failed, "Cannot listen on " + this->socket_path + ": " + error);
+    }
+}
+
+void standby_receiver::serve_client(const int client_fd, const std::atomic_bool & stop)
+{
+    send_frame(client_fd, FRAME_HELLO, store.last_sequence(), nullptr, 0);
+
+    // the last block received waits for the attribute that may follow it, then it is stored
+    std::optional < shipped_block_t > held;
+    auto store_held = [&]
+    {
+        if (held)
+        {
+            store.store_block(*held);
+            held.reset();
+        }
+    };
+
+    std::vector < uint8_t > payload;
+    while (!stop)
+    {
+        // an idle primary would otherwise keep recv() blocked, and with it the stop check
+        if (pollfd pfd { .fd = client_fd, .events = POLLIN, .revents = 0 }; ::poll(&pfd, 1, 200) <= 0) {
+            continue;
+        }
+
+        const auto header = receive_frame(client_fd, payload);
+        switch (header.type)
+        {
+            case FRAME_BLOCK:
+                store_held();
+                held = shipped_block_t { .hash = header.param, .content = payload, .attribute = { } };
+                break;
+
+            case FRAME_BLOCK_ATTRIBUTE:
+                if (!held || held->hash != header.param) {
+                    easy_throw_except(journal_shipping_failed, "Block attribute without its block");
+                }
+                held->attribute = payload;
+                store_held();
+                break;
+
+            case FRAME_RECORDS:
+            {
+                if (payload.size() != header.param * sizeof(log_manager::log_t)) {
+                    easy_throw_except(journal_shipping_failed, "Short record batch");
+                }
+
+                std::vector < log_manager::log_t > records(header.param);
+                std::memcpy(records.data(), payload.data(), payload.size());
+                store_held();
+                store.apply(records);
+                send_frame(client_fd, FRAME_ACK, store.last_sequence(), nullptr, 0);
+                break;
+            }
+
+            default:
+                easy_throw_except(journal_shipping_failed, "Unexpected frame " + std::to_string(header.type));
+        }
+    }
+}
+
+void standby_receiver::serve(const std::atomic_bool & stop)
+{
+    while (!stop)
+    {
+        pollfd pfd { .fd = listen_fd, .events = POLLIN, .revents = 0 };
+        if (::poll(&pfd, 1, 200) <= 0) {
+            continue;
+        }
+
+        const int client_fd = ::accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            continue;
+        }
+
+        info_log("Primary connected\n");
+        try {
+            serve_client(client_fd, stop);
+        } catch (const journal_shipping_peer_closed &) {
+            info_log("Primary disconnected\n");
+        } catch (const std::exception & e) {
+            warning_log("Primary disconnected: ", e.what(), "\n");
+        }
+        ::close(client_fd);
+    }
+}
+
+standby_receiver::~standby_receiver()
+{
+    ::close(listen_fd);
+    std::filesystem::remove(socket_path);
+}
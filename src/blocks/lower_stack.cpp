@@ -0,0 +1,159 @@
+#include <set>
+#include "lower_stack.h"
+using namespace cow_block;
+
+lower_stack::lower_stack(std::vector < std::string > layers, const uint64_t cache_entries)
+    : layers(std::move(layers)), cache(cache_entries)
+{
+}
+
+[[nodiscard]] bool lower_stack::in_layer(const uint32_t layer, const std::string & path, struct stat * attributes) const
+{
+    struct stat st { };
+    if (::lstat((layers[layer] + path).c_str(), &st) != 0) {
+        return false;
+    }
+
+    if (attributes != nullptr) {
+        *attributes = st;
+    }
+    return true;
+}
+
+void lower_stack::index_directory(resolution_t & resolution, const std::vector < uint32_t > & candidates,
+    const std::string & path) const
+{
+    // a whiteout in one layer hides the name in the layers below it, not in its own, so does anything but a directory
+    std::set < std::string > hidden;
+    std::set < std::string > closed;
+    for (const auto layer : candidates)
+    {
+        DIR * dir = ::opendir((layers[layer] + path).c_str());
+        if (dir == nullptr) {
+            continue;
+        }
+
+        std::vector < std::string > whiteouts;
+        bool opaque = false;
+        while (const dirent * entry = ::readdir(dir))
+        {
+            const std::string name = entry->d_name;
+            if (name == "." || name == "..") {
+                continue;
+            }
+            if (name == opaque_marker)
+            {
+                opaque = true;
+                continue;
+            }
+            if (name.starts_with(whiteout_prefix))
+            {
+                whiteouts.push_back(name.substr(whiteout_prefix.size()));
+                continue;
+            }
+            if (hidden.contains(name) || closed.contains(name)) {
+                continue;
+            }
+
+            uint8_t type = entry->d_type;
+            if (struct stat st { }; type == DT_UNKNOWN && in_layer(layer, path + "/" + name, &st)) {
+                type = IFTODT(st.st_mode);
+            }
+
+            auto & child = resolution.children.try_emplace(name, child_t { .layer = layer, .type = type, .dir_layers = { } }).first->second;
+            if (child.type != DT_DIR || type != DT_DIR)
+            {
+                closed.insert(name);
+                continue;
+            }
+            child.dir_layers.push_back(layer);
+        }
+        ::closedir(dir);
+
+        resolution.dir_layers.push_back(layer);
+        hidden.insert(whiteouts.begin(), whiteouts.end());
+        if (opaque) {
+            break;
+        }
+    }
+}
+
+[[nodiscard]] lower_stack::resolution_ptr lower_stack::resolve(const std::string & path) const
+{
+    if (auto cached = cache.get(path)) {
+        return *cached;
+    }
+
+    auto resolution = std::make_shared<resolution_t>();
+    if (path.empty())
+    {
+        std::vector < uint32_t > all(layers.size());
+        for (uint32_t i = 0; i < all.size(); i++) {
+            all[i] = i;
+        }
+
+        index_directory(*resolution, all, path);
+        resolution->exists = !resolution->dir_layers.empty();
+        resolution->layer = resolution->exists ? resolution->dir_layers.front() : 0;
+    }
+    else
+    {
+        const auto slash = path.rfind('/');
+        const auto parent = resolve(path.substr(0, slash));
+        if (const auto it = parent->children.find(path.substr(slash + 1)); it != parent->children.end())
+        {
+            resolution->exists = true;
+            resolution->layer = it->second.layer;
+            if (it->second.type == DT_DIR) {
+                index_directory(*resolution, it->second.dir_layers, path);
+            }
+        }
+    }
+
+    cache.put(path, resolution);
+    return resolution;
+}
+
+[[nodiscard]] std::optional < std::string > lower_stack::locate(const std::string & path) const
+{
+    if (layers.empty()) {
+        return std::nullopt;
+    }
+
+    const auto resolution = resolve(path);
+    if (!resolution->exists) {
+        return std::nullopt;
+    }
+    return layers[resolution->layer] + path;
+}
+
+[[nodiscard]] bool lower_stack::exists(const std::string & path, struct stat * attributes) const
+{
+    if (layers.empty()) {
+        return false;
+    }
+
+    const auto resolution = resolve(path);
+    if (!resolution->exists) {
+        return false;
+    }
+    return attributes == nullptr || in_layer(resolution->layer, path, attributes);
+}
+
+[[nodiscard]] lower_stack::entry_list_t lower_stack::list(const std::string & path) const
+{
+    entry_list_t entries;
+    if (layers.empty()) {
+        return entries;
+    }
+
+    for (const auto & [name, child] : resolve(path)->children) {
+        entries.emplace_back(name, child.type);
+    }
+    return entries;
+}
+
+[[nodiscard]] uint64_t lower_stack::get_layer_count() const
+{
+    return layers.size();
+}
@@ -0,0 +1,84 @@
+#include "metadata_cache.h"
+using namespace cow_block;
+
+metadata_cache::metadata_cache(const uint64_t inode_capacity, const uint64_t dentry_capacity, const uint64_t shard_count)
+    : inodes(inode_capacity, shard_count), dentries(dentry_capacity, shard_count)
+{
+}
+
+[[nodiscard]] metadata_cache::inode_ptr metadata_cache::get_inode(const uint64_t number,
+    const std::function<inode_ptr()> & loader)
+{
+    if (auto cached = inodes.get(number))
+    {
+        inode_hits.fetch_add(1, std::memory_order_relaxed);
+        return *cached;
+    }
+
+    inode_misses.fetch_add(1, std::memory_order_relaxed);
+    auto node = loader();
+    if (node) {
+        inodes.put(number, node);
+    }
+    return node;
+}
+
+void metadata_cache::put_inode(inode_ptr node)
+{
+    const uint64_t number = node->get_number();
+    inodes.put(number, std::move(node));
+}
+
+void metadata_cache::forget_inode(const uint64_t number)
+{
+    inodes.erase(number);
+}
+
+[[nodiscard]] std::optional < dirent_t > metadata_cache::lookup(const uint64_t parent, const std::string & name,
+    const std::function<std::optional < dirent_t >()> & loader)
+{
+    const dentry_key_t key { .parent = parent, .name_hash = directory_index::name_hash(name) };
+    if (const auto cached = dentries.get(key); cached && cached->name == name)
+    {
+        (cached->entry ? dentry_hits : negative_hits).fetch_add(1, std::memory_order_relaxed);
+        return cached->entry;
+    }
+
+    dentry_misses.fetch_add(1, std::memory_order_relaxed);
+    auto entry = loader();
+    dentries.put(key, dentry_value_t { .name = name, .entry = entry });
+    return entry;
+}
+
+void metadata_cache::put_dentry(const uint64_t parent, const std::string & name, std::optional < dirent_t > entry)
+{
+    dentries.put(dentry_key_t { .parent = parent, .name_hash = directory_index::name_hash(name) },
+        dentry_value_t { .name = name, .entry = std::move(entry) });
+}
+
+void metadata_cache::forget_dentry(const uint64_t parent, const std::string & name)
+{
+    dentries.erase(dentry_key_t { .parent = parent, .name_hash = directory_index::name_hash(name) });
+}
+
+void metadata_cache::forget_directory(const uint64_t parent)
+{
+    dentries.erase_if([&](const dentry_key_t & key, const dentry_value_t &) { return key.parent == parent; });
+}
+
+void metadata_cache::clear()
+{
+    inodes.clear();
+    dentries.clear();
+}
+
+[[nodiscard]] metadata_cache::statistics_t metadata_cache::get_statistics() const
+{
+    return statistics_t {
+        .inode_hits = inode_hits.load(std::memory_order_relaxed),
+        .inode_misses = inode_misses.load(std::memory_order_relaxed),
+        .dentry_hits = dentry_hits.load(std::memory_order_relaxed),
+        .negative_hits = negative_hits.load(std::memory_order_relaxed),
+        .dentry_misses = dentry_misses.load(std::memory_order_relaxed),
+    };
+}
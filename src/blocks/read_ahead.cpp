@@ -0,0 +1,100 @@
+#include <algorithm>
+#include "read_ahead.h"
+#include "log.hpp"
+using namespace cow_block;
+
+read_ahead::read_ahead(const uint64_t threads, const uint64_t max_window)
+    : max_window(threads == 0 ? 0 : max_window), max_pending(threads * 4)
+{
+    if (this->max_window == 0) {
+        return;
+    }
+
+    for (uint64_t i = 0; i < threads; i++) {
+        workers.emplace_back([this] { work(); });
+    }
+}
+
+void read_ahead::work()
+{
+    while (true)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock lock(mutex);
+            cond.wait(lock, [this] { return stop || !jobs.empty(); });
+            if (stop) {
+                return;
+            }
+
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        try {
+            job();
+        } catch (const std::exception & e) {
+            debug_log("Read-ahead failed: ", e.what(), "\n");
+        }
+    }
+}
+
+[[nodiscard]] std::optional < read_ahead::range_t > read_ahead::advise(stream_t & stream, const uint64_t first_block,
+    const uint64_t end_block) const
+{
+    if (max_window == 0) {
+        return std::nullopt;
+    }
+
+    std::lock_guard lock(stream.mutex);
+    const bool sequential = first_block == stream.next_block
+        // the kernel may split one large read and send its parts out of order
+        || (stream.window != 0 && first_block < stream.next_block && end_block > stream.next_block);
+    if (!sequential)
+    {
+        stream.window = 0;
+        stream.ahead = 0;
+        stream.next_block = end_block;
+        return std::nullopt;
+    }
+
+    stream.window = stream.window == 0 ? std::min(initial_window, max_window) : std::min(stream.window * 2, max_window);
+    stream.next_block = std::max(stream.next_block, end_block);
+    stream.ahead = std::max(stream.ahead, stream.next_block);
+    if (stream.ahead - stream.next_block > stream.window / 2) {
+        return std::nullopt;
+    }
+
+    const range_t range { .first = stream.ahead, .end = stream.next_block + stream.window };
+    stream.ahead = range.end;
+    return range;
+}
+
+void read_ahead::submit(std::function<void()> job)
+{
+    {
+        std::lock_guard lock(mutex);
+        if (jobs.size() >= max_pending) {
+            return;
+        }
+        jobs.push_back(std::move(job));
+    }
+    cond.notify_one();
+}
+
+[[nodiscard]] bool read_ahead::enabled() const
+{
+    return max_window != 0;
+}
+
+read_ahead::~read_ahead()
+{
+    {
+        std::lock_guard lock(mutex);
+        stop = true;
+    }
+    cond.notify_all();
+    for (auto & worker : workers) {
+        worker.join();
+    }
+}
@@ -0,0 +1,181 @@
+#include "recovery.h"
+using namespace cow_block;
+
+journal_recovery::journal_recovery(const log_manager & journal, const block_manager & blocks)
+    : journal(journal), blocks(blocks)
+{
+    // blocks are content addressed, so replaying a write means making sure the block on disk
+    // is the one the record refers to. A torn block is dropped, its content is lost anyway
+    register_handler(LOG_WRITE_BLOCK, [this](const log_t & log)
+    {
+        if (const std::string block_name = bin2hex(log.params.generic.param1);
+            !this->blocks.verify_block(block_name))
+        {
+            warning_log("Block ", block_name, " is missing or torn, removed\n");
+            std::filesystem::remove(this->blocks.get_data_dir() + "/" + block_name);
+        }
+    });
+
+    register_handler(LOG_SET_BLOCK_ATTRIBUTE, [this](const log_t & log)
+    {
+        this->blocks.set_block_attribute(bin2hex(log.params.generic.param1),
+            unpack_block_attribute(log.params.generic.param2, log.params.generic.param3));
+    });
+}
+
+void journal_recovery::register_handler(const uint64_t action, replay_handler_t handler)
+{
+    handlers[action] = std::move(handler);
+}
+
+void journal_recovery::replay_record(const log_t & log) const
+{
+    if (const auto it = handlers.find(log.action); it != handlers.end())
+    {
+        it->second(log);
+        return;
+    }
+
+    debug_log("No replay handler for action ", log.action, ", record ", log.sequence, " skipped\n");
+}
+
+void journal_recovery::run_partitioned(const std::function<void(const dispatcher_t &)> & producer, uint64_t thread_count) const
+{
+    if (thread_count == 0) {
+        thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+
+    std::vector < std::unique_ptr < partition_t > > partitions;
+    for (uint64_t i = 0; i < thread_count; i++) {
+        partitions.emplace_back(std::make_unique<partition_t>());
+    }
+
+    std::mutex error_mutex;
+    std::string first_error;
+    std::vector < std::thread > workers;
+    for (const auto & partition : partitions)
+    {
+        workers.emplace_back([&, part = partition.get()]
+        {
+            while (true)
+            {
+                std::deque < log_t > batch;
+                {
+                    std::unique_lock lock(part->mutex);
+                    part->cond.wait(lock, [&] { return !part->records.empty() || part->finished; });
+                    if (part->records.empty() && part->finished) {
+                        return;
+                    }
+                    batch.swap(part->records);
+                }
+
+                try {
+                    for (const auto & log : batch) {
+                        replay_record(log);
+                    }
+                } catch (const std::exception & e) {
+                    std::lock_guard lock(error_mutex);
+                    if (first_error.empty()) {
+                        first_error = e.what();
+                    }
+                }
+            }
+        });
+    }
+
+    producer([&](const log_t & record)
+    {
+        auto & part = *partitions[record.params.generic.param1 % thread_count];
+        std::lock_guard lock(part.mutex);
+        part.records.push_back(record);
+        part.cond.notify_one();
+    });
+
+    for (const auto & partition : partitions)
+    {
+        std::lock_guard lock(partition->mutex);
+        partition->finished = true;
+        partition->cond.notify_one();
+    }
+
+    for (auto & worker : workers) {
+        worker.join();
+    }
+
+    if (!first_error.empty()) {
+        easy_throw_except(journal_replay_failed, first_error);
+    }
+}
+
+void journal_recovery::apply(const std::vector < log_t > & records, const uint64_t thread_count) const
+{
+    run_partitioned([&](const dispatcher_t & dispatch)
+    {
+        for (const auto & record : records)
+        {
+            if (record.action != LOG_COMMIT) {
+                dispatch(record);
+            }
+        }
+    }, thread_count);
+}
+
+journal_recovery::statistics_t journal_recovery::replay(const uint64_t thread_count, const bool read_only)
+{
+    statistics_t stats;
+    uint64_t records_seen = 0;
+    run_partitioned([&](const dispatcher_t & dispatch)
+    {
+        // scan the journal while workers replay what's already committed
+        std::vector < log_t > pending;
+        uint64_t last_sequence = 0;
+        journal.scan(0, [&](const log_t & log, const uint64_t offset) -> bool
+        {
+            if (!log_manager::is_valid(log) || log.sequence <= last_sequence) {
+                warning_log("Journal inconsistent at offset ", offset, " (record ", log.sequence, ")\n");
+                return false;
+            }
+
+            last_sequence = log.sequence;
+            records_seen++;
+            if (log.action != LOG_COMMIT)
+            {
+                pending.push_back(log);
+                return true;
+            }
+
+            for (const auto & record : pending) {
+                dispatch(record);
+            }
+
+            stats.records_replayed += pending.size();
+            stats.transactions_replayed++;
+            stats.last_committed_sequence = log.sequence;
+            stats.consistent_size = offset + sizeof(log_t);
+            pending.clear();
+            return true;
+        });
+
+        // the uncommitted tail is dropped, but blocks it wrote stay in the store and later writes
+        // of the same content would reuse them, so they are checked as well
+        for (const auto & record : pending)
+        {
+            if (record.action == LOG_WRITE_BLOCK) {
+                dispatch(record);
+            }
+        }
+    }, thread_count);
+
+    stats.records_discarded = records_seen - stats.records_replayed - stats.transactions_replayed;
+    if (const std::string path = journal.get_log_path();
+        std::filesystem::exists(path) && std::filesystem::file_size(path) > stats.consistent_size)
+    {
+        warning_log("Discarding ", std::filesystem::file_size(path) - stats.consistent_size,
+            " bytes of uncommitted journal after record ", stats.last_committed_sequence, "\n");
+        if (!read_only) {
+            journal.discard_after(stats.consistent_size);
+        }
+    }
+
+    return stats;
+}
@@ -0,0 +1,74 @@
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include "write_policy.h"
+#include "log.hpp"
+using namespace cow_block;
+
+write_policy::write_policy(const uint64_t probe_blocks, const uint64_t reprobe_blocks)
+    : probe_blocks(probe_blocks), reprobe_blocks(reprobe_blocks)
+{
+}
+
+[[nodiscard]] bool write_policy::bypass(stream_t & stream) const
+{
+    if (!stream.bypass) {
+        return false;
+    }
+
+    if (++stream.blocks > reprobe_blocks)
+    {
+        stream = stream_t { };
+        return false;
+    }
+    return true;
+}
+
+void write_policy::record(stream_t & stream, const std::vector < uint8_t > & data, const bool existed,
+    const bool compressed) const
+{
+    if (probe_blocks == 0 || stream.bypass) {
+        return;
+    }
+
+    stream.blocks++;
+    stream.dedup_hits += existed;
+    stream.compress_hits += compressed;
+    stream.entropy += sample_entropy(data);
+    if (stream.blocks < probe_blocks) {
+        return;
+    }
+
+    if (stream.dedup_hits * max_hit_ratio < stream.blocks && stream.compress_hits * max_hit_ratio < stream.blocks
+        && stream.entropy / static_cast<double>(stream.blocks) >= min_entropy)
+    {
+        debug_log("Write stream bypasses dedup and compression: ", stream.dedup_hits, " stored and ",
+            stream.compress_hits, " compressed of ", stream.blocks, " blocks\n");
+        stream = stream_t { .bypass = true };
+        return;
+    }
+
+    // keep judging the most recent blocks only
+    stream = stream_t { };
+}
+
+[[nodiscard]] double write_policy::sample_entropy(const std::vector < uint8_t > & data)
+{
+    std::array < uint32_t, 256 > counts { };
+    const uint64_t stride = std::max<uint64_t>(data.size() / entropy_samples, 1);
+    uint64_t samples = 0;
+    for (uint64_t i = 0; i < data.size(); i += stride, samples++) {
+        counts[data[i]]++;
+    }
+
+    double entropy = 0;
+    for (const uint32_t count : counts)
+    {
+        if (count != 0)
+        {
+            const double p = static_cast<double>(count) / static_cast<double>(samples);
+            entropy -= p * std::log2(p);
+        }
+    }
+    return entropy;
+}
@@ -0,0 +1,764 @@
+#define FUSE_USE_VERSION 312
+#include <fuse_lowlevel.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <fstream>
+#include "fuse_server.h"
+#include "log.hpp"
+using namespace cow_block;
+
+namespace
+{
+    /// what every request handler sees through fuse_req_userdata()
+    struct session_t
+    {
+        cow_filesystem & filesystem;
+        const fuse_server::options_t & options;
+        uint64_t io_size;
+        std::vector < int > cpus;                   /// per-CPU mode: where workers are pinned, in order
+        std::atomic < uint64_t > next_worker = 0;
+
+        bool passthrough = false;                   /// negotiated in init
+        bool splice = false;                        /// negotiated in init
+        std::mutex passthrough_mutex { };
+        std::unordered_map < uint64_t, uint64_t > passthrough_opens { };   /// node id -> open passthrough handles
+    };
+
+    /// what fuse_file_info::fh points to for a regular file
+    struct open_file_t
+    {
+        std::unique_ptr < cow_filesystem::file_handle_t > handle;
+        int backing_id = 0;                         /// passthrough backing file, 0 if served by the daemon
+    };
+
+    /// pin the calling worker to the next CPU the first time it serves a request; libfuse has
+    /// no hook before the first receive, so the worker's request buffer is wherever it was touched
+    void pin_worker(session_t & session)
+    {
+        thread_local bool pinned = false;
+        if (pinned || session.cpus.empty()) {
+            return;
+        }
+
+        pinned = true;
+        const int cpu = session.cpus[session.next_worker++ % session.cpus.size()];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (const int result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set); result != 0) {
+            warning_log("Cannot pin FUSE worker to CPU ", cpu, ": ", strerror(result), "\n");
+        } else {
+            debug_log("FUSE worker pinned to CPU ", cpu, "\n");
+        }
+    }
+
+    /// every worker may hold max_read_fds block files open while a reply is sent, and each open
+    /// file has a handle: the soft limit is raised as far as the hard one lets it
+    void raise_fd_limit()
+    {
+        rlimit limit { };
+        if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == limit.rlim_max) {
+            return;
+        }
+
+        const rlim_t previous = limit.rlim_cur;
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+            warning_log("Cannot raise the open file limit from ", previous, ": ", strerror(errno), "\n");
+        } else {
+            debug_log("Open file limit raised from ", previous, " to ", limit.rlim_cur, "\n");
+        }
+    }
+
+    session_t & session_of(fuse_req_t req)
+    {
+        auto & session = *static_cast<session_t *>(fuse_req_userdata(req));
+        pin_worker(session);
+        return session;
+    }
+
+    /// run a request, turning exceptions into error replies
+    template < typename Operation >
+    void serve(fuse_req_t req, Operation && operation)
+    {
+        try
+        {
+            operation(session_of(req));
+        }
+        catch (const fs_error & e)
+        {
+            fuse_reply_err(req, e.get_code());
+        }
+        catch (const std::exception & e)
+        {
+            error_log("Request failed: ", e.what(), "\n");
+            fuse_reply_err(req, EIO);
+        }
+    }
+
+    void reply_entry(fuse_req_t req, const session_t & session, const cow_filesystem::entry_t & entry)
+    {
+        fuse_entry_param param { };
+        param.ino = entry.node_id;
+        param.attr = entry.attributes;
+        param.attr_timeout = session.options.attr_timeout;
+        param.entry_timeout = session.options.entry_timeout;
+        fuse_reply_entry(req, &param);
+    }
+
+    uint32_t to_set_of(const int to_set)
+    {
+        uint32_t result = 0;
+        if (to_set & FUSE_SET_ATTR_MODE) result |= cow_filesystem::SET_MODE;
+        if (to_set & FUSE_SET_ATTR_UID) result |= cow_filesystem::SET_UID;
+        if (to_set & FUSE_SET_ATTR_GID) result |= cow_filesystem::SET_GID;
+        if (to_set & FUSE_SET_ATTR_SIZE) result |= cow_filesystem::SET_SIZE;
+        if (to_set & FUSE_SET_ATTR_ATIME) result |= cow_filesystem::SET_ATIME;
+        if (to_set & FUSE_SET_ATTR_MTIME) result |= cow_filesystem::SET_MTIME;
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW) result |= cow_filesystem::SET_ATIME_NOW;
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW) result |= cow_filesystem::SET_MTIME_NOW;
+        if (to_set & FUSE_SET_ATTR_CTIME) result |= cow_filesystem::SET_CTIME;
+        return result;
+    }
+
+    open_file_t & file_of(const fuse_file_info * fi)
+    {
+        return *reinterpret_cast<open_file_t *>(fi->fh);
+    }
+
+    /// @brief Hand an open file to the kernel. A file still only in the lower layer is
+    /// registered as a passthrough backing file, so the kernel reads it without asking us.
+    /// A file opened while passthrough handles on it exist (a writer, after copy-up) is
+    /// opened direct_io, the kernel does not allow cached opens next to passthrough ones
+    void attach(fuse_req_t req, session_t & session, const fuse_ino_t ino, fuse_file_info * fi,
+        std::unique_ptr < cow_filesystem::file_handle_t > handle)
+    {
+        auto file = std::make_unique<open_file_t>();
+        file->handle = std::move(handle);
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 16)
+        if (session.passthrough)
+        {
+            std::lock_guard lock(session.passthrough_mutex);
+            if (file->handle->unmodified)
+            {
+                if (const int backing_id = fuse_passthrough_open(req, file->handle->lower_fd); backing_id > 0)
+                {
+                    file->backing_id = backing_id;
+                    fi->backing_id = backing_id;
+                    session.passthrough_opens[ino]++;
+                }
+                else
+                {
+                    debug_log("Passthrough refused for node ", ino, ", serving reads ourselves\n");
+                }
+            }
+            else if (session.passthrough_opens.contains(ino))
+            {
+                fi->direct_io = 1;
+            }
+        }
+#endif
+        fi->fh = reinterpret_cast<uint64_t>(file.release());
+    }
+
+    void detach(fuse_req_t req, session_t & session, const fuse_ino_t ino, const fuse_file_info * fi)
+    {
+        const std::unique_ptr < open_file_t > file(&file_of(fi));
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 16)
+        if (file->backing_id > 0)
+        {
+            fuse_passthrough_close(req, file->backing_id);
+            std::lock_guard lock(session.passthrough_mutex);
+            if (const auto it = session.passthrough_opens.find(ino); it != session.passthrough_opens.end() && --it->second == 0) {
+                session.passthrough_opens.erase(it);
+            }
+        }
+#endif
+    }
+
+    cow_filesystem::dir_handle_t & dir_of(const fuse_file_info * fi)
+    {
+        return *reinterpret_cast<cow_filesystem::dir_handle_t *>(fi->fh);
+    }
+
+    void op_init(void * userdata, fuse_conn_info * conn)
+    {
+        auto & session = *static_cast<session_t *>(userdata);
+        conn->max_write = static_cast<uint32_t>(session.io_size);
+        conn->max_read = static_cast<uint32_t>(session.io_size);
+        constexpr uint32_t splice_capabilities = FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+        if (session.options.splice)
+        {
+            conn->want |= conn->capable & splice_capabilities;
+            session.splice = (conn->want & FUSE_CAP_SPLICE_WRITE) != 0;
+        }
+        else
+        {
+            conn->want &= ~splice_capabilities;
+        }
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 16)
+        if (session.options.passthrough)
+        {
+            if (conn->capable & FUSE_CAP_PASSTHROUGH)
+            {
+                conn->want |= FUSE_CAP_PASSTHROUGH;
+                session.passthrough = true;
+            }
+            else
+            {
+                info_log("Kernel does not offer FUSE passthrough, lower files are read through the daemon\n");
+            }
+        }
+#endif
+        info_log("FUSE protocol ", conn->proto_major, ".", conn->proto_minor, ", max_read/max_write ", session.io_size, "\n");
+    }
+
+    void op_destroy(void * userdata)
+    {
+        try {
+            static_cast<session_t *>(userdata)->filesystem.commit();
+        } catch (const std::exception & e) {
+            error_log("Commit on unmount failed: ", e.what(), "\n");
+        }
+    }
+
+    void op_lookup(fuse_req_t req, const fuse_ino_t parent, const char * name)
+    {
+        serve(req, [&](session_t & session)
+        {
+            try
+            {
+                reply_entry(req, session, session.filesystem.lookup(parent, name));
+            }
+            catch (const fs_error & e)
+            {
+                if (e.get_code() != ENOENT) {
+                    throw;
+                }
+
+                // node id 0: the kernel caches the miss for entry_timeout
+                fuse_entry_param param { };
+                param.entry_timeout = session.options.entry_timeout;
+                fuse_reply_entry(req, &param);
+            }
+        });
+    }
+
+    void op_forget(fuse_req_t req, const fuse_ino_t ino, const uint64_t nlookup)
+    {
+        session_of(req).filesystem.forget(ino, nlookup);
+        fuse_reply_none(req);
+    }
+
+    void op_forget_multi(fuse_req_t req, const size_t count, fuse_forget_data * forgets)
+    {
+        for (size_t i = 0; i < count; i++) {
+            session_of(req).filesystem.forget(forgets[i].ino, forgets[i].nlookup);
+        }
+        fuse_reply_none(req);
+    }
+
+    void op_getattr(fuse_req_t req, const fuse_ino_t ino, fuse_file_info *)
+    {
+        serve(req, [&](session_t & session)
+        {
+            const struct stat attributes = session.filesystem.getattr(ino);
+            fuse_reply_attr(req, &attributes, session.options.attr_timeout);
+        });
+    }
+
+    void op_setattr(fuse_req_t req, const fuse_ino_t ino, struct stat * attr, const int to_set, fuse_file_info *)
+    {
+        serve(req, [&](session_t & session)
+        {
+            const struct stat attributes = session.filesystem.setattr(ino, *attr, to_set_of(to_set));
+            fuse_reply_attr(req, &attributes, session.options.attr_timeout);
+        });
+    }
+
+    void op_readlink(fuse_req_t req, const fuse_ino_t ino)
+    {
+        serve(req, [&](session_t & session) { fuse_reply_readlink(req, session.filesystem.readlink(ino).c_str()); });
+    }
+
+    void op_mknod(fuse_req_t req, const fuse_ino_t parent, const char * name, const mode_t mode, const dev_t rdev)
+    {
+        serve(req, [&](session_t & session)
+        {
+            const fuse_ctx * ctx = fuse_req_ctx(req);
+            reply_entry(req, session, session.filesystem.mknod(parent, name, mode, rdev, ctx->uid, ctx->gid));
+        });
+    }
+
+    void op_mkdir(fuse_req_t req, const fuse_ino_t parent, const char * name, const mode_t mode)
+    {
+        serve(req, [&](session_t & session)
+        {
+            const fuse_ctx * ctx = fuse_req_ctx(req);
+            reply_entry(req, session, session.filesystem.mkdir(parent, name, mode, ctx->uid, ctx->gid));
+        });
+    }
+
+    void op_symlink(fuse_req_t req, const char * link, const fuse_ino_t parent, const char * name)
+    {
+        serve(req, [&](session_t & session)
+        {
+            const fuse_ctx * ctx = fuse_req_ctx(req);
+            reply_entry(req, session, session.filesystem.symlink(parent, name, link, ctx->uid, ctx->gid));
+        });
+    }
+
+    void op_link(fuse_req_t req, const fuse_ino_t ino, const fuse_ino_t new_parent, const char * new_name)
+    {
+        serve(req, [&](session_t & session) { reply_entry(req, session, session.filesystem.link(ino, new_parent, new_name)); });
+    }
+
+    void op_unlink(fuse_req_t req, const fuse_ino_t parent, const char * name)
+    {
+        serve(req, [&](session_t & session)
+        {
+            session.filesystem.unlink(parent, name);
+            fuse_reply_err(req, 0);
+        });
+    }
+
+    void op_rmdir(fuse_req_t req, const fuse_ino_t parent, const char * name)
+    {
+        serve(req, [&](session_t & session)
+        {
+            session.filesystem.rmdir(parent, name);
+            fuse_reply_err(req, 0);
+        });
+    }
+
+    void op_rename(fuse_req_t req, const fuse_ino_t parent, const char * name, const fuse_ino_t new_parent,
+        const char * new_name, const unsigned int flags)
+    {
+        serve(req, [&](session_t & session)
+        {
+            session.filesystem.rename(parent, name, new_parent, new_name, flags);
+            fuse_reply_err(req, 0);
+        });
+    }
+
+    void op_open(fuse_req_t req, const fuse_ino_t ino, fuse_file_info * fi)
+    {
+        serve(req, [&](session_t & session)
+        {
+            attach(req, session, ino, fi, session.filesystem.open(ino, fi->flags));
+            fuse_reply_open(req, fi);
+        });
+    }
+
+    void op_create(fuse_req_t req, const fuse_ino_t parent, const char * name, const mode_t mode, fuse_file_info * fi)
+    {
+        serve(req, [&](session_t & session)
+        {
+            const fuse_ctx * ctx = fuse_req_ctx(req);
+            const auto entry = session.filesystem.mknod(parent, name, S_IFREG | (mode & ~S_IFMT), 0, ctx->uid, ctx->gid);
+            attach(req, session, entry.node_id, fi, session.filesystem.open(entry.node_id, fi->flags & ~O_TRUNC));
+
+            fuse_entry_param param { };
+            param.ino = entry.node_id;
+            param.attr = entry.attributes;
+            param.attr_timeout = session.options.attr_timeout;
+            param.entry_timeout = session.options.entry_timeout;
+            fuse_reply_create(req, &param, fi);
+        });
+    }
+
+    void op_read(fuse_req_t req, const fuse_ino_t ino, const size_t size, const off_t off, fuse_file_info * fi)
+    {
+        serve(req, [&](session_t & session)
+        {
+            const auto & handle = *file_of(fi).handle;
+            if (!session.splice)
+            {
+                const auto data = session.filesystem.read(ino, handle, static_cast<uint64_t>(off), size);
+                fuse_reply_buf(req, reinterpret_cast<const char *>(data.data()), data.size());
+                return;
+            }
+
+            // file ranges are spliced into /dev/fuse by libfuse, bytes in memory are vmspliced
+            const auto pieces = session.filesystem.read_pieces(ino, handle, static_cast<uint64_t>(off), size);
+            if (pieces.empty()) {
+                fuse_reply_buf(req, nullptr, 0);
+                return;
+            }
+
+            const std::unique_ptr < fuse_bufvec, decltype(&std::free) > buffers(static_cast<fuse_bufvec *>(
+                std::calloc(1, sizeof(fuse_bufvec) + (pieces.size() - 1) * sizeof(fuse_buf))), std::free);
+            if (!buffers) {
+                throw fs_error(ENOMEM, "Cannot allocate a read reply");
+            }
+
+            buffers->count = pieces.size();
+            for (uint64_t i = 0; i < pieces.size(); i++)
+            {
+                fuse_buf & buffer = buffers->buf[i];
+                buffer.size = pieces[i].length;
+                if (pieces[i].fd >= 0)
+                {
+                    buffer.flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+                    buffer.fd = pieces[i].fd;
+                    buffer.pos = static_cast<off_t>(pieces[i].fd_offset);
+                }
+                else
+                {
+                    buffer.mem = const_cast<uint8_t *>(pieces[i].data.data());
+                    buffer.fd = -1;
+                }
+            }
+            fuse_reply_data(req, buffers.get(), FUSE_BUF_SPLICE_MOVE);
+        });
+    }
+
+    void op_write_buf(fuse_req_t req, const fuse_ino_t ino, fuse_bufvec * in, const off_t off, fuse_file_info *)
+    {
+        serve(req, [&](session_t & session)
+        {
+            // blocks are hashed and compressed, so spliced data has to land in memory once
+            if (in->count == 1 && !(in->buf[0].flags & FUSE_BUF_IS_FD))
+            {
+                fuse_reply_write(req, session.filesystem.write(ino, static_cast<uint64_t>(off),
+                    static_cast<const uint8_t *>(in->buf[0].mem), in->buf[0].size));
+                return;
+            }
+
+            const size_t size = fuse_buf_size(in);
+            std::vector < uint8_t > data(size);
+            fuse_bufvec out = FUSE_BUFVEC_INIT(size);
+            out.buf[0].mem = data.data();
+            const ssize_t copied = fuse_buf_copy(&out, in, static_cast<fuse_buf_copy_flags>(0));
+            if (copied < 0) {
+                throw fs_error(static_cast<int>(-copied), "Cannot receive write data");
+            }
+            fuse_reply_write(req, session.filesystem.write(ino, static_cast<uint64_t>(off), data.data(),
+                static_cast<uint64_t>(copied)));
+        });
+    }
+
+    void op_flush(fuse_req_t req, const fuse_ino_t ino, fuse_file_info *)
+    {
+        serve(req, [&](session_t & session)
+        {
+            session.filesystem.flush(ino);
+            fuse_reply_err(req, 0);
+        });
+    }
+
+    void op_release(fuse_req_t req, const fuse_ino_t ino, fuse_file_info * fi)
+    {
+        detach(req, session_of(req), ino, fi);
+        fuse_reply_err(req, 0);
+    }
+
+    void op_fsync(fuse_req_t req, fuse_ino_t, int, fuse_file_info *)
+    {
+        serve(req, [&](session_t & session)
+        {
+            session.filesystem.commit();
+            fuse_reply_err(req, 0);
+        });
+    }
+
+    void op_fallocate(fuse_req_t req, const fuse_ino_t ino, const int mode, const off_t offset, const off_t length,
+        fuse_file_info *)
+    {
+        serve(req, [&](session_t & session)
+        {
+            if (offset < 0 || length <= 0) {
+                throw fs_error(EINVAL, "Invalid fallocate range");
+            }
+            session.filesystem.fallocate(ino, mode, static_cast<uint64_t>(offset), static_cast<uint64_t>(length));
+            fuse_reply_err(req, 0);
+        });
+    }
+
+    void op_lseek(fuse_req_t req, const fuse_ino_t ino, const off_t off, const int whence, fuse_file_info * fi)
+    {
+        serve(req, [&](session_t & session)
+        {
+            if (off < 0) {
+                throw fs_error(ENXIO, "Negative offset");
+            }
+            const uint64_t found = session.filesystem.seek(ino, *file_of(fi).handle, static_cast<uint64_t>(off), whence);
+            fuse_reply_lseek(req, static_cast<off_t>(found));
+        });
+    }
+
+    void op_opendir(fuse_req_t req, const fuse_ino_t ino, fuse_file_info * fi)
+    {
+        serve(req, [&](session_t & session)
+        {
+            fi->fh = reinterpret_cast<uint64_t>(session.filesystem.opendir(ino).release());
+            fuse_reply_open(req, fi);
+        });
+    }
+
+    void op_readdir(fuse_req_t req, const fuse_ino_t ino, const size_t size, const off_t off, fuse_file_info * fi)
+    {
+        serve(req, [&](session_t & session)
+        {
+            std::vector < char > buffer(size);
+            size_t used = 0;
+            session.filesystem.readdir(ino, dir_of(fi), static_cast<uint64_t>(off),
+                [&](const std::string & name, const uint64_t entry_ino, const uint32_t type, const uint64_t cookie) -> bool
+                {
+                    struct stat attributes { };
+                    attributes.st_ino = entry_ino;
+                    attributes.st_mode = type;
+                    const size_t needed = fuse_add_direntry(req, nullptr, 0, name.c_str(), nullptr, 0);
+                    if (used + needed > size) {
+                        return false;
+                    }
+
+                    fuse_add_direntry(req, buffer.data() + used, size - used, name.c_str(), &attributes, static_cast<off_t>(cookie));
+                    used += needed;
+                    return true;
+                });
+            fuse_reply_buf(req, buffer.data(), used);
+        });
+    }
+
+    void op_releasedir(fuse_req_t req, fuse_ino_t, fuse_file_info * fi)
+    {
+        delete &dir_of(fi);
+        fuse_reply_err(req, 0);
+    }
+
+    void op_statfs(fuse_req_t req, fuse_ino_t)
+    {
+        serve(req, [&](session_t & session)
+        {
+            const struct statvfs st = session.filesystem.statfs();
+            fuse_reply_statfs(req, &st);
+        });
+    }
+
+    /// Sends inode invalidations from its own thread: the kernel may need a worker to finish
+    /// one, so they cannot be sent from the request (and under the lock) that caused them
+    class invalidator_t
+    {
+        fuse_session * se;
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::vector < uint64_t > pending;
+        bool stop = false;
+        std::thread thread;
+
+        void deliver()
+        {
+            std::unique_lock lock(mutex);
+            while (true)
+            {
+                cond.wait(lock, [this] { return stop || !pending.empty(); });
+                if (pending.empty()) {
+                    return;
+                }
+
+                std::vector < uint64_t > batch;
+                batch.swap(pending);
+                lock.unlock();
+                for (const auto node_id : batch)
+                {
+                    // -ENOENT: the kernel holds nothing for this node, nothing to drop
+                    if (const int result = fuse_lowlevel_notify_inval_inode(se, node_id, 0, 0); result != 0 && result != -ENOENT) {
+                        debug_log("Cannot invalidate node ", node_id, ": ", strerror(-result), "\n");
+                    }
+                }
+                lock.lock();
+            }
+        }
+
+    public:
+        explicit invalidator_t(fuse_session * se) : se(se), thread([this] { deliver(); }) { }
+
+        void push(const uint64_t node_id)
+        {
+            std::lock_guard lock(mutex);
+            pending.push_back(node_id);
+            cond.notify_one();
+        }
+
+        ~invalidator_t()
+        {
+            {
+                std::lock_guard lock(mutex);
+                stop = true;
+            }
+            cond.notify_one();
+            thread.join();
+        }
+
+        invalidator_t(const invalidator_t &) = delete;
+        invalidator_t(invalidator_t &&) = delete;
+        invalidator_t &operator=(const invalidator_t &) = delete;
+        invalidator_t &operator=(invalidator_t &&) = delete;
+    };
+
+    fuse_lowlevel_ops make_operations()
+    {
+        fuse_lowlevel_ops ops { };
+        ops.init = op_init;
+        ops.destroy = op_destroy;
+        ops.lookup = op_lookup;
+        ops.forget = op_forget;
+        ops.forget_multi = op_forget_multi;
+        ops.getattr = op_getattr;
+        ops.setattr = op_setattr;
+        ops.readlink = op_readlink;
+        ops.mknod = op_mknod;
+        ops.mkdir = op_mkdir;
+        ops.symlink = op_symlink;
+        ops.link = op_link;
+        ops.unlink = op_unlink;
+        ops.rmdir = op_rmdir;
+        ops.rename = op_rename;
+        ops.open = op_open;
+        ops.create = op_create;
+        ops.read = op_read;
+        ops.write_buf = op_write_buf;
+        ops.flush = op_flush;
+        ops.release = op_release;
+        ops.fsync = op_fsync;
+        ops.fallocate = op_fallocate;
+        ops.lseek = op_lseek;
+        ops.opendir = op_opendir;
+        ops.readdir = op_readdir;
+        ops.releasedir = op_releasedir;
+        ops.fsyncdir = op_fsync;
+        ops.statfs = op_statfs;
+        return ops;
+    }
+}
+
+fuse_server::fuse_server(cow_filesystem & filesystem, std::string mount_point, options_t options)
+    : filesystem(filesystem), mount_point(std::move(mount_point)), options(options)
+{
+}
+
+[[nodiscard]] std::vector < int > fuse_server::available_cpus()
+{
+    std::vector < int > result;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &cpus)) {
+                result.push_back(cpu);
+            }
+        }
+    }
+    return result;
+}
+
+[[nodiscard]] uint64_t fuse_server::get_thread_count() const
+{
+    if (options.threads != 0) {
+        return options.threads;
+    }
+
+    if (const auto cpus = available_cpus(); !cpus.empty()) {
+        return cpus.size();
+    }
+    return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+[[nodiscard]] uint64_t fuse_server::get_io_size() const
+{
+    const uint64_t block_size = filesystem.get_block_size();
+    return std::max(options.max_io_size / block_size, static_cast<uint64_t>(1)) * block_size;
+}
+
+[[nodiscard]] bool fuse_server::uses_io_uring() const
+{
+    if (options.transport != TRANSPORT_IO_URING) {
+        return false;
+    }
+
+#if FUSE_VERSION >= FUSE_MAKE_VERSION(3, 18)
+    std::ifstream parameter("/sys/module/fuse/parameters/enable_uring");
+    char enabled = 'N';
+    if (!(parameter >> enabled) || enabled != 'Y')
+    {
+        warning_log("Kernel FUSE io_uring support is not enabled (fuse.enable_uring), using /dev/fuse\n");
+        return false;
+    }
+    return true;
+#else
+    warning_log("libfuse ", FUSE_MAJOR_VERSION, ".", FUSE_MINOR_VERSION, " has no io_uring transport, using /dev/fuse\n");
+    return false;
+#endif
+}
+
+int fuse_server::run(const std::string & program_name)
+{
+    session_t session { .filesystem = filesystem, .options = options, .io_size = get_io_size(),
+        .cpus = options.channels == CHANNELS_PER_CPU ? available_cpus() : std::vector < int > { } };
+    const fuse_lowlevel_ops ops = make_operations();
+    raise_fd_limit();
+
+    std::string mount_options = "fsname=" + program_name + ",subtype=cppCowOverlay,default_permissions"
+        + ",max_read=" + std::to_string(session.io_size);
+    if (options.allow_other) {
+        mount_options += ",allow_other";
+    }
+    if (options.read_only) {
+        mount_options += ",ro";
+    }
+
+    // libfuse itself falls back to /dev/fuse if the kernel refuses the ring during init
+    const bool io_uring = uses_io_uring();
+    if (io_uring) {
+        mount_options += ",io_uring,io_uring_q_depth=" + std::to_string(std::max(options.uring_queue_depth, static_cast<uint64_t>(1)));
+    }
+
+    fuse_args args = FUSE_ARGS_INIT(0, nullptr);
+    fuse_opt_add_arg(&args, program_name.c_str());
+    fuse_opt_add_arg(&args, "-o");
+    fuse_opt_add_arg(&args, mount_options.c_str());
+
+    fuse_session * se = fuse_session_new(&args, &ops, sizeof(ops), &session);
+    fuse_opt_free_args(&args);
+    if (se == nullptr) {
+        easy_throw_except(fuse_mount_failed, "Cannot create a FUSE session");
+    }
+
+    if (fuse_set_signal_handlers(se) != 0)
+    {
+        fuse_session_destroy(se);
+        easy_throw_except(fuse_mount_failed, "Cannot install signal handlers");
+    }
+
+    if (fuse_session_mount(se, mount_point.c_str()) != 0)
+    {
+        fuse_remove_signal_handlers(se);
+        fuse_session_destroy(se);
+        easy_throw_except(fuse_mount_failed, "Cannot mount on " + mount_point);
+    }
+
+    const uint64_t threads = get_thread_count();
+    info_log("Serving ", mount_point, " with ", threads, " worker threads, ",
+        io_uring ? "io_uring queues" : options.channels == CHANNELS_PER_CPU ? "one channel per CPU" : "one shared channel", "\n");
+    fuse_loop_config * config = fuse_loop_cfg_create();
+    fuse_loop_cfg_set_max_threads(config, static_cast<unsigned int>(threads));
+    fuse_loop_cfg_set_idle_threads(config, static_cast<unsigned int>(threads));
+    fuse_loop_cfg_set_clone_fd(config, options.channels == CHANNELS_PER_CPU);
+    int result;
+    {
+        invalidator_t invalidator(se);
+        filesystem.set_invalidation_handler([&invalidator](const uint64_t node_id) { invalidator.push(node_id); });
+        result = fuse_session_loop_mt(se, config);
+        filesystem.set_invalidation_handler(nullptr);
+    }
+    fuse_loop_cfg_destroy(config);
+
+    fuse_session_unmount(se);
+    fuse_remove_signal_handlers(se);
+    fuse_session_destroy(se);
+    return result;
+}
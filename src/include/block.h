@@ -1,15 +1,22 @@
 #ifndef CPPCOWOVERLAY_BLOCK_H
 #define CPPCOWOVERLAY_BLOCK_H
 
+#include <atomic>
 #include <cstdint>
 #include <fstream>
 #include <utility>
 #include <vector>
 #include <cstring>
 #include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <fcntl.h>
+#include <unistd.h>
 #include "lz4.h"
 #include "error.h"
 #include "log.hpp"
+#include "journal_clock.h"
 
 #ifdef __unix__
 # undef LITTLE_ENDIAN
@@ -49,11 +56,16 @@ namespace cow_block
     template < PODType Type >
     [[nodiscard]] uint64_t hashcrc64(const Type & data) {
         CRC64 hash;
-        hash.update(static_cast<uint8_t*>(&data), sizeof(data));
+        hash.update(reinterpret_cast<const uint8_t*>(&data), sizeof(data));
         return hash.get_checksum();
     }
 
     std::string bin2hex(const std::vector < char > &);
+
+    /// @brief Reverse of bin2hex() for block names
+    /// @param name Block name, 16 hex digits
+    /// @return Block id (CRC64 hash) the name was made from
+    [[nodiscard]] uint64_t block_id_from_name(const std::string & name);
     template < PODType Type > std::string bin2hex(const Type & raw)
     {
         std::vector < char > vec(sizeof(raw));
@@ -78,6 +90,21 @@ namespace cow_block
         }
     }
 
+    /// @brief Flush a file or directory to stable storage
+    /// @param path Path to the file or directory
+    /// @return false if the file cannot be opened or fsync() failed
+    [[nodiscard]] inline bool sync_path(const std::string & path)
+    {
+        const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+
+        const bool ok = ::fsync(fd) == 0;
+        ::close(fd);
+        return ok;
+    }
+
     def_except_with_trace(write_into_data_block_failed);
 
     inline void write_into(const std::string & path, const std::vector < uint8_t > & data)
@@ -95,6 +122,17 @@ namespace cow_block
         }
     }
 
+    /// @brief Replace the content of a file atomically (write to a temporary file, then rename)
+    /// @param path Path to the file
+    /// @param data New content
+    inline void replace_into(const std::string & path, const std::vector < uint8_t > & data)
+    {
+        const std::string tmp_path = path + ".tmp";
+        std::filesystem::remove(tmp_path);
+        write_into(tmp_path, data);
+        std::filesystem::rename(tmp_path, path);
+    }
+
     template < typename Type >
     void write_pod(const std::string & path, const Type & data)
     {
@@ -119,23 +157,149 @@ namespace cow_block
     };
     static_assert(sizeof(block_attribute_t) == 4096);
 
+    /// @brief Pack the flag fields of a block attribute into one journal parameter
+    /// @param attr Block attribute
+    /// @return Packed flags, one byte per field
+    [[nodiscard]] inline uint64_t pack_block_attribute_flags(const block_attribute_t & attr)
+    {
+        return static_cast<uint64_t>(attr.information.is_lz4_compressed)
+            | static_cast<uint64_t>(attr.information.is_frozen) << 8
+            | static_cast<uint64_t>(attr.information.newly_allocated_block_thus_no_cow) << 16
+            | static_cast<uint64_t>(attr.information.data_block_type) << 24
+            | static_cast<uint64_t>(attr.information.data_block_type_backup) << 32;
+    }
+
+    /// @brief Rebuild a block attribute from journal parameters
+    /// @param flags Packed flags produced by pack_block_attribute_flags
+    /// @param snapshot_version_count Snapshot reference count
+    /// @return Block attribute
+    [[nodiscard]] inline block_attribute_t unpack_block_attribute(const uint64_t flags, const uint64_t snapshot_version_count)
+    {
+        using data_block_type_t = decltype(block_attribute_t::information)::data_block_type_t;
+        block_attribute_t attr { };
+        attr.information.is_lz4_compressed = flags & 0xFF;
+        attr.information.is_frozen = flags >> 8 & 0xFF;
+        attr.information.newly_allocated_block_thus_no_cow = flags >> 16 & 0xFF;
+        attr.information.data_block_type = static_cast<data_block_type_t>(flags >> 24 & 0xFF);
+        attr.information.data_block_type_backup = static_cast<data_block_type_t>(flags >> 32 & 0xFF);
+        attr.information.snapshot_version_count = snapshot_version_count;
+        return attr;
+    }
+
     def_except_with_trace(block_manager_invalid_argument);
+    def_except_with_trace(block_corrupted);
+    def_except_with_trace(read_from_data_block_failed);
+    def_except_with_trace(journal_mode_invalid);
 
+    /// Durability of the block store and the journal
+    enum journal_mode_t : uint8_t
+    {
+        JOURNAL_ORDERED,    /// data blocks are flushed before the journal commit that references them
+        JOURNAL_WRITEBACK,  /// only the journal is flushed on commit, data blocks reach disk whenever
+        JOURNAL_UNSAFE,     /// nothing is ever flushed, for throwaway upper layers
+    };
+
+    /// @brief Parse a journal mode from configuration
+    /// @param name "ordered", "writeback" or "unsafe"
+    /// @return Journal mode
+    [[nodiscard]] inline journal_mode_t journal_mode_from_string(const std::string & name)
+    {
+        if (name == "ordered") return JOURNAL_ORDERED;
+        if (name == "writeback") return JOURNAL_WRITEBACK;
+        if (name == "unsafe") return JOURNAL_UNSAFE;
+        throw journal_mode_invalid("Unknown journal mode \"" + name + "\"");
+    }
+
+    /// Content-addressed block store. Blocks come in size classes, class n being block_size << n,
+    /// up to max_class_size; metadata always uses class 0. A block file does not record its
+    /// class, whoever references a block knows it (an inode keeps the class of all its blocks)
     class block_manager
     {
+    public:
+        static constexpr uint64_t max_class_size = 1024 * 1024;
+
+        /// How write_in_block() stored a block
+        struct write_outcome_t
+        {
+            bool existed = false;       /// already stored (or all zeros), nothing was written
+            bool compressed = false;    /// written LZ4 compressed
+        };
+
+    private:
         std::string data_dir;           /// directory for data
-        std::string zero_pointer_name;  /// name for zero pointer (unallocated zeros)
+        std::string tmp_dir;            /// blocks being written, renamed into data_dir once complete
+        std::vector < uint64_t > zero_block_ids;    /// hash of an all-zero block of each size class, never stored
         const uint64_t block_size;      /// block size
+        const journal_mode_t journal_mode;
+        mutable std::mutex pending_mutex;
+        mutable std::vector < std::string > pending_sync; /// blocks written but not yet flushed (ordered mode)
+        mutable std::atomic < bool > clone_supported = true;        /// FICLONERANGE worked, or has not been tried
+        mutable std::atomic < bool > copy_range_supported = true;   /// copy_file_range() worked, or has not been tried
+        mutable std::atomic < uint64_t > tmp_serial = 0;
+
+        void track_pending(const std::string & path_name) const;
+
+        /// @brief Name a file in tmp_dir no other writer uses
+        [[nodiscard]] std::string make_tmp_path() const;
+
+        /// @brief Write a block file under a temporary name and move it into place, so a block file
+        /// that exists is always complete
+        /// @param path_name Block file
+        /// @param data Stored content
+        /// @param exclusive Leave an existing block file as it is instead of replacing it
+        /// @return false if exclusive and the block file already existed
+        bool store_file(const std::string & path_name, const std::vector < uint8_t > & data, bool exclusive) const;
 
     public:
-        /// @brief Initializes class members
+        /// @brief Initializes class members, and drops blocks left half written in tmp_dir
         /// @param data_dir Directory for all data files
         /// @param blk_sz Block size
-        block_manager(std::string data_dir, uint64_t blk_sz);
-
-        /// @brief Write to a block whose path is $DATA_DIR/CRC64_STR(data)
-        /// @param data Data of the block whose size must be the same with block_size
-        void write_in_block(const std::vector < uint8_t > & data) const;
+        /// @param mode Journal mode, decides whether written blocks are tracked for flush()
+        block_manager(std::string data_dir, uint64_t blk_sz, journal_mode_t mode = JOURNAL_ORDERED);
+
+        /// @brief Write to a block whose path is $DATA_DIR/CRC64_STR(data). The block is stored LZ4
+        /// compressed when that saves at least an eighth of it, a stored block shorter than
+        /// its class size is a compressed one
+        /// @param data Data of the block whose size must be the size of one of the size classes
+        /// @param outcome Receives how the block was stored, may be nullptr
+        /// @return Block id, i.e., CRC64 of data
+        uint64_t write_in_block(const std::vector < uint8_t > & data, write_outcome_t * outcome = nullptr) const;
+
+        /// @brief Store a block uncompressed without trying to compress it, and without looking it
+        /// up first: the file is moved into place exclusively, an existing one is left as it is.
+        /// For data known not to compress, see write_policy
+        /// @param data Data of the block whose size must be the size of one of the size classes
+        /// @return Block id, i.e., CRC64 of data
+        uint64_t write_in_block_raw(const std::vector < uint8_t > & data) const;
+
+        /// @brief Store a block by having the file system copy it from another file: shared extents
+        /// with FICLONERANGE where it supports reflinks (XFS, btrfs), an in-kernel copy_file_range()
+        /// otherwise. The block is stored uncompressed. Once a method fails for lack of support it
+        /// is not tried again
+        /// @param block_id Block id of the bytes at source_offset, i.e., CRC64 of them
+        /// @param source_fd File to copy from, readable
+        /// @param source_offset Offset of the block in that file, a whole block must follow
+        /// @param size_class Size class of the block
+        /// @return true if the block is stored, false if it has to go through write_in_block()
+        bool clone_in_block(uint64_t block_id, int source_fd, uint64_t source_offset, uint8_t size_class = 0) const;
+
+        /// @brief Read a block back
+        /// @param block_id Block id returned by write_in_block()
+        /// @param size_class Size class the block was written with
+        /// @return Block content, get_block_size(size_class) bytes
+        [[nodiscard]] std::vector < uint8_t > read_block(uint64_t block_id, uint8_t size_class = 0) const;
+
+        /// @brief Open the file of a block stored uncompressed, whose bytes can be spliced as they are
+        /// @param block_id Block id returned by write_in_block()
+        /// @param size_class Size class the block was written with
+        /// @return Read-only descriptor the caller closes, -1 for a compressed or all-zero block, or
+        /// if the file cannot be opened for any reason but being missing
+        [[nodiscard]] int open_raw_block(uint64_t block_id, uint8_t size_class = 0) const;
+
+        /// @brief Whether a block is stored, so its id can be referenced without writing it again
+        /// @param block_id Block id
+        /// @return true if the block file exists or the block is all zeros
+        [[nodiscard]] bool has_block(uint64_t block_id) const;
 
         /// @brief set block attribute
         /// @param block_name Name for the block
@@ -148,8 +312,32 @@ namespace cow_block
         [[nodiscard]] block_attribute_t get_block_attribute(const std::string & block_name) const;
 
         /// @brief get block size
-        /// @return Block size
-        [[nodiscard]] uint64_t get_block_size() const;
+        /// @param size_class Size class
+        /// @return Block size of the class
+        [[nodiscard]] uint64_t get_block_size(uint8_t size_class = 0) const;
+
+        /// @brief get zero block id
+        /// @param size_class Size class
+        /// @return Hash of an all-zero block of the class, which is never stored
+        [[nodiscard]] uint64_t get_zero_block_id(uint8_t size_class = 0) const;
+
+        /// @brief Find the size class of a block size
+        /// @param size Block size in bytes
+        /// @return Size class, nullopt if no class has that size
+        [[nodiscard]] std::optional < uint8_t > size_class_of(uint64_t size) const;
+
+        /// @brief get data directory
+        /// @return Directory for all data files
+        [[nodiscard]] std::string get_data_dir() const;
+
+        /// @brief Flush every block written since the last flush, together with the data directory.
+        /// Only ordered mode tracks blocks, in other modes this is a no-op
+        void flush() const;
+
+        /// @brief Check that a block file exists and its content still matches its name
+        /// @param block_name Name of the block
+        /// @return true if the block is intact
+        [[nodiscard]] bool verify_block(const std::string & block_name) const;
 
         ~block_manager() = default;
         block_manager(const block_manager &) = delete;
@@ -160,11 +348,19 @@ namespace cow_block
 
     def_except_with_trace(log_io_failed);
 
-    class log_manager
+    /// Journal actions. Every action except LOG_COMMIT carries its target object (block hash, inode number, ...)
+    /// in param1, which is what the recovery engine partitions on
+    enum log_action_t : uint64_t
     {
-    private:
-        std::string log_dir;
+        LOG_COMMIT = 0x01,              /// transaction boundary, no parameters
+        LOG_WRITE_BLOCK,                /// param1: block hash
+        LOG_SET_BLOCK_ATTRIBUTE,        /// param1: block hash, param2: packed flags, param3: snapshot_version_count
+        LOG_ROOT_UPDATE,                /// param1: inode table root block, param2: next free inode number
+    };
 
+    class log_manager
+    {
+    public:
         struct log_t
         {
             timespec timestamp;
@@ -182,17 +378,70 @@ namespace cow_block
                     uint64_t param7;
                 } generic;
             } params;
+            uint64_t sequence;  /// strictly increasing record number
+            uint64_t checksum;  /// CRC64 of the record with this field zeroed
         };
 
+    private:
+        std::string log_dir;
+        const journal_mode_t journal_mode;
+        mutable std::mutex append_mutex;
+        mutable uint64_t next_sequence = 1;
+        mutable journal_clock clock;
+        std::function<void()> commit_barrier; /// runs before a commit record is written
+
         /// remove all logs before time_point
         /// @param time_point Log validation point
         void trunc_log(uint64_t time_point) const;
 
     public:
-        explicit log_manager(std::string log_dir) : log_dir(std::move(log_dir))
-        {
-            mkdir_p(this->log_dir);
-        }
+        /// @brief Initializes class members
+        /// @param log_dir Directory for the journal
+        /// @param mode Journal mode, decides whether commit() flushes the journal
+        explicit log_manager(std::string log_dir, journal_mode_t mode = JOURNAL_ORDERED);
+
+        /// @brief Set the action run before every commit record, e.g. flushing data blocks in ordered mode
+        /// @param barrier Commit barrier
+        void set_commit_barrier(std::function<void()> barrier);
+
+        /// @brief Calculate the checksum of a log record
+        /// @param log Log record, the checksum field is ignored
+        /// @return CRC64 checksum
+        [[nodiscard]] static uint64_t checksum_of(log_t log);
+
+        /// @brief Check whether a log record is intact
+        /// @param log Log record
+        /// @return true if the stored checksum matches
+        [[nodiscard]] static bool is_valid(const log_t & log);
+
+        /// @brief Read records sequentially
+        /// @param offset Byte offset to start from
+        /// @param callback Called with every record and its byte offset, return false to stop
+        /// @return Byte offset right after the last record accepted by callback
+        uint64_t scan(uint64_t offset, const std::function<bool(const log_t &, uint64_t)> & callback) const;
+
+        /// @brief Drop everything after offset, used to discard an uncommitted or torn tail
+        /// @param offset New log size in bytes
+        void discard_after(uint64_t offset) const;
+
+        /// @brief Run the commit barrier, append a transaction boundary and, unless in unsafe mode,
+        /// flush the journal
+        void commit() const;
+
+        /// @brief Flush the journal, unless in unsafe mode
+        void sync() const;
+
+        /// @brief Append a record exactly as it was written to another journal (shipping, standby)
+        /// @param log Intact record whose sequence is past every record in this journal
+        void append_raw(const log_t & log) const;
+
+        /// @brief Find the last transaction boundary that is preceded only by intact records
+        /// @return Its sequence number, or 0 if there is none
+        [[nodiscard]] uint64_t last_committed_sequence() const;
+
+        /// @brief get log file path
+        /// @return Path to the log file
+        [[nodiscard]] std::string get_log_path() const;
 
         /// @brief Append log
         /// @param action Log Action
@@ -202,6 +451,22 @@ namespace cow_block
             uint64_t param3 = 0, uint64_t param4 = 0,
             uint64_t param5 = 0, uint64_t param6 = 0,
             uint64_t param7 = 0) const;
+
+        /// @brief Build a record for append_logs()
+        /// @param action Log Action
+        /// @param param... Parameter ... (the action determines Parameter number)
+        /// @return Record with timestamp, sequence and checksum still unset
+        [[nodiscard]] static log_t make_log(uint64_t action,
+            uint64_t param1 = 0, uint64_t param2 = 0,
+            uint64_t param3 = 0, uint64_t param4 = 0,
+            uint64_t param5 = 0, uint64_t param6 = 0,
+            uint64_t param7 = 0);
+
+        /// @brief Append a group of records with one write. The group shares one clock read,
+        /// each record gets the batch timestamp plus its index in nanoseconds
+        /// @param logs Records built by make_log()
+        void append_logs(std::vector < log_t > logs) const;
+
         [[nodiscard]] std::vector < log_t > get_last_n_logs(int64_t log_num) const;
 
         ~log_manager() = default;
@@ -0,0 +1,139 @@
+#ifndef CPPCOWOVERLAY_BLOCK_MAP_H
+#define CPPCOWOVERLAY_BLOCK_MAP_H
+
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <vector>
+#include "error.h"
+
+namespace cow_block
+{
+    def_except_with_trace(block_map_out_of_range);
+    def_except_with_trace(block_map_corrupted);
+
+    /// Maps a file's logical block index to the content block holding it.
+    ///
+    /// A radix tree of 64-way nodes, each node aligned to a cache line with both bitmaps in its
+    /// first line, so a lookup touches at most two lines per level: 5 levels cover a 1 TiB file
+    /// of 4 KiB blocks. A slot either points to a child node, or covers its whole span with a
+    /// single block (an extent), or is empty. Empty means a hole that reads as the zero block, so
+    /// runs of zero blocks never take up space, and aligned runs of one block collapse into a
+    /// single slot one level up.
+    /// Content blocks are named by hash, consecutive file blocks are not consecutive ids, so
+    /// extents are runs of the same block rather than runs of adjacent ones
+    class block_map
+    {
+    public:
+        using block_id_t = uint64_t;
+
+        struct extent_t
+        {
+            uint64_t first;     /// first logical block
+            uint64_t count;     /// number of logical blocks
+            block_id_t block;   /// content block of every logical block in the extent
+        };
+
+        static constexpr uint64_t fanout_shift = 6;
+        static constexpr uint64_t fanout = 1ULL << fanout_shift;
+        static constexpr uint64_t max_height = 10; /// 2^60 blocks
+
+        /// Not a stored block: the logical block still reads from the lower file at the same
+        /// offset, see inode::get_lower_origin(). No CRC64 of a block is expected to collide with it
+        static constexpr block_id_t lower_block = UINT64_MAX;
+
+    private:
+        struct alignas(64) node_t
+        {
+            uint64_t child_bitmap = 0;      /// slot is the index of a child node
+            uint64_t extent_bitmap = 0;     /// slot is a block id covering the slot's whole span
+            uint64_t slots[fanout] { };
+        };
+        static_assert(sizeof(node_t) % 64 == 0);
+
+        static constexpr uint32_t no_node = UINT32_MAX;
+
+        std::vector < node_t > nodes;
+        std::vector < uint32_t > free_nodes;
+        uint32_t root = no_node;
+        uint64_t height = 0;                /// root is at level height - 1
+        block_id_t zero_block;
+
+        [[nodiscard]] static uint64_t span_of(uint64_t level);
+        [[nodiscard]] uint64_t capacity() const;
+        [[nodiscard]] uint32_t alloc_node();
+        void free_subtree(uint32_t node, uint64_t level);
+        void grow_to(uint64_t index);
+
+        /// @brief Assign value (or a hole) to [first, last] inside a node
+        void assign(uint32_t node, uint64_t level, uint64_t base,
+            uint64_t first, uint64_t last, std::optional < block_id_t > value);
+
+        /// @brief Replace a child slot by a hole or an extent if its node became uniform
+        void collapse(uint32_t parent, uint64_t slot);
+
+        void walk(uint32_t node, uint64_t level, uint64_t base,
+            const std::function<void(uint64_t, uint64_t, block_id_t)> & callback) const;
+
+        [[nodiscard]] std::optional < uint64_t > find(uint32_t node, uint64_t level, uint64_t base, uint64_t from,
+            const std::function<bool(std::optional < block_id_t >)> & match) const;
+
+    public:
+        /// @brief Create an empty map, every block reads as a hole
+        /// @param zero_block Id of the all-zero block, stored as holes rather than mapped
+        explicit block_map(block_id_t zero_block);
+
+        /// @brief Find the content block of a logical block
+        /// @param index Logical block index
+        /// @return Block id, or nullopt for a hole
+        [[nodiscard]] std::optional < block_id_t > lookup(uint64_t index) const;
+
+        /// @brief Map one logical block
+        /// @param index Logical block index
+        /// @param block Content block, the zero block punches a hole
+        void set(uint64_t index, block_id_t block);
+
+        /// @brief Map a run of logical blocks to one content block
+        /// @param first First logical block
+        /// @param count Number of logical blocks
+        /// @param block Content block, the zero block punches a hole
+        void set_range(uint64_t first, uint64_t count, block_id_t block);
+
+        /// @brief Turn a run of logical blocks into a hole
+        /// @param first First logical block
+        /// @param count Number of logical blocks
+        void punch(uint64_t first, uint64_t count);
+
+        /// @brief Drop every mapping at or after a logical block, used on truncate
+        /// @param first First logical block to drop
+        void truncate(uint64_t first);
+
+        /// @brief Find the first logical block at or after an index whose mapping matches, skipping
+        /// whole extents and holes at a time, e.g. the next data or the next hole
+        /// @param index First logical block to consider
+        /// @param match Called with a block id, or nullopt for a hole
+        /// @return Logical block, nullopt if nothing matches (every block past the last mapped one is a hole)
+        [[nodiscard]] std::optional < uint64_t > find_next(uint64_t index,
+            const std::function<bool(std::optional < block_id_t >)> & match) const;
+
+        /// @brief Visit mapped extents in logical order, adjacent runs of one block are merged
+        /// @param callback Called with every extent
+        void for_each_extent(const std::function<void(const extent_t &)> & callback) const;
+
+        /// @brief Serialize as an extent list
+        /// @return Serialized map
+        [[nodiscard]] std::vector < uint8_t > serialize() const;
+
+        /// @brief Rebuild a map serialized by serialize()
+        /// @param data Serialized map
+        /// @param zero_block Id of the all-zero block
+        /// @return Block map
+        [[nodiscard]] static block_map deserialize(const std::vector < uint8_t > & data, block_id_t zero_block);
+
+        /// @brief get node count
+        /// @return Number of radix nodes in use
+        [[nodiscard]] uint64_t node_count() const;
+    };
+}
+
+#endif //CPPCOWOVERLAY_BLOCK_MAP_H
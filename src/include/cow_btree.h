@@ -0,0 +1,104 @@
+#ifndef CPPCOWOVERLAY_COW_BTREE_H
+#define CPPCOWOVERLAY_COW_BTREE_H
+
+#include <memory>
+#include <optional>
+#include "block.h"
+#include "lru_cache.h"
+
+namespace cow_block
+{
+    def_except_with_trace(btree_corrupted);
+    def_except_with_trace(btree_value_too_large);
+
+    /// In-memory form of a B+tree node. Nodes are immutable once stored, a change always
+    /// produces a new node (and a new block), so decoded nodes can be shared freely
+    struct btree_node_t
+    {
+        uint16_t level = 0;                             /// 0 for leaves
+        std::vector < uint64_t > keys;                  /// leaf: entry keys; inner: lowest key of each child
+        std::vector < std::vector < uint8_t > > values; /// leaf only
+        std::vector < uint64_t > children;              /// inner only, block ids
+    };
+
+    /// Decoded nodes shared by every tree on the same block store, keyed by block id.
+    /// Blocks are content addressed, so a cached node never goes stale
+    using buffer_pool = lru_cache < uint64_t, std::shared_ptr < const btree_node_t > >;
+
+    /// Copy-on-write B+tree with 64-bit keys and small byte-string values, stored one node per
+    /// block through block_manager. A tree is identified by its root block id: every update
+    /// path-copies the nodes from the changed leaf up to the root and returns the new root,
+    /// the old root still describes the tree as it was, which is what a snapshot is. Erasing
+    /// merges a node that drops below a quarter of a block with a sibling
+    class cow_btree
+    {
+    public:
+        using value_t = std::vector < uint8_t >;
+        using scan_callback_t = std::function<bool(uint64_t, const value_t &)>;
+
+    private:
+        const block_manager & blocks;
+        buffer_pool & pool;
+        const log_manager * journal;
+        const uint64_t block_size;
+        const uint64_t max_value_size;
+
+        using piece_t = std::pair < uint64_t /* lowest key */, uint64_t /* block id */ >;
+
+        [[nodiscard]] std::shared_ptr < const btree_node_t > load(uint64_t block_id) const;
+        [[nodiscard]] uint64_t store(const btree_node_t & node, std::vector < uint64_t > & written) const;
+        [[nodiscard]] uint64_t node_size(const btree_node_t & node, uint64_t first, uint64_t last) const;
+        [[nodiscard]] std::vector < piece_t > store_split(const btree_node_t & node, std::vector < uint64_t > & written) const;
+        [[nodiscard]] static uint64_t child_index(const btree_node_t & node, uint64_t key);
+
+        [[nodiscard]] std::vector < piece_t > insert_into(uint64_t block_id, uint64_t key, const value_t & value,
+            std::vector < uint64_t > & written) const;
+        [[nodiscard]] std::optional < piece_t > erase_from(uint64_t block_id, uint64_t key, bool & found,
+            std::vector < uint64_t > & written) const;
+        void merge_children(btree_node_t & node, uint64_t left, std::vector < uint64_t > & written) const;
+        bool scan_from(uint64_t block_id, uint64_t from, const scan_callback_t & callback) const;
+        void journal_written(const std::vector < uint64_t > & written) const;
+
+    public:
+        /// @brief Initializes the tree accessor
+        /// @param blocks Block store holding the nodes
+        /// @param pool Node cache, usually shared by every tree on the same store
+        /// @param journal Journal receiving a LOG_WRITE_BLOCK for every new node, may be nullptr
+        cow_btree(const block_manager & blocks, buffer_pool & pool, const log_manager * journal = nullptr);
+
+        /// @brief Store an empty tree
+        /// @return Root block id
+        [[nodiscard]] uint64_t create() const;
+
+        /// @brief Look a key up
+        /// @param root Root block id
+        /// @param key Key
+        /// @return Value, or nullopt if absent
+        [[nodiscard]] std::optional < value_t > get(uint64_t root, uint64_t key) const;
+
+        /// @brief Insert or replace a key
+        /// @param root Root block id
+        /// @param key Key
+        /// @param value Value, at most get_max_value_size() bytes
+        /// @return New root block id
+        [[nodiscard]] uint64_t put(uint64_t root, uint64_t key, const value_t & value) const;
+
+        /// @brief Remove a key
+        /// @param root Root block id
+        /// @param key Key
+        /// @return New root block id, root itself if the key was absent
+        [[nodiscard]] uint64_t erase(uint64_t root, uint64_t key) const;
+
+        /// @brief Visit entries in key order
+        /// @param root Root block id
+        /// @param from Smallest key to visit
+        /// @param callback Called with every key and value, return false to stop
+        void scan(uint64_t root, uint64_t from, const scan_callback_t & callback) const;
+
+        /// @brief get max value size
+        /// @return Largest value a leaf accepts, a leaf always holds at least four of them
+        [[nodiscard]] uint64_t get_max_value_size() const;
+    };
+}
+
+#endif //CPPCOWOVERLAY_COW_BTREE_H
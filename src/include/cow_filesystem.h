@@ -0,0 +1,437 @@
+#ifndef CPPCOWOVERLAY_COW_FILESYSTEM_H
+#define CPPCOWOVERLAY_COW_FILESYSTEM_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <sys/statvfs.h>
+#include "directory.h"
+#include "inode_table.h"
+#include "lower_stack.h"
+#include "fingerprint_cache.h"
+#include "read_ahead.h"
+#include "write_policy.h"
+#include "metadata_cache.h"
+
+namespace cow_block
+{
+    def_except_with_trace(block_size_class_invalid);
+
+    /// File system error, carries the errno reported back to the kernel
+    class fs_error final : public cppCowOverlayBaseErrorType
+    {
+        int code;
+
+    public:
+        fs_error(const int code, const std::string & msg) : cppCowOverlayBaseErrorType("fs_error: " + msg), code(code) {}
+        [[nodiscard]] int get_code() const { return code; }
+    };
+
+    /// The file system served over FUSE: a copy-on-write upper layer kept in the block store,
+    /// optionally stacked on read-only lower layers (see lower_stack for how those merge).
+    ///
+    /// Nodes are addressed by id, which is also the inode number. Upper inodes live in the
+    /// inode table, lower-only files get an id when first looked up and keep it once copied
+    /// up. Anything that modifies a lower file or directory copies it (and its parents) up
+    /// first. Small files are copied whole; larger ones are copied up lazily, their block map
+    /// starts out as block_map::lower_block everywhere and only blocks written afterwards go
+    /// to the block store, the rest keep reading from the lower file. Block ids of a file
+    /// copied whole are kept in a fingerprint_cache; while it stays unchanged, copying it up
+    /// again (e.g. into another upper layer sharing the block store) takes the stored blocks
+    /// without reading the file, and without leaving a lower origin behind. Whole blocks of
+    /// a lower file on the block store's own file system are stored by the kernel
+    /// (block_manager::clone_in_block) instead of being written back from memory.
+    ///
+    /// Regular files pick their block size when created (see block_manager for size classes):
+    /// the first of block_size_rules whose suffix ends the name, otherwise large_block_size for
+    /// files known to reach large_file_size (copied up from a lower file that large, or an empty
+    /// file truncated or fallocated to it), otherwise the store's block size.
+    ///
+    /// Data blocks written to a file go through a write_policy, which stops looking up and
+    /// compressing blocks of a file being written with data that never dedups nor compresses.
+    ///
+    /// Decompressed data blocks are kept in block_cache, keyed by their content hash so they
+    /// never go stale; read_ahead fills it ahead of sequential readers of upper files.
+    /// Removing a lower entry leaves a whiteout in the upper
+    /// directory, a directory copied up from the lower layer is merged with it, a directory
+    /// created in the upper layer hides whatever the lower layer had under its name.
+    ///
+    /// Metadata is guarded by one reader/writer lock: lookups and reads share it, anything
+    /// that modifies takes it exclusively. Data writes to a regular file are serialized by a
+    /// lock of that file instead, taken before the metadata lock: the blocks a write touches
+    /// are read under the shared lock, hashed, compressed and stored under none, and only
+    /// mapped under the exclusive one, so writers to different files and readers run side by
+    /// side. Modified inodes stay in memory and are written to the inode table together with
+    /// the new table root (LOG_ROOT_UPDATE) on commit, which runs every commit_interval, on
+    /// fsync and on unmount
+    class cow_filesystem
+    {
+    public:
+        struct options_t
+        {
+            std::vector < std::string > lower_dirs;         /// read-only lower layers, topmost first, empty for none
+            uint64_t lower_cache_entries = 65536;           /// cached lower path resolutions, see lower_stack
+            std::string fingerprint_path;                   /// lower file fingerprints kept across mounts, empty for none
+            bool fingerprint_xattr = false;                 /// also keep them in an xattr of each lower file
+            std::optional < uint64_t > inline_threshold;    /// see inode_table
+            uint64_t inode_cache_entries = 65536;
+            uint64_t dentry_cache_entries = 262144;
+            uint64_t buffer_pool_entries = 16384;           /// decoded metadata nodes
+            uint64_t block_cache_entries = 4096;            /// decompressed data blocks
+            uint64_t read_ahead_blocks = 256;               /// largest read-ahead window, 0 disables read-ahead
+            uint64_t read_ahead_threads = 2;
+            uint64_t write_buffer_blocks = 1024;            /// partial blocks held back for later writes to complete, 0 writes through
+            std::vector < std::pair < std::string, uint64_t > > block_size_rules;  /// name suffix and block size, first match wins
+            uint64_t large_block_size = 0;                  /// block size of large files, 0 for the store's
+            uint64_t large_file_size = 64 * 1024 * 1024;    /// size from which a file is large
+            uint64_t bypass_probe_blocks = 64;              /// see write_policy, 0 always dedups and compresses
+            uint64_t bypass_reprobe_blocks = 1024;
+            std::chrono::milliseconds commit_interval { 5000 };
+            bool read_only = false;
+            uint64_t initial_root = 0;                      /// inode table to mount when the journal names none
+        };
+
+        struct entry_t
+        {
+            uint64_t node_id;
+            struct stat attributes;
+        };
+
+        /// Attributes changed by setattr()
+        enum set_attribute_t : uint32_t
+        {
+            SET_MODE = 1 << 0,
+            SET_UID = 1 << 1,
+            SET_GID = 1 << 2,
+            SET_SIZE = 1 << 3,
+            SET_ATIME = 1 << 4,
+            SET_MTIME = 1 << 5,
+            SET_ATIME_NOW = 1 << 6,
+            SET_MTIME_NOW = 1 << 7,
+            SET_CTIME = 1 << 8,
+        };
+
+        struct file_handle_t
+        {
+            int lower_fd = -1;      /// the node's lower file: the whole file, or the origin of blocks not copied up yet
+            bool unmodified = false;/// the node was still only in the lower layer when opened
+            mutable read_ahead::stream_t stream;
+            ~file_handle_t();
+        };
+
+        /// Part of a read reply: bytes in memory, or a range of an open file the kernel can splice from
+        struct read_piece_t
+        {
+            std::vector < uint8_t > data;   /// used when fd is -1
+            int fd = -1;
+            bool owns_fd = false;           /// close fd with the piece (block files), lower handles are borrowed
+            uint64_t fd_offset = 0;
+            uint64_t length = 0;
+
+            read_piece_t() = default;
+            read_piece_t(read_piece_t && other) noexcept;
+            read_piece_t &operator=(read_piece_t &&) = delete;
+            read_piece_t(const read_piece_t &) = delete;
+            read_piece_t &operator=(const read_piece_t &) = delete;
+            ~read_piece_t();
+        };
+
+        struct dir_handle_t
+        {
+            std::vector < std::pair < std::string, uint8_t > > lower_entries;  /// name and d_type, sorted
+        };
+
+        /// @brief Called by readdir() with every entry, return false if it did not fit
+        using readdir_callback_t = std::function<bool(const std::string & /* name */, uint64_t /* ino */,
+            uint32_t /* S_IFMT bits */, uint64_t /* cookie */)>;
+
+        /// @brief Called with a node whose attributes or contents changed without a request
+        /// from the kernel (copy-up), while metadata is locked: it must only queue the node
+        using invalidation_handler_t = std::function<void(uint64_t /* node id */)>;
+
+        static constexpr uint64_t root_node_id = 1;
+
+    private:
+        // readdir cookies: 1 and 2 are "." and "..", then upper entries (directory cookie + 2,
+        // below 2^61 + 2), then lower entries from lower_cookie_base on
+        static constexpr uint64_t lower_cookie_base = 1ULL << 62;
+
+        // block files a read reply keeps open for splicing, later blocks of the reply are copied
+        static constexpr uint64_t max_read_fds = 16;
+
+        struct node_t
+        {
+            bool upper = false;                         /// has an inode in the upper layer
+            std::optional < std::string > lower_path;   /// path below the lower directory, merged directories only once copied up
+            uint64_t parent = 0;
+            std::string name;
+            uint64_t lookups = 0;                       /// kernel references, see forget()
+        };
+
+        /// A partially written block held back until later writes complete it
+        struct pending_block_t
+        {
+            std::vector < uint8_t > data;                               /// a block of the file's size class, meaningful where written
+            std::vector < std::pair < uint64_t, uint64_t > > written;   /// [begin, end) ranges written, merged and sorted
+
+            /// @brief Record a write into the block
+            void add(uint64_t begin, const uint8_t * bytes, uint64_t length);
+            [[nodiscard]] bool complete() const;
+            /// @brief Whether a write of the range would complete the block
+            [[nodiscard]] bool completed_by(uint64_t begin, uint64_t length) const;
+            /// @brief Lay the written ranges over the block's older content
+            void overlay(std::vector < uint8_t > & block) const;
+        };
+
+        /// Data writer side of a regular file
+        struct writer_t
+        {
+            std::mutex mutex;               /// serializes changes to the file's data, taken before metadata_lock
+            write_policy::stream_t stream;  /// guarded by mutex, dropped on close
+        };
+
+        /// Holds the writer_t of a file locked, and drops it from writers once nobody else
+        /// holds it and its stream carries nothing worth keeping
+        class writer_lock_t
+        {
+            cow_filesystem & filesystem;
+            const uint64_t number;
+            std::shared_ptr < writer_t > writer;
+            std::unique_lock < std::mutex > lock;
+
+        public:
+            writer_lock_t(cow_filesystem & filesystem, uint64_t number);
+            [[nodiscard]] writer_t & get() const { return *writer; }
+            ~writer_lock_t();
+            writer_lock_t(const writer_lock_t &) = delete;
+            writer_lock_t(writer_lock_t &&) = delete;
+            writer_lock_t &operator=(const writer_lock_t &) = delete;
+            writer_lock_t &operator=(writer_lock_t &&) = delete;
+        };
+
+        struct resolved_t
+        {
+            uint64_t node_id;                           /// 0 for a lower-only node not seen before
+            bool upper;
+            std::optional < std::string > lower_path;
+        };
+
+        const block_manager & blocks;
+        const log_manager & journal;
+        const options_t options;
+        buffer_pool pool;
+        cow_btree tree;
+        inode_table table;
+        directory_index directories;
+        metadata_cache cache;
+        lower_stack lower;
+        fingerprint_cache fingerprints;
+        uint64_t data_device = 0;                           /// st_dev of the block store, lower files on it are cloned into blocks
+        std::vector < std::pair < std::string, uint8_t > > size_class_rules;   /// block_size_rules as size classes
+        uint8_t large_size_class = 0;
+        mutable lru_cache < uint64_t, std::shared_ptr < const std::vector < uint8_t > > > block_cache;
+        read_ahead prefetcher;                              /// after block_cache, its workers fill it
+        write_policy writes;
+
+        mutable std::shared_mutex metadata_lock;
+        uint64_t table_root = 0;
+        std::atomic < uint64_t > next_inode = root_node_id + 1;
+        std::unordered_map < uint64_t, std::shared_ptr < inode > > dirty_inodes;
+        std::unordered_map < uint64_t, std::map < uint64_t, pending_block_t > > pending_writes; /// by inode, then block index
+        std::atomic < uint64_t > pending_block_count = 0;  /// changed under metadata_lock, read without
+        bool dirty = false;
+
+        std::mutex writers_mutex;                           /// guards writers only, nothing is locked while holding it
+        std::unordered_map < uint64_t, std::shared_ptr < writer_t > > writers;  /// by inode
+
+        mutable std::mutex nodes_mutex;
+        std::unordered_map < uint64_t, node_t > nodes;
+        std::unordered_map < std::string, uint64_t > lower_nodes;
+        invalidation_handler_t invalidation_handler;
+
+        std::mutex committer_mutex;
+        std::condition_variable committer_cond;
+        bool committer_stop = false;
+        std::thread committer;
+
+        /// @brief Mount the last committed inode table, or the initial one, or format an empty one
+        void load_root();
+
+        [[nodiscard]] node_t node_of(uint64_t node_id) const;
+        /// @brief Record where a node was found, allocating an id for a new lower-only node
+        [[nodiscard]] uint64_t remember(uint64_t node_id, uint64_t parent, const std::string & name, bool upper,
+            const std::optional < std::string > & lower_path, uint64_t references);
+        [[nodiscard]] std::string lower_full_path(const std::string & lower_path) const;
+        [[nodiscard]] static std::string child_path(const std::string & parent, const std::string & name);
+
+        [[nodiscard]] std::shared_ptr < const inode > get_inode(uint64_t number);
+        [[nodiscard]] inode & mutable_inode(uint64_t number);
+        void drop_inode(uint64_t number);
+        void flush_dirty();
+
+        [[nodiscard]] struct stat stat_of(uint64_t node_id, const node_t & node);
+        [[nodiscard]] struct stat stat_of(const inode & node) const;
+        [[nodiscard]] uint64_t block_size_of(const inode & node) const;
+        [[nodiscard]] uint64_t zero_block_of(const inode & node) const;
+
+        /// @brief Pick the block size class of a new regular file
+        /// @param node New inode, nothing mapped yet
+        /// @param name File name, matched against block_size_rules
+        /// @param size_hint Size the file is known to reach, 0 if unknown
+        void choose_size_class(inode & node, const std::string & name, uint64_t size_hint) const;
+
+        /// @brief Move an empty file to large_block_size once it is sized to at least large_file_size
+        void hint_size(inode & node, uint64_t size) const;
+        [[nodiscard]] std::optional < dirent_t > upper_entry(const node_t & dir, uint64_t dir_id, const std::string & name);
+        [[nodiscard]] bool lower_exists(const node_t & dir, const std::string & name, struct stat * attributes = nullptr) const;
+        [[nodiscard]] std::vector < std::pair < std::string, uint8_t > > list_lower(const std::string & lower_path) const;
+        [[nodiscard]] static node_t as_node(const resolved_t & resolved);
+        [[nodiscard]] bool is_empty_dir(uint64_t node_id, const node_t & node);
+
+        /// @brief Resolve a name in the merged view of a directory, whiteouts hide lower entries
+        [[nodiscard]] std::optional < resolved_t > resolve(uint64_t parent_id, const node_t & parent, const std::string & name);
+
+        void check_writable() const;
+        void copy_up(uint64_t node_id);
+        [[nodiscard]] bool copy_from_fingerprint(inode & copy, const std::string & path, const struct stat & st);
+        void copy_content_up(inode & copy, const std::string & lower_path, const std::string & path, const struct stat & st);
+        [[nodiscard]] bool clone_lower_block(const inode & copy, int fd, const struct stat & st, uint64_t index, uint64_t block_id) const;
+        [[nodiscard]] inode & new_inode(uint32_t mode, uint32_t uid, uint32_t gid, uint64_t rdev);
+        void add_entry(uint64_t dir_id, const std::string & name, const dirent_t & entry);
+        void remove_entry(uint64_t dir_id, const node_t & dir, const std::string & name);
+        [[nodiscard]] entry_t make_node(uint64_t parent, const std::string & name, uint32_t mode,
+            uint32_t uid, uint32_t gid, uint64_t rdev, const std::string & symlink_target);
+
+        /// @brief Read one content block, from the block store or, for block_map::lower_block, the lower origin
+        /// @param lower_fd Open lower origin, -1 to open it for this call
+        [[nodiscard]] std::shared_ptr < const std::vector < uint8_t > > cached_block(uint64_t block_id, uint8_t size_class) const;
+        void read_ahead_of(const inode & node, const file_handle_t & handle, uint64_t offset, uint64_t size);
+        void prefetch_blocks(const std::vector < uint64_t > & block_ids, uint8_t size_class) const;
+        [[nodiscard]] std::vector < uint8_t > load_block(const inode & node, uint64_t index, uint64_t block_id, int lower_fd = -1) const;
+        [[nodiscard]] std::vector < uint8_t > read_upper(const inode & node, uint64_t offset, uint64_t size, int lower_fd = -1) const;
+        void write_upper(inode & node, uint64_t offset, const uint8_t * data, uint64_t size);
+        void truncate_upper(inode & node, uint64_t size);
+        void zero_upper(inode & node, uint64_t offset, uint64_t end);
+
+        /// @brief Write to a regular file whose content is in blocks, storing the blocks outside metadata_lock
+        /// @param number Inode number
+        /// @param writer The file's writer, locked
+        /// @param offset Offset
+        /// @param data Bytes to write
+        /// @param size Byte count
+        /// @return false, with nothing written, if the file is not copied up or its content is not in blocks
+        [[nodiscard]] bool write_blocks(uint64_t number, writer_t & writer, uint64_t offset, const uint8_t * data, uint64_t size);
+
+        /// @brief Store a data block of a file, bypassing lookup and compression where its write stream says so
+        /// @return Block id
+        [[nodiscard]] uint64_t store_block(write_policy::stream_t & stream, const std::vector < uint8_t > & data) const;
+
+        /// @brief Store the partial block writes held back for a file, outside metadata_lock
+        /// @param number Inode number
+        /// @param writer The file's writer, locked
+        void store_pending(uint64_t number, writer_t & writer);
+
+        /// @brief store_pending() every file with held back writes, no lock may be held
+        void store_all_pending();
+
+        /// @brief Store the partial block writes held back for a file, metadata_lock held exclusively
+        void flush_pending(uint64_t number);
+        void flush_all_pending();
+        [[nodiscard]] bool has_pending(const inode & node, uint64_t offset, uint64_t size) const;
+        void commit_locked();
+        void mark_dirty();
+
+    public:
+        /// @brief Mount the file system
+        /// @param blocks Block store
+        /// @param journal Journal, already replayed
+        /// @param options Options
+        cow_filesystem(const block_manager & blocks, const log_manager & journal, options_t options);
+
+        [[nodiscard]] entry_t lookup(uint64_t parent, const std::string & name);
+        void forget(uint64_t node_id, uint64_t count);
+        [[nodiscard]] struct stat getattr(uint64_t node_id);
+        [[nodiscard]] struct stat setattr(uint64_t node_id, const struct stat & attributes, uint32_t to_set);
+        [[nodiscard]] std::string readlink(uint64_t node_id);
+        [[nodiscard]] entry_t mknod(uint64_t parent, const std::string & name, uint32_t mode, uint64_t rdev, uint32_t uid, uint32_t gid);
+        [[nodiscard]] entry_t mkdir(uint64_t parent, const std::string & name, uint32_t mode, uint32_t uid, uint32_t gid);
+        [[nodiscard]] entry_t symlink(uint64_t parent, const std::string & name, const std::string & target, uint32_t uid, uint32_t gid);
+        [[nodiscard]] entry_t link(uint64_t node_id, uint64_t new_parent, const std::string & new_name);
+        void unlink(uint64_t parent, const std::string & name);
+        void rmdir(uint64_t parent, const std::string & name);
+        void rename(uint64_t parent, const std::string & name, uint64_t new_parent, const std::string & new_name, uint32_t flags);
+
+        /// @brief Open a file, copying it up first if it is opened for writing
+        /// @param node_id Node id
+        /// @param flags open(2) flags
+        /// @return File handle
+        [[nodiscard]] std::unique_ptr < file_handle_t > open(uint64_t node_id, int flags);
+        [[nodiscard]] std::vector < uint8_t > read(uint64_t node_id, const file_handle_t & handle, uint64_t offset, uint64_t size);
+
+        /// @brief Read without copying where possible: uncompressed blocks (up to max_read_fds of
+        /// them) and lower files are returned as file ranges, everything else (inline data, holes,
+        /// compressed blocks) as bytes
+        /// @param node_id Node id
+        /// @param handle Handle from open(), must outlive the pieces
+        /// @param offset Offset
+        /// @param size Most bytes to read
+        /// @return Pieces in file order, short at end of file
+        [[nodiscard]] std::vector < read_piece_t > read_pieces(uint64_t node_id, const file_handle_t & handle,
+            uint64_t offset, uint64_t size);
+        [[nodiscard]] uint64_t write(uint64_t node_id, uint64_t offset, const uint8_t * data, uint64_t size);
+
+        /// @brief Store the partial block writes held back for a node, called on close
+        /// @param node_id Node id
+        void flush(uint64_t node_id);
+
+        /// @brief Find data or a hole, unmapped blocks being holes
+        /// @param node_id Node id
+        /// @param handle Handle from open()
+        /// @param offset Offset to search from
+        /// @param whence SEEK_DATA or SEEK_HOLE
+        /// @return Offset found, the end of the file being a hole
+        [[nodiscard]] uint64_t seek(uint64_t node_id, const file_handle_t & handle, uint64_t offset, int whence);
+
+        /// @brief Punch a hole, zero a range or extend the file
+        /// @param node_id Node id
+        /// @param mode 0, FALLOC_FL_KEEP_SIZE, FALLOC_FL_PUNCH_HOLE or FALLOC_FL_ZERO_RANGE
+        /// @param offset Start of the range
+        /// @param length Length of the range
+        void fallocate(uint64_t node_id, int mode, uint64_t offset, uint64_t length);
+
+        [[nodiscard]] std::unique_ptr < dir_handle_t > opendir(uint64_t node_id);
+
+        /// @brief Stream directory entries, ".", "..", upper entries and then lower entries not hidden by them
+        /// @param node_id Directory node id
+        /// @param handle Handle from opendir()
+        /// @param cookie Resume after the entry with this cookie, 0 to start from the beginning
+        /// @param callback Called with every entry
+        void readdir(uint64_t node_id, const dir_handle_t & handle, uint64_t cookie, const readdir_callback_t & callback);
+
+        [[nodiscard]] struct statvfs statfs() const;
+
+        /// @brief Install the handler told about changes made behind the kernel's back, before
+        /// requests are served (or after they stopped)
+        /// @param handler Handler, empty to remove it
+        void set_invalidation_handler(invalidation_handler_t handler);
+
+        /// @brief Write modified inodes and the new table root, then commit the journal
+        void commit();
+
+        /// @brief get block size
+        /// @return Block size of the store, size class 0
+        [[nodiscard]] uint64_t get_block_size() const;
+
+        ~cow_filesystem();
+        cow_filesystem(const cow_filesystem &) = delete;
+        cow_filesystem(cow_filesystem &&) = delete;
+        cow_filesystem &operator=(const cow_filesystem &) = delete;
+        cow_filesystem &operator=(cow_filesystem &&) = delete;
+    };
+}
+
+#endif //CPPCOWOVERLAY_COW_FILESYSTEM_H
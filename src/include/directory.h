@@ -0,0 +1,127 @@
+#ifndef CPPCOWOVERLAY_DIRECTORY_H
+#define CPPCOWOVERLAY_DIRECTORY_H
+
+#include <optional>
+#include "cow_btree.h"
+#include "inode.h"
+
+namespace cow_block
+{
+    def_except_with_trace(directory_corrupted);
+    def_except_with_trace(directory_hash_chain_full);
+
+    /// Entry type of a whiteout, hiding the lower layer entry of the same name (DT_WHT)
+    constexpr uint8_t DIRENT_WHITEOUT = 14;
+
+    struct dirent_t
+    {
+        std::string name;
+        uint64_t inode = 0;
+        uint8_t type = 0;   /// file type, (st_mode & S_IFMT) >> 12
+    };
+
+    /// Hashed directory index. A directory is a cow_btree of its own keyed on a 54-bit name hash,
+    /// each value is the collision chain for that hash, so a lookup costs one tree descent no
+    /// matter how many entries the directory has.
+    /// Every entry in a chain keeps the slot it was inserted in, and its readdir cookie is
+    /// (hash << 7 | slot + 1): cookies order entries by hash, then slot, and stay valid while
+    /// other entries come and go.
+    /// Tiny directories skip the tree: their chains sit back to back, in cookie order, in the
+    /// directory inode's inline data until they outgrow the inline threshold
+    class directory_index
+    {
+    public:
+        using readdir_callback_t = std::function<bool(const dirent_t &, uint64_t /* cookie */)>;
+        static constexpr uint64_t max_chain_length = 127;
+
+    private:
+        const cow_btree & tree;
+
+        struct chain_entry_t
+        {
+            uint8_t slot;
+            dirent_t entry;
+        };
+
+        [[nodiscard]] static std::vector < chain_entry_t > decode_chain(const cow_btree::value_t & value);
+        [[nodiscard]] static cow_btree::value_t encode_chain(const std::vector < chain_entry_t > & chain);
+        [[nodiscard]] static uint64_t cookie_of(const chain_entry_t & entry);
+
+        /// @brief Add or replace an entry in a cookie ordered list, taking the lowest free slot of its hash
+        static void place(std::vector < chain_entry_t > & entries, const dirent_t & entry);
+
+    public:
+        /// @brief Initializes the index accessor
+        /// @param tree Tree accessor on the metadata store
+        explicit directory_index(const cow_btree & tree);
+
+        /// @brief Hash a name into an index key
+        /// @param name Entry name
+        /// @return 54-bit name hash
+        [[nodiscard]] static uint64_t name_hash(const std::string & name);
+
+        /// @brief Store an empty directory
+        /// @return Directory root block id
+        [[nodiscard]] uint64_t create() const;
+
+        /// @brief Look an entry up
+        /// @param root Directory root block id
+        /// @param name Entry name
+        /// @return Entry, or nullopt if absent
+        [[nodiscard]] std::optional < dirent_t > lookup(uint64_t root, const std::string & name) const;
+
+        /// @brief Add an entry, or replace the entry with the same name
+        /// @param root Directory root block id
+        /// @param entry Entry
+        /// @return New directory root block id
+        [[nodiscard]] uint64_t insert(uint64_t root, const dirent_t & entry) const;
+
+        /// @brief Remove an entry
+        /// @param root Directory root block id
+        /// @param name Entry name
+        /// @return New directory root block id, root itself if the entry was absent
+        [[nodiscard]] uint64_t remove(uint64_t root, const std::string & name) const;
+
+        /// @brief Stream entries in cookie order
+        /// @param root Directory root block id
+        /// @param cookie Resume after the entry with this cookie, 0 to start from the beginning
+        /// @param callback Called with every entry and its cookie, return false to stop
+        void readdir(uint64_t root, uint64_t cookie, const readdir_callback_t & callback) const;
+
+        /// @brief Check whether a directory has no entries
+        /// @param root Directory root block id
+        /// @return true if empty
+        [[nodiscard]] bool empty(uint64_t root) const;
+
+        /// @brief Look an entry up in a directory inode
+        /// @param dir Directory inode, inline or indexed
+        /// @param name Entry name
+        /// @return Entry, or nullopt if absent
+        [[nodiscard]] std::optional < dirent_t > lookup(const inode & dir, const std::string & name) const;
+
+        /// @brief Add an entry to a directory inode, or replace the entry with the same name. An inline
+        /// directory moves into an index once its entries no longer fit the inline threshold
+        /// @param dir Directory inode, inline or indexed
+        /// @param entry Entry
+        /// @param inline_threshold Largest inline content in bytes, see inode_table::get_inline_threshold()
+        void insert(inode & dir, const dirent_t & entry, uint64_t inline_threshold) const;
+
+        /// @brief Remove an entry from a directory inode
+        /// @param dir Directory inode, inline or indexed
+        /// @param name Entry name
+        void remove(inode & dir, const std::string & name) const;
+
+        /// @brief Stream entries of a directory inode in cookie order
+        /// @param dir Directory inode, inline or indexed
+        /// @param cookie Resume after the entry with this cookie, 0 to start from the beginning
+        /// @param callback Called with every entry and its cookie, return false to stop
+        void readdir(const inode & dir, uint64_t cookie, const readdir_callback_t & callback) const;
+
+        /// @brief Check whether a directory inode has no entries
+        /// @param dir Directory inode, inline or indexed
+        /// @return true if empty
+        [[nodiscard]] bool empty(const inode & dir) const;
+    };
+}
+
+#endif //CPPCOWOVERLAY_DIRECTORY_H
@@ -0,0 +1,111 @@
+#ifndef CPPCOWOVERLAY_FINGERPRINT_CACHE_H
+#define CPPCOWOVERLAY_FINGERPRINT_CACHE_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+#include "error.h"
+
+namespace cow_block
+{
+    def_except_with_trace(fingerprint_cache_io_failed);
+
+    /// Block ids (CRC64 of each zero-padded block, as block_manager names it) of lower files,
+    /// remembered so a lower file that has not changed is never read and hashed again. A file
+    /// has a fingerprint for every block size it was copied up with.
+    /// A file is known by device, inode, mtime and size; any change to it changes one of them,
+    /// so a stale fingerprint is never returned, only left unused.
+    ///
+    /// Fingerprints persist in an append-only file of checksummed records that is compacted
+    /// when loaded, a torn last record is dropped. With xattrs enabled they are also written to
+    /// the lower file itself as user.cppcowoverlay.fingerprint (best effort, lower layers are
+    /// often read-only), which follows the file to another device or inode number
+    class fingerprint_cache
+    {
+    public:
+        static constexpr const char * xattr_name = "user.cppcowoverlay.fingerprint";
+
+    private:
+        struct key_t
+        {
+            uint64_t device;
+            uint64_t inode;
+            int64_t mtime_sec;
+            int64_t mtime_nsec;
+            uint64_t size;
+
+            bool operator==(const key_t &) const = default;
+        };
+
+        struct key_hash_t
+        {
+            uint64_t operator()(const key_t & key) const;
+        };
+
+        struct record_header_t
+        {
+            key_t key;
+            uint64_t block_size;
+            uint64_t count;             /// block ids following the header, then a CRC64 of header and ids
+        };
+
+        const std::string store_path;
+        const bool use_xattr;
+        mutable std::mutex mutex;
+        std::unordered_map < key_t, std::map < uint64_t /* block size */, std::vector < uint64_t > >, key_hash_t > entries;
+
+        [[nodiscard]] static key_t key_of(const struct stat & st);
+        [[nodiscard]] static std::vector < uint8_t > encode(const key_t & key, uint64_t block_size, const std::vector < uint64_t > & block_ids);
+
+        /// @brief Parse one record
+        /// @param data Bytes starting at the record
+        /// @param size Bytes available
+        /// @param key Receives the key
+        /// @param block_size Receives the block size the ids were made for
+        /// @param block_ids Receives the block ids
+        /// @return Bytes the record takes, 0 if it is truncated or corrupted
+        [[nodiscard]] static uint64_t decode(const uint8_t * data, uint64_t size, key_t & key, uint64_t & block_size,
+            std::vector < uint64_t > & block_ids);
+
+        void load();
+        void append(const std::vector < uint8_t > & record) const;
+
+    public:
+        /// @brief Open the cache, loading fingerprints kept by earlier mounts
+        /// @param store_path File the fingerprints persist in, empty to keep them in memory only
+        /// @param use_xattr Also keep fingerprints in an xattr of the lower file
+        fingerprint_cache(std::string store_path, bool use_xattr);
+
+        /// @brief Find the fingerprint of an unchanged lower file
+        /// @param path Lower file, read for its xattr only
+        /// @param st Current lstat() of the file
+        /// @param block_size Block size the ids are wanted for
+        /// @return Block ids, one per block of the file, nullopt if unknown or the file changed
+        [[nodiscard]] std::optional < std::vector < uint64_t > > lookup(const std::string & path, const struct stat & st,
+            uint64_t block_size);
+
+        /// @brief Remember the fingerprint of a lower file
+        /// @param path Lower file
+        /// @param st lstat() of the file taken before it was read
+        /// @param block_size Block size the ids were made for
+        /// @param block_ids Block ids, one per block of the file
+        void store(const std::string & path, const struct stat & st, uint64_t block_size, std::vector < uint64_t > block_ids);
+
+        /// @brief get entry count
+        /// @return Number of files fingerprinted, whatever the block sizes
+        [[nodiscard]] uint64_t get_entry_count() const;
+
+        ~fingerprint_cache() = default;
+        fingerprint_cache(const fingerprint_cache &) = delete;
+        fingerprint_cache(fingerprint_cache &&) = delete;
+        fingerprint_cache &operator=(const fingerprint_cache &) = delete;
+        fingerprint_cache &operator=(fingerprint_cache &&) = delete;
+    };
+}
+
+#endif //CPPCOWOVERLAY_FINGERPRINT_CACHE_H
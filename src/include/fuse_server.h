@@ -0,0 +1,121 @@
+#ifndef CPPCOWOVERLAY_FUSE_SERVER_H
+#define CPPCOWOVERLAY_FUSE_SERVER_H
+
+#include "cow_filesystem.h"
+
+namespace cow_block
+{
+    def_except_with_trace(fuse_mount_failed);
+    def_except_with_trace(fuse_channel_mode_invalid);
+    def_except_with_trace(fuse_transport_invalid);
+
+    /// How worker threads receive requests
+    enum fuse_channel_mode_t : uint8_t
+    {
+        CHANNELS_SHARED,    /// every worker reads the one /dev/fuse descriptor
+        CHANNELS_PER_CPU,   /// every worker reads its own cloned descriptor and is pinned to a CPU
+    };
+
+    /// @brief Parse a channel mode name
+    /// @param name "shared" or "per_cpu"
+    /// @return Channel mode
+    [[nodiscard]] inline fuse_channel_mode_t fuse_channel_mode_from_string(const std::string & name)
+    {
+        if (name == "shared") return CHANNELS_SHARED;
+        if (name == "per_cpu") return CHANNELS_PER_CPU;
+        throw fuse_channel_mode_invalid("Unknown FUSE channel mode \"" + name + "\"");
+    }
+
+    /// How requests travel between the kernel and the workers
+    enum fuse_transport_t : uint8_t
+    {
+        TRANSPORT_DEV,          /// read(2) and write(2) on /dev/fuse, one syscall pair per request
+        TRANSPORT_IO_URING,     /// per-CPU io_uring queues (Linux 6.14+, libfuse 3.18+), /dev/fuse otherwise
+    };
+
+    /// @brief Parse a transport name
+    /// @param name "dev" or "io_uring"
+    /// @return Transport
+    [[nodiscard]] inline fuse_transport_t fuse_transport_from_string(const std::string & name)
+    {
+        if (name == "dev") return TRANSPORT_DEV;
+        if (name == "io_uring") return TRANSPORT_IO_URING;
+        throw fuse_transport_invalid("Unknown FUSE transport \"" + name + "\"");
+    }
+
+    /// FUSE low-level server in front of a cow_filesystem. Requests are served by a pool of
+    /// worker threads sized to the cores available to the process, reads and writes are
+    /// negotiated in whole multiples of the block size. In CHANNELS_PER_CPU mode each worker
+    /// gets a cloned /dev/fuse descriptor, so workers do not serialize on one channel, and is
+    /// pinned to its own CPU on the first request it serves, so it keeps its caches warm. The
+    /// request buffer libfuse gives a worker is allocated, and first touched, before that, so
+    /// it is not kept on the worker's NUMA node.
+    ///
+    /// The kernel is allowed to cache names, missing names included, and attributes for long:
+    /// every change but copy-up arrives as a request, so the kernel already knows about it, and
+    /// copy-up invalidates the node's cached attributes itself.
+    ///
+    /// With passthrough, files opened read-only while still only in the lower layer are read
+    /// by the kernel straight from the lower file system. A handle opened before the file is
+    /// copied up keeps reading the lower contents until it is closed
+    class fuse_server
+    {
+    public:
+        struct options_t
+        {
+            uint64_t threads = 0;                   /// worker threads, 0 for one per available core
+            fuse_channel_mode_t channels = CHANNELS_SHARED;
+            fuse_transport_t transport = TRANSPORT_DEV;
+            uint64_t uring_queue_depth = 8;         /// io_uring entries per CPU queue
+            uint64_t max_io_size = 1024 * 1024;     /// largest read or write request, rounded down to whole blocks
+            bool allow_other = false;
+            bool passthrough = true;                /// let the kernel read files only in the lower layer directly
+            bool splice = true;                     /// splice uncompressed blocks and lower files into replies
+            bool read_only = false;
+            double entry_timeout = 86400.0;         /// seconds the kernel may cache a name, or its absence
+            double attr_timeout = 86400.0;          /// seconds the kernel may cache attributes
+        };
+
+    private:
+        cow_filesystem & filesystem;
+        const std::string mount_point;
+        const options_t options;
+
+    public:
+        /// @brief Prepare a server
+        /// @param filesystem File system to serve
+        /// @param mount_point Directory to mount on
+        /// @param options Options
+        fuse_server(cow_filesystem & filesystem, std::string mount_point, options_t options);
+
+        /// @brief Mount and serve requests until unmounted or interrupted
+        /// @param program_name argv[0], reported as the file system source
+        /// @return Exit status of the session loop
+        int run(const std::string & program_name);
+
+        /// @brief CPUs the process may run on, in the order per-CPU workers are pinned to them
+        /// @return CPU numbers
+        [[nodiscard]] static std::vector < int > available_cpus();
+
+        /// @brief Whether requests will travel over io_uring, which needs the transport selected,
+        /// libfuse built with it and the kernel fuse module loaded with enable_uring
+        /// @return true for io_uring, false for /dev/fuse
+        [[nodiscard]] bool uses_io_uring() const;
+
+        /// @brief Threads the session loop will run
+        /// @return Worker thread count
+        [[nodiscard]] uint64_t get_thread_count() const;
+
+        /// @brief Largest read and write the kernel will send
+        /// @return Size in bytes, a multiple of the block size
+        [[nodiscard]] uint64_t get_io_size() const;
+
+        ~fuse_server() = default;
+        fuse_server(const fuse_server &) = delete;
+        fuse_server(fuse_server &&) = delete;
+        fuse_server &operator=(const fuse_server &) = delete;
+        fuse_server &operator=(fuse_server &&) = delete;
+    };
+}
+
+#endif //CPPCOWOVERLAY_FUSE_SERVER_H
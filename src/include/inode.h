@@ -3,12 +3,139 @@
 
 #include <sys/stat.h>
 #include "block.h"
+#include "block_map.h"
 
 class inode
 {
 public:
-    explicit inode(const std::string & block_name);
+    /// Where the inode keeps its content
+    enum storage_t : uint8_t
+    {
+        STORAGE_INLINE = 0,     /// file data, symlink target or directory entries inside the inode record
+        STORAGE_BLOCKS = 1,     /// file data in content blocks, through the block map
+        STORAGE_INDEX = 2,      /// directory entries in a directory_index tree
+    };
+
+    enum flags_t : uint8_t
+    {
+        INODE_MERGED = 1 << 0,  /// directory copied up from the lower layer, its lower entries still show through
+    };
+
+    struct attributes_t
+    {
+        uint32_t mode = 0;
+        uint32_t uid = 0;
+        uint32_t gid = 0;
+        uint32_t nlink = 1;
+        uint64_t size = 0;
+        uint64_t rdev = 0;
+        timespec atime { };
+        timespec mtime { };
+        timespec ctime { };
+    };
+
+private:
+    uint64_t number;
+    attributes_t attributes;
+    storage_t storage = STORAGE_INLINE;
+    uint8_t flags = 0;
+    uint8_t size_class = 0;
+    std::vector < uint8_t > inline_data;
+    std::string lower_origin;
+    cow_block::block_map map;
+    uint64_t extent_root = 0;
+    std::vector < cow_block::block_map::extent_t > stored_extents; /// extents under extent_root, in order
+    uint64_t index_root = 0;
+
+public:
+    /// @brief Create an inode with empty inline content
+    /// @param number Inode number
+    /// @param zero_block_id Id of the all-zero block, see block_manager::get_zero_block_id()
+    inode(uint64_t number, cow_block::block_map::block_id_t zero_block_id);
+
+    /// @brief get number
+    /// @return Inode number
+    [[nodiscard]] uint64_t get_number() const;
+
+    /// @brief get attributes
+    /// @return Mode, ownership, size and times
+    [[nodiscard]] attributes_t & get_attributes();
+    [[nodiscard]] const attributes_t & get_attributes() const;
+
+    /// @brief get flags
+    /// @return Combination of flags_t
+    [[nodiscard]] uint8_t get_flags() const;
+
+    /// @brief set flags
+    /// @param new_flags Combination of flags_t
+    void set_flags(uint8_t new_flags);
+
+    /// @brief get size class
+    /// @return Block size class of the content blocks, see block_manager
+    [[nodiscard]] uint8_t get_size_class() const;
+
+    /// @brief Change the block size class, only while no block is mapped (when the file is created)
+    /// @param new_size_class Block size class
+    /// @param zero_block_id Id of the all-zero block of that class
+    void set_size_class(uint8_t new_size_class, cow_block::block_map::block_id_t zero_block_id);
+
+    /// @brief get storage
+    /// @return Where the content lives
+    [[nodiscard]] storage_t get_storage() const;
+
+    /// @brief get inline data
+    /// @return Inline content, empty unless storage is STORAGE_INLINE
+    [[nodiscard]] const std::vector < uint8_t > & get_inline_data() const;
+
+    /// @brief Keep content inline, dropping the block map, extent tree, lower origin and directory index
+    /// @param data Inline content
+    void set_inline_data(std::vector < uint8_t > data);
+
+    /// @brief Keep content in blocks, dropping inline data and directory index
+    void use_blocks();
+
+    /// @brief get lower origin
+    /// @return Path below the lower directory that block_map::lower_block entries read from, empty for none
+    [[nodiscard]] const std::string & get_lower_origin() const;
+
+    /// @brief Let blocks mapped to block_map::lower_block read from a lower file, used by lazy copy-up
+    /// @param path Path below the lower directory
+    void set_lower_origin(std::string path);
+
+    /// @brief get extent root
+    /// @return Root of the extent tree the block map was last stored in, 0 if it is kept in the record
+    [[nodiscard]] uint64_t get_extent_root() const;
+
+    /// @brief get stored extents
+    /// @return Extents of the block map as last stored under the extent root
+    [[nodiscard]] const std::vector < cow_block::block_map::extent_t > & get_stored_extents() const;
+
+    /// @brief Remember the extent tree the block map was stored in, so the next store only
+    /// writes what changed since
+    /// @param root Extent tree root, 0 for none
+    /// @param extents Extents stored under root, in logical order
+    void set_extent_root(uint64_t root, std::vector < cow_block::block_map::extent_t > extents);
+
+    /// @brief get index root
+    /// @return Directory index root block id, 0 unless storage is STORAGE_INDEX
+    [[nodiscard]] uint64_t get_index_root() const;
+
+    /// @brief Keep directory entries in a directory index, dropping inline data, the block map, extent tree
+    /// and lower origin
+    /// @param root Directory index root block id
+    void set_index_root(uint64_t root);
+
+    /// @brief Find the content block holding a byte offset
+    /// @param offset Byte offset in the file
+    /// @param block_size Block size of the file
+    /// @return Block id, or nullopt if the offset is in a hole
+    [[nodiscard]] std::optional < cow_block::block_map::block_id_t > block_at(uint64_t offset, uint64_t block_size) const;
+
+    /// @brief get block map
+    /// @return Logical block to content block mapping
+    [[nodiscard]] cow_block::block_map & get_block_map();
+    [[nodiscard]] const cow_block::block_map & get_block_map() const;
 };
 
 
-#endif //CPPCOWOVERLAY_INODE_H
\ No newline at end of file
+#endif //CPPCOWOVERLAY_INODE_H
@@ -0,0 +1,90 @@
+#ifndef CPPCOWOVERLAY_INODE_TABLE_H
+#define CPPCOWOVERLAY_INODE_TABLE_H
+
+#include "cow_btree.h"
+#include "inode.h"
+
+namespace cow_block
+{
+    def_except_with_trace(inode_corrupted);
+    def_except_with_trace(inline_threshold_too_large);
+
+    /// Inode records kept in a cow_btree keyed by inode number.
+    /// Regular files and symlinks whose content is at most inline_threshold bytes, and
+    /// directories whose encoded entries are, keep their content inside the record, so
+    /// reading them costs no block lookup at all. Larger files go through a block map, stored
+    /// inside the record as an extent list while that fits, and spilled into a tree of its own
+    /// (keyed by first logical block) once it does not. A spilled map stays in its tree while the
+    /// content is in blocks, every store only puts and erases the extents that changed since the
+    /// one before. A file copied up lazily also records the lower file its unmodified blocks read
+    /// from, in a content block of its own since a path may be longer than a record
+    class inode_table
+    {
+        const cow_btree & tree;
+        const block_manager & blocks;
+        const log_manager * journal;
+        const uint64_t inline_threshold;
+
+        [[nodiscard]] std::vector < uint8_t > read_content(const inode & node) const;
+
+        /// @brief Bring the extent tree of a node up to date with its block map
+        /// @param node Inode, remembers the new extent tree root and what it holds
+        void store_extents(inode & node) const;
+
+        /// @brief Whether some block still reads from the lower origin
+        [[nodiscard]] static bool references_lower(const inode & node);
+
+    public:
+        /// @brief Initializes the table accessor
+        /// @param tree Tree accessor on the metadata store
+        /// @param blocks Block store holding file content
+        /// @param inline_threshold Largest inline content in bytes, nullopt for the largest a record holds
+        /// @param journal Journal receiving a LOG_WRITE_BLOCK for every content block settle() writes, may be nullptr
+        inode_table(const cow_btree & tree, const block_manager & blocks, std::optional < uint64_t > inline_threshold,
+            const log_manager * journal = nullptr);
+
+        /// @brief Largest inline content a record can hold
+        /// @param tree Tree accessor on the metadata store
+        /// @return Size in bytes
+        [[nodiscard]] static uint64_t max_inline_size(const cow_btree & tree);
+
+        /// @brief get inline threshold
+        /// @return Largest inline content in bytes
+        [[nodiscard]] uint64_t get_inline_threshold() const;
+
+        /// @brief Store an empty table
+        /// @return Table root block id
+        [[nodiscard]] uint64_t create() const;
+
+        /// @brief Load an inode
+        /// @param root Table root block id
+        /// @param number Inode number
+        /// @return Inode, or nullopt if absent
+        [[nodiscard]] std::optional < inode > load(uint64_t root, uint64_t number) const;
+
+        /// @brief Store an inode, replacing the previous record
+        /// @param root Table root block id
+        /// @param node Inode, remembers where its block map went if it went into an extent tree
+        /// @return New table root block id
+        [[nodiscard]] uint64_t store(uint64_t root, inode & node) const;
+
+        /// @brief Remove an inode record
+        /// @param root Table root block id
+        /// @param number Inode number
+        /// @return New table root block id
+        [[nodiscard]] uint64_t remove(uint64_t root, uint64_t number) const;
+
+        /// @brief Move inline content into content blocks, whatever its size, e.g. before a write that
+        /// grows the file past the inline threshold
+        /// @param node Inode
+        void spill(inode & node) const;
+
+        /// @brief Move the content of a regular file or symlink between inline and blocks, depending
+        /// on whether its size is over the inline threshold. Directories are moved by directory_index,
+        /// files with blocks still in the lower layer stay in blocks
+        /// @param node Inode
+        void settle(inode & node) const;
+    };
+}
+
+#endif //CPPCOWOVERLAY_INODE_TABLE_H
@@ -0,0 +1,40 @@
+#ifndef CPPCOWOVERLAY_JOURNAL_CLOCK_H
+#define CPPCOWOVERLAY_JOURNAL_CLOCK_H
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+
+namespace cow_block
+{
+    /// Timestamps for journal records. Reads CLOCK_REALTIME_COARSE, which is served from the
+    /// vDSO without touching the hardware clock, and makes the result strictly monotonic across
+    /// all threads: every reservation starts after the last nanosecond handed out, even when the
+    /// coarse clock hasn't ticked or the wall clock stepped backwards.
+    /// A group of records reserves a range at once and shares one clock read, record i of the
+    /// group gets base + i nanoseconds
+    class journal_clock
+    {
+        std::atomic_uint64_t last_issued = 0; /// nanoseconds since epoch
+
+    public:
+        journal_clock() = default;
+
+        /// @brief Never issue anything at or before this point, used to continue after the last journal record
+        /// @param timestamp Last timestamp already issued
+        void advance_to(const timespec & timestamp);
+
+        /// @brief Reserve count strictly increasing timestamps
+        /// @param count Number of timestamps, at least 1
+        /// @return First timestamp of the range, in nanoseconds since epoch
+        [[nodiscard]] uint64_t reserve(uint64_t count = 1);
+
+        /// @brief Convert nanoseconds since epoch to timespec
+        [[nodiscard]] static timespec to_timespec(uint64_t nanoseconds);
+
+        /// @brief Convert timespec to nanoseconds since epoch
+        [[nodiscard]] static uint64_t from_timespec(const timespec & timestamp);
+    };
+}
+
+#endif //CPPCOWOVERLAY_JOURNAL_CLOCK_H
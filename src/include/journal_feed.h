@@ -0,0 +1,72 @@
+#ifndef CPPCOWOVERLAY_JOURNAL_FEED_H
+#define CPPCOWOVERLAY_JOURNAL_FEED_H
+
+#include <atomic>
+#include <chrono>
+#include "block.h"
+
+namespace cow_block
+{
+    def_except_with_trace(journal_feed_cursor_invalid);
+
+    /// Change feed over the journal. Streams every committed record past a sequence number,
+    /// transaction by transaction, and remembers how far it got in a cursor file so a consumer
+    /// (incremental backup, replication) can resume where it stopped.
+    /// Delivery is at-least-once: the cursor is saved after the consumer returns, so a consumer
+    /// that dies mid-transaction will see that transaction again
+    class journal_feed
+    {
+    public:
+        using log_t = log_manager::log_t;
+        using consumer_t = std::function<void(const log_t &)>;
+
+    private:
+        struct cursor_t
+        {
+            uint64_t magic;
+            uint64_t sequence;  /// last delivered commit
+            uint64_t offset;    /// byte offset right after that commit, only a hint
+        };
+        static constexpr uint64_t cursor_magic = 0x524F535255434C4A; // "JLCURSOR"
+
+        const log_manager & journal;
+        std::string cursor_path;
+        cursor_t cursor { cursor_magic, 0, 0 };
+
+        /// @brief Make sure the offset hint still points right after the cursor sequence,
+        /// the journal may have been truncated or rewritten since
+        void revalidate_offset();
+        void save_cursor() const;
+
+    public:
+        /// @brief Open a feed with a resumable cursor
+        /// @param journal Journal to follow
+        /// @param cursor_path Cursor file, created on first delivery, empty for no persistence
+        /// @param after_sequence Start position when no cursor file exists yet
+        journal_feed(const log_manager & journal, std::string cursor_path, uint64_t after_sequence = 0);
+
+        /// @brief Deliver every committed transaction past the cursor, then advance and save the cursor
+        /// @param consumer Called with each record, LOG_COMMIT included so transaction boundaries are visible
+        /// @return Number of transactions delivered
+        uint64_t poll(const consumer_t & consumer);
+
+        /// @brief Keep polling until stop is set
+        /// @param consumer Called with each record
+        /// @param stop Stop flag, checked between polls
+        /// @param interval Idle time between polls when nothing new was committed
+        void follow(const consumer_t & consumer, const std::atomic_bool & stop,
+            std::chrono::milliseconds interval = std::chrono::milliseconds(100));
+
+        /// @brief get cursor
+        /// @return Sequence number of the last delivered commit
+        [[nodiscard]] uint64_t get_cursor() const;
+
+        ~journal_feed() = default;
+        journal_feed(const journal_feed &) = delete;
+        journal_feed(journal_feed &&) = delete;
+        journal_feed &operator=(const journal_feed &) = delete;
+        journal_feed &operator=(journal_feed &&) = delete;
+    };
+}
+
+#endif //CPPCOWOVERLAY_JOURNAL_FEED_H
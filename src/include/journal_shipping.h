@@ -0,0 +1,193 @@
+#ifndef CPPCOWOVERLAY_JOURNAL_SHIPPING_H
+#define CPPCOWOVERLAY_JOURNAL_SHIPPING_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <thread>
+#include "block.h"
+#include "recovery.h"
+
+namespace cow_block
+{
+    def_except_with_trace(journal_shipping_failed);
+    def_except_no_trace(journal_shipping_peer_closed);
+
+    /// A block in the form it is stored in, shipped ahead of the records that reference it
+    struct shipped_block_t
+    {
+        uint64_t hash;
+        std::vector < uint8_t > content;
+        std::vector < uint8_t > attribute; /// empty if the block has no attribute file
+    };
+
+    /// Standby side of journal shipping: its own data directory and journal.
+    /// Blocks are stored as they arrive, records only once the blocks ahead of them are durable,
+    /// then replayed, so whatever the standby crashes in the middle of is repaired by its own
+    /// recovery at mount. A block no record references yet is harmless, blocks are content addressed
+    class standby_store
+    {
+        block_manager blocks;
+        log_manager journal;
+        journal_recovery recovery;
+        uint64_t applied_sequence;
+        bool blocks_unsynced = false;   /// blocks stored since the data directory was last flushed
+
+    public:
+        /// @brief Open (or create) the standby directories
+        /// @param data_dir Standby data directory
+        /// @param log_dir Standby journal directory
+        /// @param block_size Block size, must match the primary
+        standby_store(const std::string & data_dir, const std::string & log_dir, uint64_t block_size);
+
+        /// @brief get last sequence
+        /// @return Last commit already applied on the standby
+        [[nodiscard]] uint64_t last_sequence() const;
+
+        /// @brief Store a block ahead of the records referencing it
+        /// @param block Block as stored on the primary
+        void store_block(const shipped_block_t & block);
+
+        /// @brief Make the blocks stored so far durable, append records and replay them
+        /// @param records Complete transactions in journal order
+        void apply(const std::vector < log_manager::log_t > & records);
+
+        ~standby_store() = default;
+        standby_store(const standby_store &) = delete;
+        standby_store(standby_store &&) = delete;
+        standby_store &operator=(const standby_store &) = delete;
+        standby_store &operator=(standby_store &&) = delete;
+    };
+
+    /// Where the shipper sends batches to
+    class ship_target
+    {
+    public:
+        /// @brief get last sequence, (re)connecting if needed
+        /// @return Last commit the target already has, shipping resumes right after it
+        [[nodiscard]] virtual uint64_t last_sequence() = 0;
+
+        /// @brief Deliver blocks ahead of the records referencing them
+        /// @param shipped_blocks Blocks
+        virtual void ship_blocks(const std::vector < shipped_block_t > & shipped_blocks) = 0;
+
+        /// @brief Deliver a batch of records, returns once the target has applied it
+        /// @param records Complete transactions in journal order, their blocks already delivered
+        virtual void ship(const std::vector < log_manager::log_t > & records) = 0;
+
+        virtual ~ship_target() = default;
+    };
+
+    /// Ship into a standby directory on this machine
+    class directory_target final : public ship_target
+    {
+        standby_store store;
+
+    public:
+        directory_target(const std::string & data_dir, const std::string & log_dir, uint64_t block_size);
+        [[nodiscard]] uint64_t last_sequence() override;
+        void ship_blocks(const std::vector < shipped_block_t > & shipped_blocks) override;
+        void ship(const std::vector < log_manager::log_t > & records) override;
+    };
+
+    /// Ship to a standby process listening on a Unix socket
+    class socket_target final : public ship_target
+    {
+        std::string socket_path;
+        int fd = -1;
+        uint64_t hello_sequence = 0;
+
+        void disconnect();
+
+    public:
+        explicit socket_target(std::string socket_path);
+        [[nodiscard]] uint64_t last_sequence() override;
+        void ship_blocks(const std::vector < shipped_block_t > & shipped_blocks) override;
+        void ship(const std::vector < log_manager::log_t > & records) override;
+        ~socket_target() override;
+        socket_target(const socket_target &) = delete;
+        socket_target &operator=(const socket_target &) = delete;
+    };
+
+    /// Primary side of journal shipping. A background thread follows the journal and ships
+    /// committed transactions with the blocks they wrote. Blocks are read and sent as their
+    /// records are read, whenever max_batch_bytes of them are held, so a large transaction or
+    /// catching up after an outage never piles its data up in memory; only records wait for a
+    /// batch boundary. Batches of records are sent once batch_records is reached or max_delay
+    /// has passed since the oldest unshipped record, whichever comes first, so the standby never
+    /// lags more than max_delay behind a healthy link and the primary never waits for the standby
+    class journal_shipper
+    {
+        const log_manager & journal;
+        const block_manager & blocks;
+        std::unique_ptr < ship_target > target;
+        const uint64_t batch_records;
+        const std::chrono::milliseconds max_delay;
+        const uint64_t max_batch_bytes;
+        std::atomic_bool stop = false;
+        std::atomic_uint64_t shipped_sequence = 0;
+        std::mutex wait_mutex;
+        std::condition_variable wait_cond;
+        std::thread worker;
+
+        [[nodiscard]] shipped_block_t load_block(uint64_t hash) const;
+        void run();
+
+    public:
+        /// @brief Initializes the shipper, call start() to begin shipping
+        /// @param journal Primary journal
+        /// @param blocks Primary block store
+        /// @param target Standby to ship to
+        /// @param batch_records Records per batch
+        /// @param max_delay Longest time a committed record waits before being shipped
+        /// @param max_batch_bytes Block bytes read ahead of sending them
+        journal_shipper(const log_manager & journal, const block_manager & blocks,
+            std::unique_ptr < ship_target > target, uint64_t batch_records, std::chrono::milliseconds max_delay,
+            uint64_t max_batch_bytes);
+
+        /// @brief Start the shipping thread
+        void start();
+
+        /// @brief Ship everything committed so far and stop the shipping thread
+        void shutdown();
+
+        /// @brief get shipped sequence
+        /// @return Last commit acknowledged by the standby
+        [[nodiscard]] uint64_t get_shipped_sequence() const;
+
+        ~journal_shipper();
+        journal_shipper(const journal_shipper &) = delete;
+        journal_shipper(journal_shipper &&) = delete;
+        journal_shipper &operator=(const journal_shipper &) = delete;
+        journal_shipper &operator=(journal_shipper &&) = delete;
+    };
+
+    /// Standby process side of socket_target: accepts one primary at a time and applies its batches
+    class standby_receiver
+    {
+        standby_store & store;
+        std::string socket_path;
+        int listen_fd = -1;
+
+        void serve_client(int client_fd, const std::atomic_bool & stop);
+
+    public:
+        /// @brief Bind the socket
+        /// @param store Standby to apply batches to
+        /// @param socket_path Unix socket path, replaced if it exists
+        standby_receiver(standby_store & store, std::string socket_path);
+
+        /// @brief Serve primaries until stop is set
+        /// @param stop Stop flag
+        void serve(const std::atomic_bool & stop);
+
+        ~standby_receiver();
+        standby_receiver(const standby_receiver &) = delete;
+        standby_receiver(standby_receiver &&) = delete;
+        standby_receiver &operator=(const standby_receiver &) = delete;
+        standby_receiver &operator=(standby_receiver &&) = delete;
+    };
+}
+
+#endif //CPPCOWOVERLAY_JOURNAL_SHIPPING_H
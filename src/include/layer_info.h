@@ -2,7 +2,21 @@
 #define CPPCOWOVERLAY_LAYER_INFO_H
 
 #include <cstdint>
+#include <optional>
 #include <string>
+#include <vector>
+#include "block.h"
+#include "fuse_server.h"
+
+struct StandbyInfoType
+{
+    std::string path_to_data_blocks;    // ship into a standby directory...
+    std::string log_dir;
+    std::string socket_path;            // ...or to a standby process
+    uint64_t batch_records = 1024;
+    uint64_t max_delay_ms = 100;
+    uint64_t max_batch_bytes = 64 * 1024 * 1024;
+};
 
 struct LayerInfoType
 {
@@ -10,6 +24,40 @@ struct LayerInfoType
     std::string root_inode_name;
     std::string log_dir;
     uint64_t block_size;
+    cow_block::journal_mode_t journal_mode = cow_block::JOURNAL_ORDERED;
+    bool read_only = false;
+    std::optional < uint64_t > inline_threshold;   // unset: as large as an inode record allows
+    uint64_t inode_cache_entries = 65536;
+    uint64_t dentry_cache_entries = 262144;
+    uint64_t block_cache_entries = 4096;
+    uint64_t read_ahead_blocks = 256;               // 0: no read-ahead
+    uint64_t read_ahead_threads = 2;
+    uint64_t write_buffer_blocks = 1024;            // 0: partial block writes are stored at once
+    std::vector < std::pair < std::string, uint64_t > > block_size_rules;  // file name suffix and block size
+    uint64_t large_block_size = 0;                  // 0: large files use block_size too
+    uint64_t large_file_size = 64 * 1024 * 1024;
+    uint64_t bypass_probe_blocks = 64;              // 0: never bypass dedup and compression
+    uint64_t bypass_reprobe_blocks = 1024;
+    std::vector < std::string > lower_dirs;         // read-only lower layers, topmost first, empty for none
+    uint64_t lower_cache_entries = 65536;
+    std::string fingerprint_path;                   // lower file fingerprints kept across mounts, empty for none
+    bool fingerprint_xattr = false;
+    uint64_t commit_interval_ms = 5000;
+    uint64_t fuse_threads = 0;                      // 0: one per available core
+    cow_block::fuse_channel_mode_t fuse_channels = cow_block::CHANNELS_SHARED;
+    cow_block::fuse_transport_t fuse_transport = cow_block::TRANSPORT_DEV;
+    uint64_t fuse_uring_depth = 8;
+    uint64_t fuse_max_io = 1024 * 1024;
+    bool allow_other = false;
+    bool fuse_passthrough = true;
+    bool fuse_splice = true;
+    double fuse_cache_timeout = 86400.0;            // seconds the kernel caches names and attributes
+    StandbyInfoType standby;
 };
 
+/// @brief Parse and validate a configuration file
+/// @param config_path Path to the configuration file
+/// @return Layer information
+LayerInfoType load_layer_info(const std::string & config_path);
+
 #endif //CPPCOWOVERLAY_LAYER_INFO_H
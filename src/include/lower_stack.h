@@ -0,0 +1,98 @@
+#ifndef CPPCOWOVERLAY_LOWER_STACK_H
+#define CPPCOWOVERLAY_LOWER_STACK_H
+
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "lru_cache.h"
+
+namespace cow_block
+{
+    /// Read-only lower layers stacked over each other, topmost first, the way container image
+    /// layers are: an entry in a higher layer hides the same path in the layers below it, a
+    /// ".wh.<name>" file removes <name> from the layers below, and a directory holding
+    /// ".wh..wh..opq" hides whatever the layers below have at its path.
+    ///
+    /// A directory is resolved in one pass: every layer merged into it is read once, and the
+    /// names found are indexed by the layer owning them, whiteouts and opaque markers applied.
+    /// Resolutions are cached by path, so with the parent cached a lookup is answered from its
+    /// index without touching any layer, and listing a directory reads only its index. Layers
+    /// never change while mounted, so a cached resolution never goes stale
+    class lower_stack
+    {
+    public:
+        using entry_list_t = std::vector < std::pair < std::string, uint8_t > >;   /// name and d_type, sorted
+
+        static constexpr std::string_view whiteout_prefix = ".wh.";
+        static constexpr std::string_view opaque_marker = ".wh..wh..opq";
+
+    private:
+        /// An entry of a merged directory
+        struct child_t
+        {
+            uint32_t layer = 0;                     /// topmost layer holding the name
+            uint8_t type = DT_UNKNOWN;              /// d_type there
+            std::vector < uint32_t > dir_layers;    /// directories only: layers holding it as a directory, before opaque markers
+        };
+
+        struct resolution_t
+        {
+            bool exists = false;
+            uint32_t layer = 0;                     /// topmost layer holding the path
+            std::vector < uint32_t > dir_layers;    /// directories only: layers merged into it, topmost first
+            std::map < std::string, child_t > children; /// directories only: merged entries
+        };
+        using resolution_ptr = std::shared_ptr < const resolution_t >;
+
+        const std::vector < std::string > layers;
+        mutable lru_cache < std::string, resolution_ptr > cache;
+
+        [[nodiscard]] resolution_ptr resolve(const std::string & path) const;
+        [[nodiscard]] bool in_layer(uint32_t layer, const std::string & path, struct stat * attributes = nullptr) const;
+
+        /// @brief Read a directory from the layers it may be merged from, stopping at an opaque one
+        /// @param resolution Receives the layers merged and the entries, whiteouts applied
+        /// @param candidates Layers holding the path as a directory, topmost first
+        /// @param path Directory path below the stack
+        void index_directory(resolution_t & resolution, const std::vector < uint32_t > & candidates, const std::string & path) const;
+
+    public:
+        /// @brief Stack layers
+        /// @param layers Layer directories, topmost first
+        /// @param cache_entries Cached path resolutions
+        lower_stack(std::vector < std::string > layers, uint64_t cache_entries);
+
+        /// @brief Find the file behind a path
+        /// @param path Path below the stack, "" for its root, otherwise starting with "/"
+        /// @return Path of the file in the topmost layer holding it, nullopt if no layer shows it
+        [[nodiscard]] std::optional < std::string > locate(const std::string & path) const;
+
+        /// @brief Whether a path shows through the stack
+        /// @param path Path below the stack
+        /// @param attributes Receives lstat() of the file if it exists, may be nullptr
+        /// @return true if it exists
+        [[nodiscard]] bool exists(const std::string & path, struct stat * attributes = nullptr) const;
+
+        /// @brief Merged listing of a directory, whiteouts and opaque markers applied and left out
+        /// @param path Directory path below the stack
+        /// @return Entries, empty if the directory does not exist
+        [[nodiscard]] entry_list_t list(const std::string & path) const;
+
+        /// @brief get layer count
+        /// @return Number of layers, 0 for an empty stack
+        [[nodiscard]] uint64_t get_layer_count() const;
+
+        ~lower_stack() = default;
+        lower_stack(const lower_stack &) = delete;
+        lower_stack(lower_stack &&) = delete;
+        lower_stack &operator=(const lower_stack &) = delete;
+        lower_stack &operator=(lower_stack &&) = delete;
+    };
+}
+
+#endif //CPPCOWOVERLAY_LOWER_STACK_H
@@ -0,0 +1,151 @@
+#ifndef CPPCOWOVERLAY_LRU_CACHE_H
+#define CPPCOWOVERLAY_LRU_CACHE_H
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+namespace cow_block
+{
+    /// LRU cache split into independently locked shards, so threads looking up different keys
+    /// rarely contend. Each shard evicts on its own once it holds capacity / shard_count entries
+    template < typename Key, typename Value, typename Hash = std::hash<Key> >
+    class lru_cache
+    {
+        struct shard_t
+        {
+            std::mutex mutex;
+            std::list < std::pair < Key, Value > > order; /// most recently used first
+            std::unordered_map < Key, typename std::list < std::pair < Key, Value > >::iterator, Hash > index;
+        };
+
+        std::vector < std::unique_ptr < shard_t > > shards;
+        uint64_t shard_capacity;
+
+        [[nodiscard]] shard_t & shard_of(const Key & key) const
+        {
+            uint64_t hash = Hash()(key);
+            hash ^= hash >> 33;
+            hash *= 0xFF51AFD7ED558CCDULL;
+            hash ^= hash >> 33;
+            return *shards[hash % shards.size()];
+        }
+
+    public:
+        /// @brief Create an empty cache
+        /// @param capacity Total number of entries
+        /// @param shard_count Number of shards
+        explicit lru_cache(const uint64_t capacity, const uint64_t shard_count = 16)
+            : shard_capacity(std::max<uint64_t>(capacity / std::max<uint64_t>(shard_count, 1), 1))
+        {
+            for (uint64_t i = 0; i < std::max<uint64_t>(shard_count, 1); i++) {
+                shards.emplace_back(std::make_unique<shard_t>());
+            }
+        }
+
+        /// @brief Look up an entry and mark it as most recently used
+        /// @param key Key
+        /// @return Value, or nullopt if not cached
+        [[nodiscard]] std::optional < Value > get(const Key & key)
+        {
+            shard_t & shard = shard_of(key);
+            std::lock_guard lock(shard.mutex);
+            const auto it = shard.index.find(key);
+            if (it == shard.index.end()) {
+                return std::nullopt;
+            }
+
+            shard.order.splice(shard.order.begin(), shard.order, it->second);
+            return it->second->second;
+        }
+
+        /// @brief Insert or replace an entry, evicting the least recently used one if the shard is full
+        /// @param key Key
+        /// @param value Value
+        void put(const Key & key, Value value)
+        {
+            shard_t & shard = shard_of(key);
+            std::lock_guard lock(shard.mutex);
+            if (const auto it = shard.index.find(key); it != shard.index.end())
+            {
+                it->second->second = std::move(value);
+                shard.order.splice(shard.order.begin(), shard.order, it->second);
+                return;
+            }
+
+            shard.order.emplace_front(key, std::move(value));
+            shard.index.emplace(key, shard.order.begin());
+            if (shard.order.size() > shard_capacity)
+            {
+                shard.index.erase(shard.order.back().first);
+                shard.order.pop_back();
+            }
+        }
+
+        /// @brief Drop an entry
+        /// @param key Key
+        void erase(const Key & key)
+        {
+            shard_t & shard = shard_of(key);
+            std::lock_guard lock(shard.mutex);
+            if (const auto it = shard.index.find(key); it != shard.index.end())
+            {
+                shard.order.erase(it->second);
+                shard.index.erase(it);
+            }
+        }
+
+        /// @brief Drop every entry matching a predicate
+        /// @param predicate Called with every key and value, return true to drop
+        void erase_if(const std::function<bool(const Key &, const Value &)> & predicate)
+        {
+            for (const auto & shard : shards)
+            {
+                std::lock_guard lock(shard->mutex);
+                for (auto it = shard->order.begin(); it != shard->order.end(); )
+                {
+                    if (predicate(it->first, it->second))
+                    {
+                        shard->index.erase(it->first);
+                        it = shard->order.erase(it);
+                    }
+                    else
+                    {
+                        ++it;
+                    }
+                }
+            }
+        }
+
+        /// @brief Drop every entry
+        void clear()
+        {
+            for (const auto & shard : shards)
+            {
+                std::lock_guard lock(shard->mutex);
+                shard->order.clear();
+                shard->index.clear();
+            }
+        }
+
+        /// @brief get size
+        /// @return Number of cached entries
+        [[nodiscard]] uint64_t size() const
+        {
+            uint64_t total = 0;
+            for (const auto & shard : shards)
+            {
+                std::lock_guard lock(shard->mutex);
+                total += shard->order.size();
+            }
+            return total;
+        }
+    };
+}
+
+#endif //CPPCOWOVERLAY_LRU_CACHE_H
@@ -4,5 +4,6 @@
 int fsck_main(int argc, char**argv);
 int mkfs_main(int argc, char**argv);
 int mount_main(int argc, char**argv);
+int standby_main(int argc, char**argv);
 
 #endif //CPPCOWOVERLAY_MAIN_REDIRECT_H
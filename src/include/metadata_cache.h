@@ -0,0 +1,116 @@
+#ifndef CPPCOWOVERLAY_METADATA_CACHE_H
+#define CPPCOWOVERLAY_METADATA_CACHE_H
+
+#include <atomic>
+#include "directory.h"
+#include "inode.h"
+#include "lru_cache.h"
+
+namespace cow_block
+{
+    struct dentry_key_t
+    {
+        uint64_t parent;
+        uint64_t name_hash;
+
+        bool operator==(const dentry_key_t &) const = default;
+    };
+
+    struct dentry_key_hash
+    {
+        size_t operator()(const dentry_key_t & key) const
+        {
+            return std::hash<uint64_t>()(key.parent * 0x9E3779B97F4A7C15ULL ^ key.name_hash);
+        }
+    };
+
+    /// In-memory inode and dentry caches in front of the metadata store, so resolving a path
+    /// that was resolved recently costs no tree descent at all.
+    /// Dentries are keyed by (parent inode, name hash) and remember failed lookups too, a
+    /// negative entry answers ENOENT without touching the store. Both caches are sharded LRUs.
+    /// The caches hold the current state of the file system, whoever changes an inode or a
+    /// directory updates or forgets the affected entries
+    class metadata_cache
+    {
+    public:
+        using inode_ptr = std::shared_ptr < const inode >;
+
+        struct statistics_t
+        {
+            uint64_t inode_hits;
+            uint64_t inode_misses;
+            uint64_t dentry_hits;
+            uint64_t negative_hits;
+            uint64_t dentry_misses;
+        };
+
+    private:
+        struct dentry_value_t
+        {
+            std::string name;                   /// tells names apart that share a hash
+            std::optional < dirent_t > entry;   /// nullopt for a negative entry
+        };
+
+        lru_cache < uint64_t, inode_ptr > inodes;
+        lru_cache < dentry_key_t, dentry_value_t, dentry_key_hash > dentries;
+
+        std::atomic < uint64_t > inode_hits = 0;
+        std::atomic < uint64_t > inode_misses = 0;
+        std::atomic < uint64_t > dentry_hits = 0;
+        std::atomic < uint64_t > negative_hits = 0;
+        std::atomic < uint64_t > dentry_misses = 0;
+
+    public:
+        /// @brief Create empty caches
+        /// @param inode_capacity Number of cached inodes
+        /// @param dentry_capacity Number of cached dentries, negative ones included
+        /// @param shard_count Number of lock shards of each cache
+        metadata_cache(uint64_t inode_capacity, uint64_t dentry_capacity, uint64_t shard_count = 64);
+
+        /// @brief Get an inode, loading and caching it on a miss
+        /// @param number Inode number
+        /// @param loader Loads the inode from the store, returns nullptr if absent
+        /// @return Inode, or nullptr if absent
+        [[nodiscard]] inode_ptr get_inode(uint64_t number, const std::function<inode_ptr()> & loader);
+
+        /// @brief Cache an inode after it changed
+        /// @param node Inode
+        void put_inode(inode_ptr node);
+
+        /// @brief Drop a cached inode
+        /// @param number Inode number
+        void forget_inode(uint64_t number);
+
+        /// @brief Look a name up, loading and caching the result, positive or negative, on a miss
+        /// @param parent Parent directory inode number
+        /// @param name Entry name
+        /// @param loader Looks the name up in the store
+        /// @return Entry, or nullopt if absent
+        [[nodiscard]] std::optional < dirent_t > lookup(uint64_t parent, const std::string & name,
+            const std::function<std::optional < dirent_t >()> & loader);
+
+        /// @brief Cache the result of a change to a directory
+        /// @param parent Parent directory inode number
+        /// @param name Entry name
+        /// @param entry Entry, or nullopt once the name is gone
+        void put_dentry(uint64_t parent, const std::string & name, std::optional < dirent_t > entry);
+
+        /// @brief Drop a cached dentry
+        /// @param parent Parent directory inode number
+        /// @param name Entry name
+        void forget_dentry(uint64_t parent, const std::string & name);
+
+        /// @brief Drop every cached dentry of a directory
+        /// @param parent Directory inode number
+        void forget_directory(uint64_t parent);
+
+        /// @brief Drop everything, e.g. after the whole tree was replaced
+        void clear();
+
+        /// @brief get statistics
+        /// @return Hit and miss counters
+        [[nodiscard]] statistics_t get_statistics() const;
+    };
+}
+
+#endif //CPPCOWOVERLAY_METADATA_CACHE_H
@@ -0,0 +1,85 @@
+#ifndef CPPCOWOVERLAY_READ_AHEAD_H
+#define CPPCOWOVERLAY_READ_AHEAD_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace cow_block
+{
+    /// Read-ahead for sequential readers of upper files. Every open file carries a stream_t;
+    /// advise() is told which blocks each read touched and decides what to load ahead of the
+    /// reader. A read starting where the previous one ended grows the window, initial_window
+    /// blocks first and doubling up to max_window, any other read tears the window down. Loads
+    /// are issued once the reader has used up half of what was loaded ahead, so each batch is
+    /// at least half a window and the reader never waits for one it is about to need.
+    ///
+    /// The batches themselves run on a few worker threads; when they fall behind, new batches
+    /// are dropped rather than queued, a late read-ahead is worth nothing
+    class read_ahead
+    {
+    public:
+        static constexpr uint64_t initial_window = 4;
+
+        /// Per open file state
+        struct stream_t
+        {
+            std::mutex mutex;
+            uint64_t next_block = 0;    /// block a sequential read would start at
+            uint64_t window = 0;        /// blocks to stay ahead of the reader, 0 when not sequential
+            uint64_t ahead = 0;         /// end of the blocks already loaded ahead
+        };
+
+        /// Blocks [first, end) to load
+        struct range_t
+        {
+            uint64_t first;
+            uint64_t end;
+        };
+
+    private:
+        const uint64_t max_window;
+        const uint64_t max_pending;
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::deque < std::function<void()> > jobs;
+        bool stop = false;
+        std::vector < std::thread > workers;
+
+        void work();
+
+    public:
+        /// @brief Start the workers
+        /// @param threads Worker threads, 0 disables read-ahead
+        /// @param max_window Largest window in blocks, 0 disables read-ahead
+        read_ahead(uint64_t threads, uint64_t max_window);
+
+        /// @brief Record a read and decide what to load ahead of it
+        /// @param stream State of the file read
+        /// @param first_block First block the read touched
+        /// @param end_block One past the last block the read touched
+        /// @return Blocks to load, nullopt if nothing is due
+        [[nodiscard]] std::optional < range_t > advise(stream_t & stream, uint64_t first_block, uint64_t end_block) const;
+
+        /// @brief Run a load on a worker, or drop it if the workers are behind
+        /// @param job Load to run, exceptions it throws are logged and dropped
+        void submit(std::function<void()> job);
+
+        /// @brief Whether read-ahead is on
+        /// @return false if it was configured away
+        [[nodiscard]] bool enabled() const;
+
+        ~read_ahead();
+        read_ahead(const read_ahead &) = delete;
+        read_ahead(read_ahead &&) = delete;
+        read_ahead &operator=(const read_ahead &) = delete;
+        read_ahead &operator=(read_ahead &&) = delete;
+    };
+}
+
+#endif //CPPCOWOVERLAY_READ_AHEAD_H
@@ -0,0 +1,88 @@
+#ifndef CPPCOWOVERLAY_RECOVERY_H
+#define CPPCOWOVERLAY_RECOVERY_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include "block.h"
+
+namespace cow_block
+{
+    def_except_with_trace(journal_replay_failed);
+
+    /// Crash recovery: validate the journal, find the last consistent commit and replay
+    /// every committed record. Records are partitioned by their target object (param1), so
+    /// updates to different objects are replayed in parallel while each object still sees
+    /// its own records in journal order
+    class journal_recovery
+    {
+    public:
+        using log_t = log_manager::log_t;
+        using replay_handler_t = std::function<void(const log_t &)>;
+
+        struct statistics_t
+        {
+            uint64_t records_replayed = 0;      /// committed records handed to a handler
+            uint64_t transactions_replayed = 0; /// number of commits found
+            uint64_t records_discarded = 0;     /// uncommitted or torn records dropped from the tail
+            uint64_t last_committed_sequence = 0;
+            uint64_t consistent_size = 0;       /// log size up to and including the last commit
+        };
+
+    private:
+        const log_manager & journal;
+        const block_manager & blocks;
+        std::map < uint64_t /* action */, replay_handler_t > handlers;
+
+        /// one queue per worker, records of one object always land in the same queue
+        struct partition_t
+        {
+            std::mutex mutex;
+            std::condition_variable cond;
+            std::deque < log_t > records;
+            bool finished = false;
+        };
+
+        using dispatcher_t = std::function<void(const log_t &)>;
+
+        void replay_record(const log_t & log) const;
+
+        /// @brief Start the workers, let producer dispatch records to them, then wait for all of them
+        /// @param producer Called once with the dispatcher that routes a record to its partition
+        /// @param thread_count Number of workers, 0 means one per core
+        void run_partitioned(const std::function<void(const dispatcher_t &)> & producer, uint64_t thread_count) const;
+
+    public:
+        /// @brief Initializes the recovery engine with the default block handlers
+        /// @param journal Journal to replay
+        /// @param blocks Block store the journal refers to
+        journal_recovery(const log_manager & journal, const block_manager & blocks);
+
+        /// @brief Register (or replace) the replay handler for an action
+        /// @param action Log action
+        /// @param handler Handler, called from worker threads
+        void register_handler(uint64_t action, replay_handler_t handler);
+
+        /// @brief Replay records that are already known to be committed, e.g. a batch shipped to a standby
+        /// @param records Records in journal order, LOG_COMMIT records are skipped
+        /// @param thread_count Number of replay workers, 0 means one per core
+        void apply(const std::vector < log_t > & records, uint64_t thread_count = 0) const;
+
+        /// @brief Validate and replay the journal
+        /// @param thread_count Number of replay workers, 0 means one per core
+        /// @param read_only Do not discard the inconsistent tail from the log
+        /// @return Replay statistics
+        statistics_t replay(uint64_t thread_count = 0, bool read_only = false);
+
+        ~journal_recovery() = default;
+        journal_recovery(const journal_recovery &) = delete;
+        journal_recovery(journal_recovery &&) = delete;
+        journal_recovery &operator=(const journal_recovery &) = delete;
+        journal_recovery &operator=(journal_recovery &&) = delete;
+    };
+}
+
+#endif //CPPCOWOVERLAY_RECOVERY_H
@@ -0,0 +1,70 @@
+#ifndef CPPCOWOVERLAY_WRITE_POLICY_H
+#define CPPCOWOVERLAY_WRITE_POLICY_H
+
+#include <cstdint>
+#include <vector>
+
+namespace cow_block
+{
+    /// Decides per write stream (the writes to one file between opening and closing it) whether
+    /// blocks are worth the full store path, i.e. looking the block up and trying to compress it.
+    /// Encrypted or already compressed data (media, backups) never hits either.
+    ///
+    /// A stream starts out probing: every block takes the full path and its outcome is counted,
+    /// together with the entropy of a sample of its bytes. After probe_blocks blocks, a stream
+    /// that found almost no stored block, almost never compressed and looks random switches to
+    /// bypass, where blocks are stored as they are. Every reprobe_blocks bypassed blocks it goes
+    /// back to probing, data may change character within a file
+    class write_policy
+    {
+    public:
+        static constexpr uint64_t max_hit_ratio = 16;       /// bypass below one hit in this many blocks
+        static constexpr double min_entropy = 7.5;          /// bits per byte, random bytes sample at about 7.8
+        static constexpr uint64_t entropy_samples = 1024;
+
+        /// Per stream state
+        struct stream_t
+        {
+            bool bypass = false;
+            uint64_t blocks = 0;        /// probed blocks while probing, bypassed blocks while bypassing
+            uint64_t dedup_hits = 0;    /// probed blocks that were already stored
+            uint64_t compress_hits = 0; /// probed blocks stored compressed
+            double entropy = 0;         /// sum over the probed blocks
+        };
+
+    private:
+        const uint64_t probe_blocks;
+        const uint64_t reprobe_blocks;
+
+    public:
+        /// @brief Set up the policy
+        /// @param probe_blocks Blocks a stream probes before deciding, 0 never bypasses
+        /// @param reprobe_blocks Blocks a stream bypasses before probing again
+        write_policy(uint64_t probe_blocks, uint64_t reprobe_blocks);
+
+        /// @brief Decide how the next block of a stream is stored
+        /// @param stream State of the stream
+        /// @return true to store it as it is, false to take the full path and record() the outcome
+        [[nodiscard]] bool bypass(stream_t & stream) const;
+
+        /// @brief Count the outcome of a block stored through the full path
+        /// @param stream State of the stream
+        /// @param data Block content
+        /// @param existed The block was already stored
+        /// @param compressed The block was stored compressed
+        void record(stream_t & stream, const std::vector < uint8_t > & data, bool existed, bool compressed) const;
+
+        /// @brief Estimate the Shannon entropy of a block from entropy_samples evenly spaced bytes
+        /// @param data Block content
+        /// @return Bits per byte, 0 to 8
+        [[nodiscard]] static double sample_entropy(const std::vector < uint8_t > & data);
+
+        ~write_policy() = default;
+        write_policy(const write_policy &) = delete;
+        write_policy(write_policy &&) = delete;
+        write_policy &operator=(const write_policy &) = delete;
+        write_policy &operator=(write_policy &&) = delete;
+    };
+}
+
+#endif //CPPCOWOVERLAY_WRITE_POLICY_H
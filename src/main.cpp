@@ -28,6 +28,11 @@ int main(int argc, char *argv[])
             return mount_main(argc, argv);
         }
 
+        if (redirect_name == "standby")
+        {
+            return standby_main(argc, argv);
+        }
+
         throw std::invalid_argument("Unknown command");
     }
     catch (std::exception & e)
@@ -2,6 +2,9 @@
 #include "log.hpp"
 #include "layer_info.h"
 #include "configuration.h"
+#include "recovery.h"
+#include "journal_shipping.h"
+#include "fuse_server.h"
 
 int mount_main(int argc, char**argv)
 {
@@ -16,52 +19,79 @@ int mount_main(int argc, char**argv)
 
         const std::string config_path = argv[1];
         const std::string mount_point = argv[2];
-        LayerInfoType layer_global_readonly_info {};
         info_log("Using configuration ", config_path, ", mounting at ", mount_point, "\n");
-        for (const configuration config(config_path);
-            const auto & [section, keys] : config)
+        const LayerInfoType layer_global_readonly_info = load_layer_info(config_path);
+
+        const cow_block::block_manager blocks(layer_global_readonly_info.path_to_data_blocks,
+            layer_global_readonly_info.block_size, layer_global_readonly_info.journal_mode);
+        cow_block::log_manager journal(layer_global_readonly_info.log_dir, layer_global_readonly_info.journal_mode);
+        journal.set_commit_barrier([&blocks] { blocks.flush(); });
+        cow_block::journal_recovery recovery(journal, blocks);
+        const auto [records_replayed, transactions_replayed, records_discarded, last_committed_sequence, consistent_size]
+            = recovery.replay(0, layer_global_readonly_info.read_only);
+        info_log("Journal replayed: ", transactions_replayed, " transactions, ", records_replayed, " records, ",
+            records_discarded, " discarded, last commit #", last_committed_sequence, "\n");
+
+        std::unique_ptr < cow_block::journal_shipper > shipper;
+        if (const auto & standby = layer_global_readonly_info.standby;
+            !layer_global_readonly_info.read_only
+            && (!standby.socket_path.empty() || !standby.path_to_data_blocks.empty()))
         {
-            debug_log("Checking section ", section, "...\n");
-            if (section != "general")
+            std::unique_ptr < cow_block::ship_target > target;
+            if (!standby.socket_path.empty())
             {
-                warning_log("Section \"", section, "\" unknown, skipped\n");
-                continue;
+                info_log("Shipping journal to standby at ", standby.socket_path, "\n");
+                target = std::make_unique<cow_block::socket_target>(standby.socket_path);
             }
-
-            for (const auto & [key, val] : keys)
+            else
             {
-                cow_assert_wm(val.size() == 1, InvalidConfiguration, "Faulty definition of key \"" + key + "\"")
-                debug_log("Entry: Section \"", section, "\": \"", key, "\": \"", val, "\"\n");
-                if (key == "log")
-                {
-                    layer_global_readonly_info.log_dir = val.front();
-                }
-                else if (key == "data")
-                {
-                    layer_global_readonly_info.path_to_data_blocks = val.front();
-                }
-                else if (key == "block_size")
-                {
-                    layer_global_readonly_info.block_size = std::strtoull(val.front().c_str(), nullptr, 10);
-                }
-                else if (key == "root")
-                {
-                    layer_global_readonly_info.root_inode_name = val.front();
-                }
-                else
-                {
-                    warning_log("Unknown key \"" + key + "\", skipped\n");
-                }
+                info_log("Shipping journal to standby directory ", standby.path_to_data_blocks, "\n");
+                target = std::make_unique<cow_block::directory_target>(
+                    standby.path_to_data_blocks, standby.log_dir, layer_global_readonly_info.block_size);
             }
+
+            shipper = std::make_unique<cow_block::journal_shipper>(journal, blocks, std::move(target),
+                standby.batch_records, std::chrono::milliseconds(standby.max_delay_ms), standby.max_batch_bytes);
+            shipper->start();
         }
 
-        cow_assert_wm(
-            !(layer_global_readonly_info.block_size == 0
-                || layer_global_readonly_info.root_inode_name.empty()
-                || layer_global_readonly_info.log_dir.empty()
-                || layer_global_readonly_info.path_to_data_blocks.empty()),
-            InvalidConfiguration, "Faulty configuration!");
-        return 0;
+        // declared after the shipper so it is unmounted, and its last changes committed, first
+        cow_block::cow_filesystem filesystem(blocks, journal, cow_block::cow_filesystem::options_t {
+            .lower_dirs = layer_global_readonly_info.lower_dirs,
+            .lower_cache_entries = layer_global_readonly_info.lower_cache_entries,
+            .fingerprint_path = layer_global_readonly_info.fingerprint_path,
+            .fingerprint_xattr = layer_global_readonly_info.fingerprint_xattr,
+            .inline_threshold = layer_global_readonly_info.inline_threshold,
+            .inode_cache_entries = layer_global_readonly_info.inode_cache_entries,
+            .dentry_cache_entries = layer_global_readonly_info.dentry_cache_entries,
+            .block_cache_entries = layer_global_readonly_info.block_cache_entries,
+            .read_ahead_blocks = layer_global_readonly_info.read_ahead_blocks,
+            .read_ahead_threads = layer_global_readonly_info.read_ahead_threads,
+            .write_buffer_blocks = layer_global_readonly_info.write_buffer_blocks,
+            .block_size_rules = layer_global_readonly_info.block_size_rules,
+            .large_block_size = layer_global_readonly_info.large_block_size,
+            .large_file_size = layer_global_readonly_info.large_file_size,
+            .bypass_probe_blocks = layer_global_readonly_info.bypass_probe_blocks,
+            .bypass_reprobe_blocks = layer_global_readonly_info.bypass_reprobe_blocks,
+            .commit_interval = std::chrono::milliseconds(layer_global_readonly_info.commit_interval_ms),
+            .read_only = layer_global_readonly_info.read_only,
+            .initial_root = cow_block::block_id_from_name(layer_global_readonly_info.root_inode_name),
+        });
+
+        cow_block::fuse_server server(filesystem, mount_point, cow_block::fuse_server::options_t {
+            .threads = layer_global_readonly_info.fuse_threads,
+            .channels = layer_global_readonly_info.fuse_channels,
+            .transport = layer_global_readonly_info.fuse_transport,
+            .uring_queue_depth = layer_global_readonly_info.fuse_uring_depth,
+            .max_io_size = layer_global_readonly_info.fuse_max_io,
+            .allow_other = layer_global_readonly_info.allow_other,
+            .passthrough = layer_global_readonly_info.fuse_passthrough,
+            .splice = layer_global_readonly_info.fuse_splice,
+            .read_only = layer_global_readonly_info.read_only,
+            .entry_timeout = layer_global_readonly_info.fuse_cache_timeout,
+            .attr_timeout = layer_global_readonly_info.fuse_cache_timeout,
+        });
+        return server.run(*argv) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
     }
     catch (const std::exception & e)
     {
@@ -0,0 +1,47 @@
+#include <csignal>
+#include "main_redirect.h"
+#include "log.hpp"
+#include "layer_info.h"
+#include "journal_shipping.h"
+
+namespace
+{
+    std::atomic_bool standby_stop = false;
+}
+
+int standby_main(int argc, char**argv)
+{
+    try
+    {
+        info_log(*argv, ": build ID ", BUILD_ID, ", built on ", BUILD_TIME, ", version ", VERSION, "\n");
+        if (argc != 3)
+        {
+            error_log(*argv, " [Configuration] [Socket Path]\n");
+            return EXIT_FAILURE;
+        }
+
+        const std::string config_path = argv[1];
+        const std::string socket_path = argv[2];
+        info_log("Using configuration ", config_path, ", listening on ", socket_path, "\n");
+        const LayerInfoType layer_global_readonly_info = load_layer_info(config_path);
+
+        cow_block::standby_store store(layer_global_readonly_info.path_to_data_blocks,
+            layer_global_readonly_info.log_dir, layer_global_readonly_info.block_size);
+        cow_block::standby_receiver receiver(store, socket_path);
+        std::signal(SIGINT, [](int) { standby_stop = true; });
+        std::signal(SIGTERM, [](int) { standby_stop = true; });
+        receiver.serve(standby_stop);
+        info_log("Standby stopped at commit #", store.last_sequence(), "\n");
+        return 0;
+    }
+    catch (const std::exception & e)
+    {
+        error_log(*argv, ": ", e.what(), "\n");
+        return EXIT_FAILURE;
+    }
+    catch (...)
+    {
+        error_log(*argv, ": Unknown exception occurred\n");
+        return EXIT_FAILURE;
+    }
+}
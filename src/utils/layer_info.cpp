@@ -0,0 +1,224 @@
+#include "layer_info.h"
+#include "configuration.h"
+#include "log.hpp"
+
+namespace
+{
+    bool parse_bool(const std::string & value)
+    {
+        return value == "true" || value == "yes" || value == "1";
+    }
+}
+
+LayerInfoType load_layer_info(const std::string & config_path)
+{
+    LayerInfoType layer_global_readonly_info {};
+    for (const configuration config(config_path);
+        const auto & [section, keys] : config)
+    {
+        debug_log("Checking section ", section, "...\n");
+        if (section != "general" && section != "standby")
+        {
+            warning_log("Section \"", section, "\" unknown, skipped\n");
+            continue;
+        }
+
+        for (const auto & [key, val] : keys)
+        {
+            // lower (one line per layer, topmost first) and block_size_rule are the keys that may repeat
+            cow_assert_wm(val.size() == 1 || (section == "general" && (key == "lower" || key == "block_size_rule")),
+                InvalidConfiguration, "Faulty definition of key \"" + key + "\"")
+            debug_log("Entry: Section \"", section, "\": \"", key, "\": \"", val, "\"\n");
+            if (section == "standby")
+            {
+                auto & standby = layer_global_readonly_info.standby;
+                if (key == "data")
+                {
+                    standby.path_to_data_blocks = val.front();
+                }
+                else if (key == "log")
+                {
+                    standby.log_dir = val.front();
+                }
+                else if (key == "socket")
+                {
+                    standby.socket_path = val.front();
+                }
+                else if (key == "batch_records")
+                {
+                    standby.batch_records = std::strtoull(val.front().c_str(), nullptr, 10);
+                }
+                else if (key == "max_delay_ms")
+                {
+                    standby.max_delay_ms = std::strtoull(val.front().c_str(), nullptr, 10);
+                }
+                else if (key == "max_batch_bytes")
+                {
+                    standby.max_batch_bytes = std::strtoull(val.front().c_str(), nullptr, 10);
+                }
+                else
+                {
+                    warning_log("Unknown key \"" + key + "\", skipped\n");
+                }
+            }
+            else if (key == "log")
+            {
+                layer_global_readonly_info.log_dir = val.front();
+            }
+            else if (key == "data")
+            {
+                layer_global_readonly_info.path_to_data_blocks = val.front();
+            }
+            else if (key == "block_size")
+            {
+                layer_global_readonly_info.block_size = std::strtoull(val.front().c_str(), nullptr, 10);
+            }
+            else if (key == "journal_mode")
+            {
+                layer_global_readonly_info.journal_mode = cow_block::journal_mode_from_string(val.front());
+            }
+            else if (key == "read_only")
+            {
+                layer_global_readonly_info.read_only = parse_bool(val.front());
+            }
+            else if (key == "inline_threshold")
+            {
+                layer_global_readonly_info.inline_threshold = std::strtoull(val.front().c_str(), nullptr, 10);
+            }
+            else if (key == "inode_cache")
+            {
+                layer_global_readonly_info.inode_cache_entries = std::strtoull(val.front().c_str(), nullptr, 10);
+            }
+            else if (key == "dentry_cache")
+            {
+                layer_global_readonly_info.dentry_cache_entries = std::strtoull(val.front().c_str(), nullptr, 10);
+            }
+            else if (key == "block_cache")
+            {
+                layer_global_readonly_info.block_cache_entries = std::strtoull(val.front().c_str(), nullptr, 10);
+            }
+            else if (key == "read_ahead_blocks")
+            {
+                layer_global_readonly_info.read_ahead_blocks = std::strtoull(val.front().c_str(), nullptr, 10);
+            }
+            else if (key == "read_ahead_threads")
+            {
+                layer_global_readonly_info.read_ahead_threads = std::strtoull(val.front().c_str(), nullptr, 10);
+            }
+            else if (key == "write_buffer_blocks")
+            {
+                layer_global_readonly_info.write_buffer_blocks = std::strtoull(val.front().c_str(), nullptr, 10);
+            }
+            else if (key == "block_size_rule")
+            {
+                for (const auto & rule : val)
+                {
+                    const auto colon = rule.rfind(':');
+                    cow_assert_wm(colon != std::string::npos && colon != 0, InvalidConfiguration,
+                        "\"block_size_rule\" must be <name suffix>:<block size>, got \"" + rule + "\"")
+                    layer_global_readonly_info.block_size_rules.emplace_back(rule.substr(0, colon),
+                        std::strtoull(rule.c_str() + colon + 1, nullptr, 10));
+                }
+            }
+            else if (key == "large_block_size")
+            {
+                layer_global_readonly_info.large_block_size = std::strtoull(val.front().c_str(), nullptr, 10);
+            }
+            else if (key == "large_file_size")
+            {
+                layer_global_readonly_info.large_file_size = std::strtoull(val.front().c_str(), nullptr, 10);
+            }
+            else if (key == "bypass_probe_blocks")
+            {
+                layer_global_readonly_info.bypass_probe_blocks = std::strtoull(val.front().c_str(), nullptr, 10);
+            }
+            else if (key == "bypass_reprobe_blocks")
+            {
+                layer_global_readonly_info.bypass_reprobe_blocks = std::strtoull(val.front().c_str(), nullptr, 10);
+            }
+            else if (key == "lower")
+            {
+                layer_global_readonly_info.lower_dirs = val;
+            }
+            else if (key == "lower_cache")
+            {
+                layer_global_readonly_info.lower_cache_entries = std::strtoull(val.front().c_str(), nullptr, 10);
+            }
+            else if (key == "fingerprint_cache")
+            {
+                layer_global_readonly_info.fingerprint_path = val.front();
+            }
+            else if (key == "fingerprint_xattr")
+            {
+                layer_global_readonly_info.fingerprint_xattr = parse_bool(val.front());
+            }
+            else if (key == "commit_interval_ms")
+            {
+                layer_global_readonly_info.commit_interval_ms = std::strtoull(val.front().c_str(), nullptr, 10);
+            }
+            else if (key == "fuse_threads")
+            {
+                layer_global_readonly_info.fuse_threads = std::strtoull(val.front().c_str(), nullptr, 10);
+            }
+            else if (key == "fuse_channels")
+            {
+                layer_global_readonly_info.fuse_channels = cow_block::fuse_channel_mode_from_string(val.front());
+            }
+            else if (key == "fuse_transport")
+            {
+                layer_global_readonly_info.fuse_transport = cow_block::fuse_transport_from_string(val.front());
+            }
+            else if (key == "fuse_uring_depth")
+            {
+                layer_global_readonly_info.fuse_uring_depth = std::strtoull(val.front().c_str(), nullptr, 10);
+            }
+            else if (key == "fuse_max_io")
+            {
+                layer_global_readonly_info.fuse_max_io = std::strtoull(val.front().c_str(), nullptr, 10);
+            }
+            else if (key == "fuse_passthrough")
+            {
+                layer_global_readonly_info.fuse_passthrough = parse_bool(val.front());
+            }
+            else if (key == "fuse_splice")
+            {
+                layer_global_readonly_info.fuse_splice = parse_bool(val.front());
+            }
+            else if (key == "fuse_cache_timeout")
+            {
+                layer_global_readonly_info.fuse_cache_timeout = std::strtod(val.front().c_str(), nullptr);
+            }
+            else if (key == "allow_other")
+            {
+                layer_global_readonly_info.allow_other = parse_bool(val.front());
+            }
+            else if (key == "root")
+            {
+                layer_global_readonly_info.root_inode_name = val.front();
+            }
+            else
+            {
+                warning_log("Unknown key \"" + key + "\", skipped\n");
+            }
+        }
+    }
+
+    cow_assert_wm(
+        !(layer_global_readonly_info.block_size == 0
+            || layer_global_readonly_info.root_inode_name.empty()
+            || layer_global_readonly_info.log_dir.empty()
+            || layer_global_readonly_info.path_to_data_blocks.empty()),
+        InvalidConfiguration, "Faulty configuration!");
+
+    cow_assert_wm(layer_global_readonly_info.commit_interval_ms != 0,
+        InvalidConfiguration, "\"commit_interval_ms\" must be positive");
+    cow_assert_wm(layer_global_readonly_info.fuse_cache_timeout >= 0,
+        InvalidConfiguration, "\"fuse_cache_timeout\" cannot be negative");
+
+    const auto & standby = layer_global_readonly_info.standby;
+    cow_assert_wm(standby.path_to_data_blocks.empty() == standby.log_dir.empty(),
+        InvalidConfiguration, "Standby directory target needs both \"data\" and \"log\"");
+    cow_assert_wm(standby.socket_path.empty() || standby.path_to_data_blocks.empty(),
+        InvalidConfiguration, "Standby target is either a directory or a socket, not both");
+    return layer_global_readonly_info;
+}